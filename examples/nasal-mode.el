@@ -51,10 +51,12 @@
 		   "forindex" "func" "if" "nil" "or" "return" "var" "while"
 		   "true" "false")
 		 'words)
-     (list (regexp-opt '("append" "bind" "call" "caller" "chr" "closure"
-			 "cmp" "compile" "contains" "delete" "die" "find"
-			 "int" "keys" "num" "pop" "rand" "setsize" "size"
-			 "split" "sprintf" "streq" "substr" "subvec" "typeof")
+     (list (regexp-opt '("all" "any" "append" "bind" "call" "caller" "chr"
+			 "closure" "cmp" "compile" "contains" "delete" "die"
+			 "filter" "find" "int" "keys" "map" "num" "pop" "rand"
+			 "reduce" "setsize" "shift" "size" "sort" "sortby"
+			 "split" "sprintf" "streq" "substr" "subvec" "typeof"
+			 "unshift")
 		       'words)
 	   1 'font-lock-builtin-face)))
   "Nasal-specific syntax to be hilighted.")
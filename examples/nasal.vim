@@ -54,9 +54,9 @@ syn keyword nasalOperator		and or
 syn match   nasalFoo			"\~"
 
 syn match   nasalFunction		display "\<contains\>"
-syn keyword nasalFunction		size keys append pop setsize subvec delete int num streq substr
+syn keyword nasalFunction		size keys append pop shift unshift setsize map filter reduce any all subvec delete int num streq substr
 syn keyword nasalFunction		chr typeof compile call die sprintf caller closure find cmp
-syn keyword nasalFunction		split rand bind sort ghosttype id
+syn keyword nasalFunction		split rand bind sort sortby ghosttype id
 
 " math lib
 syn match   nasalFunction		"\<math\.\(sin\|cos\|exp\|ln\|sqrt\|atan2\)\>"
@@ -125,6 +125,22 @@ static int checkVec(naContext ctx, naRef vec, naRef idx)
     return i;
 }
 
+static int checkNumVec(naContext ctx, naRef vec, naRef idx)
+{
+    int i = (int)numify(ctx, idx);
+
+    if (i < 0) {
+        i += naNumVec_size(vec);
+    }
+
+    if (i < 0 || i >= naNumVec_size(vec)) {
+        naRuntimeError(ctx, "numvec index %d out of bounds (size: %d)",
+                       i, naNumVec_size(vec));
+    }
+
+    return i;
+}
+
 static int checkStr(naContext ctx, naRef str, naRef idx)
 {
     int i = (int)numify(ctx, idx);
@@ -153,6 +169,8 @@ static naRef containerGet(naContext ctx, naRef box, naRef key)
         naHash_get(box, key, &result);
     } else if (IS_VEC(box)) {
         result = naVec_get(box, checkVec(ctx, box, key));
+    } else if (IS_NUMVEC(box)) {
+        result = naNum(naNumVec_get(box, checkNumVec(ctx, box, key)));
     } else if (IS_STR(box)) {
         result = naNum((unsigned char)naStr_data(box)[checkStr(ctx, box, key)]);
     } else {
@@ -170,12 +188,16 @@ static void containerSet(naContext ctx, naRef box, naRef key, naRef val)
         naHash_set(box, key, val);
     } else if(IS_VEC(box)) {
         naVec_set(box, checkVec(ctx, box, key), val);
+    } else if(IS_NUMVEC(box)) {
+        naNumVec_set(box, checkNumVec(ctx, box, key), numify(ctx, val));
     } else if(IS_STR(box)) {
         if(PTR(box).str->hashcode) {
             ERR(ctx, "cannot change immutable string");
         }
 
-        naStr_data(box)[checkStr(ctx, box, key)] = (char)numify(ctx, val);
+        // numify() first: naStr_data() resets the string's number cache
+        char ch = (char)numify(ctx, val);
+        naStr_data(box)[checkStr(ctx, box, key)] = ch;
     } else {
         ERR(ctx, "insert into non-container");
     }
@@ -198,6 +220,7 @@ static void initContext(naContext c)
 {
     int i;
     c->fTop = c->opTop = c->markTop = 0;
+    c->fBase = 0;
     for(i=0; i<NUM_NASAL_TYPES; i++)
         c->nfree[i] = 0;
 
@@ -223,6 +246,9 @@ static void initGlobals()
     globals->sem = naNewSem();
     globals->lock = naNewLock();
 
+    // Must happen before the first string gets hashed
+    naiHash_init();
+
     globals->allocCount = 256; // reasonable starting value
     for(i=0; i<NUM_NASAL_TYPES; i++)
         naGC_init(&(globals->pools[i]), i);
@@ -269,6 +295,7 @@ naContext naNewContext()
         UNLOCK();
         // REVIEW: Memory Leak - 8,184 bytes in 1 blocks are still reachable
         c = (naContext)naAlloc(sizeof(struct Context));
+        c->fmtcache = 0;
         initTemps(c);
         initContext(c);
         LOCK();
@@ -412,6 +439,8 @@ static char* NasalRefDescription(naRef val)
         return dosprintf("scalar");
     } else if (naIsVector(val)) {
         return dosprintf("vector");
+    } else if (naIsNumVec(val)) {
+        return dosprintf("numvec");
     } else if (naIsHash(val)) {
         return dosprintf("hash");
     } else if (naIsFunc(val)) {
@@ -497,11 +526,12 @@ static naRef evalEquality(int op, naRef ra, naRef rb)
 static naRef evalCat(naContext ctx, naRef l, naRef r)
 {
     if (IS_VEC(l) && IS_VEC(r)) {
-        int i, ls = naVec_size(l), rs = naVec_size(r);
-        naRef v = naNewVector(ctx);
+        int ls = naVec_size(l), rs = naVec_size(r);
+        naRef v = naNewVector(ctx), *a;
         naVec_setsize(ctx, v, ls + rs);
-        for(i=0; i<ls; i+=1) naVec_set(v, i, naVec_get(l, i));
-        for(i=0; i<rs; i+=1) naVec_set(v, i+ls, naVec_get(r, i));
+        a = PTR(v).vec->rec->array;
+        if(ls) memcpy(a, PTR(l).vec->rec->array, ls * sizeof(naRef));
+        if(rs) memcpy(a + ls, PTR(r).vec->rec->array, rs * sizeof(naRef));
         return v;
     } else {
         naRef a = stringify(ctx, l);
@@ -632,7 +662,13 @@ static const char* getMember_r(naContext ctx, naRef obj, naRef field, naRef* out
             return 0;
         }
     } else if (IS_STR(obj) ) {
-        return getMember_r(ctx, getStringMethods(ctx), field, out, count);
+        // The methods hash itself is the usual answer, so look there
+        // before recursing for its parents
+        p = getStringMethods(ctx);
+        if (IS_HASH(p) && naHash_get(p, field, out)) {
+            return "";
+        }
+        return getMember_r(ctx, p, field, out, count);
     } else {
         return "non-objects have no members";
     }
@@ -691,6 +727,73 @@ int naMember_get(naContext ctx, naRef obj, naRef field, naRef* out)
     return err && !err[0];
 }
 
+// Hashes are walked in place, with a cursor in the index slot: the
+// entry position in the low 32 bits, and above them (one more than)
+// the hash's modification count when the loop started, so that adding
+// or removing keys inside the loop can be caught.  Setting the values
+// of existing keys is fine.
+static int eachHash(naContext ctx, naRef* key, naRef* val)
+{
+    naRef hash = ctx->opStack[ctx->opTop-2];
+    uint64_t cur = (uint64_t)ctx->opStack[ctx->opTop-1].num;
+    uint64_t stamp = (PTR(hash).hash->mods & 0xfffff) + 1;
+    int pos = (int)(cur & 0xffffffff);
+
+    if (cur && (cur >> 32) != stamp) {
+        ERR(ctx, "hash modified during foreach");
+    }
+
+    if (!naiHash_next(hash, &pos, key, val)) {
+        return 0;
+    }
+
+    ctx->opStack[ctx->opTop-1].num = (double)((stamp << 32) | (uint64_t)pos);
+    return 1;
+}
+
+// OP_EACH2 is the two-variable foreach: it pushes the value and then
+// the key (or vector index), or just an end token when done.
+static void evalEach2(naContext ctx)
+{
+    int idx = (int)(ctx->opStack[ctx->opTop-1].num);
+    naRef vec = ctx->opStack[ctx->opTop-2];
+    naRef key, val;
+
+    if (IS_HASH(vec)) {
+        if (eachHash(ctx, &key, &val)) {
+            PUSH(val);
+            PUSH(key);
+        } else {
+            PUSH(endToken());
+        }
+        return;
+    }
+
+    if (IS_NUMVEC(vec)) {
+        if (idx >= naNumVec_size(vec)) {
+            PUSH(endToken());
+            return;
+        }
+        ctx->opStack[ctx->opTop-1].num = idx+1;
+        PUSH(naNum(naNumVec_get(vec, idx)));
+        PUSH(naNum(idx));
+        return;
+    }
+
+    if (!IS_VEC(vec)) {
+        ERR(ctx, "foreach enumeration of non-vector or hash");
+    }
+
+    if (!PTR(vec).vec->rec || idx >= PTR(vec).vec->rec->size) {
+        PUSH(endToken());
+        return;
+    }
+
+    ctx->opStack[ctx->opTop-1].num = idx+1; // modify in place
+    PUSH(naVec_get(vec, idx));
+    PUSH(naNum(idx));
+}
+
 // OP_EACH works like a vector get, except that it leaves the vector
 // and index on the stack, increments the index after use, and
 // pushes a nil if the index is beyond the end.
@@ -698,6 +801,22 @@ static void evalEach(naContext ctx, int useIndex)
 {
     int idx = (int)(ctx->opStack[ctx->opTop-1].num);
     naRef vec = ctx->opStack[ctx->opTop-2];
+    naRef key, val;
+
+    if (IS_HASH(vec) && !useIndex) {
+        PUSH(eachHash(ctx, &key, &val) ? key : endToken());
+        return;
+    }
+
+    if (IS_NUMVEC(vec)) {
+        if (idx >= naNumVec_size(vec)) {
+            PUSH(endToken());
+            return;
+        }
+        ctx->opStack[ctx->opTop-1].num = idx+1;
+        PUSH(naNum(useIndex ? idx : naNumVec_get(vec, idx)));
+        return;
+    }
 
     if (!IS_VEC(vec)) {
         ERR(ctx, "foreach enumeration of non-vector");
@@ -762,13 +881,14 @@ static void evalSlice2(naContext ctx, naRef src, naRef dst,
     }
 
     end = vbound(ctx, src, endr, 1);
-
-    for(i = vbound(ctx, src, start, 0); i<=end; i++)
-        naVec_append(dst, naVec_get(src, i));
+    i = vbound(ctx, src, start, 0);
+    naiVec_appendrange(ctx, dst, src, i, end - i + 1, 1);
 }
 
 #define ARG() BYTECODE(cd)[f->ip++]
 #define CONSTARG() cd->constants[ARG()]
+#define CONSTARGW() (f->ip += 2, cd->constants[BYTECODE(cd)[f->ip-2] \
+                                  | (unsigned)BYTECODE(cd)[f->ip-1] << 16])
 #define POP() ctx->opStack[--ctx->opTop]
 #define STK(n) (ctx->opStack[ctx->opTop-(n)])
 #define SETFRAME(F) f = (F); cd = PTR(PTR(f->func).func->code).code;
@@ -838,6 +958,11 @@ static naRef run(naContext ctx)
             if(IS_CODE(a)) a = bindFunction(ctx, f, a);
             PUSH(a);
             break;
+        case OP_PUSHCONSTW:
+            a = CONSTARGW();
+            if(IS_CODE(a)) a = bindFunction(ctx, f, a);
+            PUSH(a);
+            break;
         case OP_PUSHONE:
             PUSH(naNum(1));
             break;
@@ -857,8 +982,11 @@ static naRef run(naContext ctx)
             naVec_append(STK(2), STK(1));
             ctx->opTop--;
             break;
-        case OP_NEWHASH:
+        case OP_NEWHASH: // immediate arg is the literal's size
             PUSH(naNewHash(ctx));
+            if ((arg = ARG())) {
+                naHash_reserve(STK(1), arg);
+            }
             break;
         case OP_HAPPEND:
             naHash_set(STK(3), STK(2), STK(1));
@@ -869,6 +997,11 @@ static naRef run(naContext ctx)
             getLocal(ctx, f, &a, &b);
             PUSH(b);
             break;
+        case OP_LOCALW:
+            a = CONSTARGW();
+            getLocal(ctx, f, &a, &b);
+            PUSH(b);
+            break;
         case OP_SETSYM:
             setSymbol(f, STK(1), STK(2));
             ctx->opTop--;
@@ -880,6 +1013,9 @@ static naRef run(naContext ctx)
         case OP_MEMBER:
             getMember(ctx, STK(1), CONSTARG(), &STK(1), 64);
             break;
+        case OP_MEMBERW:
+            getMember(ctx, STK(1), CONSTARGW(), &STK(1), 64);
+            break;
         case OP_SETMEMBER:
             setMember(ctx, STK(2), STK(1), STK(3));
             break;
@@ -950,7 +1086,7 @@ static naRef run(naContext ctx)
                 naFreeContext(ctx->callChild);
             }
 
-            if (--ctx->fTop <= 0) {
+            if (--ctx->fTop <= ctx->fBase) {
                 return a;
             }
 
@@ -964,6 +1100,9 @@ static naRef run(naContext ctx)
         case OP_INDEX:
             evalEach(ctx, 1);
             break;
+        case OP_EACH2:
+            evalEach2(ctx);
+            break;
         case OP_MARK: // save stack state (e.g. "setjmp")
             if (ctx->markTop >= MAX_MARK_DEPTH) {
                 ERR(ctx, "mark stack overflow");
@@ -992,6 +1131,7 @@ static naRef run(naContext ctx)
 }
 #undef POP
 #undef CONSTARG
+#undef CONSTARGW
 #undef STK
 #undef FIXFRAME
 
@@ -1051,7 +1191,7 @@ int naGetLine(naContext ctx, int frame)
     if (IS_FUNC(f->func) && IS_CODE(PTR(f->func).func->code)) {
 
         struct naCode* c = PTR(PTR(f->func).func->code).code;
-        unsigned short* p = LINEIPS(c) + c->nLines - 2;
+        unsigned int* p = LINEIPS(c) + c->nLines - 2;
 
         while(p >= LINEIPS(c) && p[0] > f->ip)
             p -= 2;
@@ -1160,6 +1300,7 @@ naRef naCall(naContext ctx, naRef func, int argc, naRef* args,
 
     ctx->opTop = ctx->markTop = 0;
     ctx->fTop = 1;
+    ctx->fBase = 0;
     ctx->fStack[0].func = func;
 
     ctx->fStack[0].locals = locals;
@@ -1177,6 +1318,52 @@ naRef naCall(naContext ctx, naRef func, int argc, naRef* args,
     return result;
 }
 
+naRef naiCallInline(naContext ctx, naRef func, int argc, naRef* args)
+{
+    int fbase = ctx->fBase, opframe = ctx->opFrame, bp = ctx->opTop;
+    struct naCCode* ccode;
+    struct Frame* f;
+    naRef result;
+
+    if (IS_CCODE(PTR(func).func->code)) {
+        ccode = PTR(PTR(func).func->code).ccode;
+        return ccode->fptru
+             ? (*ccode->fptru)(ctx, naNil(), argc, args, ccode->user_data)
+             : (*ccode->fptr)(ctx, naNil(), argc, args);
+    }
+
+    if (ctx->fTop >= MAX_RECURSION) {
+        ERR(ctx, "Call stack overflow, exceeded maximum recursion depth.");
+    }
+
+    f = &(ctx->fStack[ctx->fTop]);
+    f->locals = naNewHash(ctx);
+    f->func = func;
+    f->ip = 0;
+    f->bp = bp;
+    setupArgs(ctx, f, args, argc);
+
+    ctx->fBase = ctx->fTop++;
+    result = run(ctx);
+
+    // Calls made by func have clobbered the C function's opFrame
+    ctx->fBase = fbase;
+    ctx->opFrame = opframe;
+    ctx->opTop = bp;
+    return result;
+}
+
+int naiBoolify(naContext ctx, naRef r)
+{
+    return boolify(ctx, r);
+}
+
+naRef* naiHold(naContext ctx, naRef r)
+{
+    PUSH(r);
+    return &ctx->opStack[ctx->opTop-1];
+}
+
 naRef naContinue(naContext ctx)
 {
     naRef result;
@@ -1187,6 +1374,7 @@ naRef naContinue(naContext ctx)
 
     ctx->dieArg = naNil();
     ctx->error[0] = 0;
+    ctx->fBase = 0; // any naiCallInline() was unwound by the error
 
     if (setjmp(ctx->jumpHandle)) {
 
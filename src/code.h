@@ -115,7 +115,15 @@ enum {
     OP_BIT_AND,
     OP_BIT_OR,
     OP_BIT_XOR,
-    OP_BIT_NEG
+    OP_BIT_NEG,
+    OP_EACH2,
+    /**
+     * @brief Wide forms of @c OP_PUSHCONST, @c OP_MEMBER and @c OP_LOCAL, for
+     * constant indexes above 0xffff. The index is two operands, low half first.
+     */
+    OP_PUSHCONSTW,
+    OP_MEMBERW,
+    OP_LOCALW
 };
 
 struct Frame {
@@ -168,6 +176,7 @@ struct Context {
     // Stack(s)
     struct Frame fStack[MAX_RECURSION];
     int fTop;
+    int fBase; // run() returns once fTop drops back to this
     naRef opStack[MAX_STACK_DEPTH];
     int opFrame; // like Frame::bp, but for C functions
     int opTop;
@@ -190,6 +199,9 @@ struct Context {
     char error[128];
     naRef dieArg;
 
+    // Compiled sprintf() formats and its output buffer, see format.c
+    struct FmtCache* fmtcache;
+
     // Sub-call lists
     struct Context* callParent;
     struct Context* callChild;
@@ -213,9 +225,46 @@ void* naNewSem();
 void naFreeSem(void* sem);
 void naSemDown(void* sem);
 void naSemUp(void* sem, int count);
+int naStartThread(void (*fn)(void* arg), void* arg); // 0 on failure
+int naNumCPUs();
+
+/**
+ * Run fn(arg, i) for each i in [0, n), spread over a pool of worker
+ * threads and the calling thread, and return once all are done.  The
+ * tasks run outside the interpreter: they must not allocate Nasal
+ * objects, call Nasal code or raise errors.  See pool.c.
+ */
+void naParallelFor(void (*fn)(void* arg, int i), void* arg, int n);
+
+// Threads naParallelFor() can use, including the caller
+int naPoolSize();
 
 void naCheckBottleneck();
 
+/**
+ * Call @p func from a C function that was itself called from Nasal
+ * code running in @p ctx.  The call gets a frame on ctx's own stacks
+ * and a nested run() of the interpreter, so there is no subcontext or
+ * setjmp per call as with naCall(): errors unwind through the calling
+ * C function to the enclosing naCall(), with the callee on the stack
+ * trace.  The caller must not hold resources that such an unwind
+ * would leak.
+ */
+naRef naiCallInline(naContext ctx, naRef func, int argc, naRef* args);
+
+/**
+ * Park @p r on the operand stack, where the GC sees it until the
+ * current C function returns.  The returned slot may be overwritten
+ * to keep a changing value (e.g. an accumulator) alive.
+ */
+naRef* naiHold(naContext ctx, naRef r);
+
+// Truth value of @p r as tested by if/while (naTrue() is narrower)
+int naiBoolify(naContext ctx, naRef r);
+
+// sprintf(): @p format applied to the @p argc values in @p args
+naRef naiFormat(naContext ctx, naRef format, int argc, naRef* args);
+
 #define LOCK() naLock(globals->lock)
 #define UNLOCK() naUnlock(globals->lock)
 
@@ -71,25 +71,68 @@ static void genBinOp(int op, struct Parser* p, struct Token* t)
 
 static int newConstant(struct Parser* p, naRef c)
 {
-    int i;
     naVec_append(p->cg->consts, c);
-    i = naVec_size(p->cg->consts) - 1;
-    if(i > 0xffff) naParseError(p, "too many constants in code block", 0);
-   return i;
+    return naVec_size(p->cg->consts) - 1;
+}
+
+static unsigned int constantHash(naRef c)
+{
+    return IS_NIL(c) ? 0 : naiHash_code(c);
+}
+
+static int sameConstant(naRef a, naRef b)
+{
+    if(IS_NUM(a) && IS_NUM(b)) return a.num == b.num;
+    else if(IS_NIL(a) && IS_NIL(b)) return 1;
+    else return naStrEqual(a, b);
+}
+
+// Doubles the constant index, keeping it at most half full
+static void growConstIndex(struct Parser* p)
+{
+    struct CodeGenerator* cg = p->cg;
+    int i, nslots = cg->constSlots ? 2 * cg->constSlots : 64;
+    unsigned int j;
+    int* index = naParseAlloc(p, nslots * sizeof(int));
+    memset(index, 0, nslots * sizeof(int));
+    for(i=0; i<cg->constSlots; i++) {
+        if(!cg->constIndex[i]) continue;
+        j = constantHash(naVec_get(cg->consts, cg->constIndex[i] - 1));
+        while(index[j & (nslots-1)]) j++;
+        index[j & (nslots-1)] = cg->constIndex[i];
+    }
+    cg->constIndex = index;
+    cg->constSlots = nslots;
 }
 
 // Interns a scalar (!) constant and returns its index
 static int internConstant(struct Parser* p, naRef c)
 {
-    int i, n = naVec_size(p->cg->consts);
+    struct CodeGenerator* cg = p->cg;
+    unsigned int i;
+    int k;
     if(IS_CODE(c)) return newConstant(p, c);
-    for(i=0; i<n; i++) {
-        naRef b = naVec_get(p->cg->consts, i);
-        if(IS_NUM(b) && IS_NUM(c) && b.num == c.num) return i;
-        else if(IS_NIL(b) && IS_NIL(c)) return i;
-        else if(naStrEqual(b, c)) return i;
+    if(2 * (cg->nInterned + 1) > cg->constSlots) growConstIndex(p);
+    for(i = constantHash(c); (k = cg->constIndex[i & (cg->constSlots-1)]); i++)
+        if(sameConstant(naVec_get(cg->consts, k - 1), c)) return k - 1;
+    k = newConstant(p, c);
+    cg->constIndex[i & (cg->constSlots-1)] = k + 1;
+    cg->nInterned++;
+    return k;
+}
+
+// Emits an instruction taking a constant index, or its wide form when
+// the index doesn't fit in one operand
+static void emitConstant(struct Parser* p, int op, int idx)
+{
+    if(idx <= 0xffff) {
+        emitImmediate(p, op, idx);
+        return;
     }
-    return newConstant(p, c);
+    emit(p, op == OP_PUSHCONST ? OP_PUSHCONSTW
+         : op == OP_MEMBER ? OP_MEMBERW : OP_LOCALW);
+    emit(p, idx & 0xffff);
+    emit(p, idx >> 16);
 }
 
 /* FIXME: this API is fundamentally a resource leak, because symbols
@@ -129,7 +172,7 @@ static int genScalarConstant(struct Parser* p, struct Token* t)
     int idx;
     if(t->str == 0 && t->num == 1) { emit(p, OP_PUSHONE); return 0; }
     if(t->str == 0 && t->num == 0) { emit(p, OP_PUSHZERO); return 0; }
-    emitImmediate(p, OP_PUSHCONST, idx = findConstantIndex(p, t));
+    emitConstant(p, OP_PUSHCONST, idx = findConstantIndex(p, t));
     return idx;
 }
 
@@ -164,12 +207,12 @@ static void genEqOp(int op, struct Parser* p, struct Token* t)
     if(setop == OP_SETMEMBER) {
         emit(p, OP_DUP2);
         emit(p, OP_POP);
-        emitImmediate(p, OP_MEMBER, cidx);
+        emitConstant(p, OP_MEMBER, cidx);
     } else if(setop == OP_INSERT) {
         emit(p, OP_DUP2);
         emit(p, OP_EXTRACT);
     } else {
-        emitImmediate(p, OP_LOCAL, cidx);
+        emitConstant(p, OP_LOCAL, cidx);
         n = 1;
     }
     genExpr(p, RIGHT(t));
@@ -261,7 +304,7 @@ static naRef newLambda(struct Parser* p, struct Token* t)
 
 static void genLambda(struct Parser* p, struct Token* t)
 {
-    emitImmediate(p, OP_PUSHCONST, newConstant(p, newLambda(p, t)));
+    emitConstant(p, OP_PUSHCONST, newConstant(p, newLambda(p, t)));
 }
 
 static int genList(struct Parser* p, struct Token* t, int doAppend)
@@ -302,6 +345,17 @@ static void genHash(struct Parser* p, struct Token* t)
     }
 }
 
+// Number of elements in a hash literal, for sizing the table up
+// front.  It's only a hint, so it is clamped to fit the operand.
+static int countHash(struct Token* t)
+{
+    int n = 0;
+    for(; t && t->type == TOK_COMMA; t = RIGHT(t))
+        if(LEFT(t) && LEFT(t)->type != TOK_EMPTY) n++;
+    n += t && t->type != TOK_EMPTY;
+    return n < 0xffff ? n : 0xffff;
+}
+
 static int isHashcall(struct Parser* p, struct Token* t)
 {
     if(t) {
@@ -318,12 +372,12 @@ static void genFuncall(struct Parser* p, struct Token* t)
         method = 1;
         genExpr(p, LEFT(LEFT(t)));
         emit(p, OP_DUP);
-        emitImmediate(p, OP_MEMBER, findConstantIndex(p, RIGHT(LEFT(t))));
+        emitConstant(p, OP_MEMBER, findConstantIndex(p, RIGHT(LEFT(t))));
     } else {
         genExpr(p, LEFT(t));
     }
     if(isHashcall(p, RIGHT(t))) {
-        emit(p, OP_NEWHASH);
+        emitImmediate(p, OP_NEWHASH, countHash(RIGHT(t)));
         genHash(p, RIGHT(t));
         emit(p, method ? OP_MCALLH : OP_FCALLH);
     } else {
@@ -366,6 +420,9 @@ static int emitJump(struct Parser* p, int op)
 // Points a previous jump instruction at the current "end-of-bytecode"
 static void fixJumpTarget(struct Parser* p, int spot)
 {
+    // Every jump lands at or before some address fixed up here
+    if(p->cg->codesz > 0xffff)
+        naParseError(p, "code block too large for jump", p->cg->lastLine);
     p->cg->byteCode[spot] = p->cg->codesz;
 }
 
@@ -448,7 +505,7 @@ static void genNullOrMember(struct Parser* p, struct Token* t)
     jumpNext = emitJump(p, OP_JIFTRUE);
     emit(p, OP_POP); // pop the comparisom result
     // object is non-nil here, emit the regular member access
-    emitImmediate(p, OP_MEMBER, findConstantIndex(p, RIGHT(t)));
+    emitConstant(p, OP_MEMBER, findConstantIndex(p, RIGHT(t)));
     jumpEnd = emitJump(p, OP_JMP);
     fixJumpTarget(p, jumpNext);
 
@@ -543,29 +600,51 @@ static void genFor(struct Parser* p, struct Token* t)
 static void genForEach(struct Parser* p, struct Token* t)
 {
     int loopTop, jumpEnd, assignOp, dummy;
-    struct Token *elem, *body, *vec, *label=0;
+    struct Token *elem, *elem2 = 0, *body, *vec, *label=0;
     struct Token *h = LEFT(LEFT(t));
     int len = countList(h, TOK_SEMI);
+    if(h && h->type == TOK_SEMI && RIGHT(h) && RIGHT(h)->type == TOK_COMMA) {
+        len = 3; // label; k, v; container
+    }
     if(len == 3) {
         if(!LEFT(h) || LEFT(h)->type != TOK_SYMBOL)
             naParseError(p, "bad loop label", h->line);
         label = LEFT(h);
         h = RIGHT(h);
-    } else if (len != 2) {
+    } else if (len != 2 && !(h && h->type == TOK_COMMA)) {
         naParseError(p, "wrong number of terms in foreach header", t->line);
     }
     elem = LEFT(h);
     vec = RIGHT(h);
+    if(h->type == TOK_COMMA) {
+        // Semicolons and commas have the same precedence, so
+        // "k, v; container" parses as (k, (v; container))
+        if(t->type != TOK_FOREACH || !vec || vec->type != TOK_SEMI
+           || countList(vec, TOK_SEMI) != 2)
+            naParseError(p, "bad foreach variables", t->line);
+        elem2 = LEFT(vec);
+        vec = RIGHT(vec);
+    }
     body = RIGHT(t)->children;
 
     genExpr(p, vec);
     emit(p, OP_PUSHZERO);
     loopTop = startLoop(p, label);
-    emit(p, t->type == TOK_FOREACH ? OP_EACH : OP_INDEX);
-    jumpEnd = emitJump(p, OP_JIFEND);
-    assignOp = genLValue(p, elem, &dummy);
-    emit(p, assignOp);
-    emit(p, OP_POP);
+    if(elem2) {
+        // foreach(k, v; hash) or foreach(i, elem; vec)
+        emit(p, OP_EACH2);
+        jumpEnd = emitJump(p, OP_JIFEND);
+        emit(p, genLValue(p, elem, &dummy));
+        emit(p, OP_POP);
+        emit(p, genLValue(p, elem2, &dummy));
+        emit(p, OP_POP);
+    } else {
+        emit(p, t->type == TOK_FOREACH ? OP_EACH : OP_INDEX);
+        jumpEnd = emitJump(p, OP_JIFEND);
+        assignOp = genLValue(p, elem, &dummy);
+        emit(p, assignOp);
+        emit(p, OP_POP);
+    }
     genLoop(p, body, 0, label, loopTop, jumpEnd);
     emit(p, OP_POP); // Pull off the vector and index
     emit(p, OP_POP);
@@ -612,14 +691,14 @@ static void newLineEntry(struct Parser* p, int line)
     int i;
     if(p->cg->nextLineIp >= p->cg->nLineIps) {
         int nsz = p->cg->nLineIps*2 + 1;
-        unsigned short* n = naParseAlloc(p, sizeof(unsigned short)*2*nsz);
-        for(i=0; i<(p->cg->nextLineIp*2); i++)
+        unsigned int* n = naParseAlloc(p, sizeof(unsigned int)*2*nsz);
+        for(i=0; i<p->cg->nextLineIp; i++)
             n[i] = p->cg->lineIps[i];
         p->cg->lineIps = n;
         p->cg->nLineIps = nsz;
     }
-    p->cg->lineIps[p->cg->nextLineIp++] = (unsigned short) p->cg->codesz;
-    p->cg->lineIps[p->cg->nextLineIp++] = (unsigned short) line;
+    p->cg->lineIps[p->cg->nextLineIp++] = p->cg->codesz;
+    p->cg->lineIps[p->cg->nextLineIp++] = line;
 }
 
 static int parListLen(struct Token* t)
@@ -762,7 +841,7 @@ static void genExpr(struct Parser* p, struct Token* t)
         }
         break;
     case TOK_LCURL:
-        emit(p, OP_NEWHASH);
+        emitImmediate(p, OP_NEWHASH, countHash(LEFT(t)));
         genHash(p, LEFT(t));
         break;
     case TOK_RETURN:
@@ -776,7 +855,7 @@ static void genExpr(struct Parser* p, struct Token* t)
         emit(p, OP_NOT);
         break;
     case TOK_SYMBOL:
-        emitImmediate(p, OP_LOCAL, findConstantIndex(p, t));
+        emitConstant(p, OP_LOCAL, findConstantIndex(p, t));
         break;
     case TOK_MINUS:
         if(BINARY(t)) {
@@ -813,7 +892,7 @@ static void genExpr(struct Parser* p, struct Token* t)
         if(!RIGHT(t) || RIGHT(t)->type != TOK_SYMBOL)
             naParseError(p, "object field not symbol", RIGHT(t)->line);
 
-        emitImmediate(p, OP_MEMBER, findConstantIndex(p, RIGHT(t)));
+        emitConstant(p, OP_MEMBER, findConstantIndex(p, RIGHT(t)));
         break;
     case TOK_NULL_ACCESS:
         genNullOrMember(p, t);
@@ -876,20 +955,22 @@ naRef naCodeGen(struct Parser* p, struct Token* block, struct Token* arglist)
     cg.byteCode = naParseAlloc(p, cg.codeAlloced *sizeof(unsigned short));
     cg.codesz = 0;
     cg.consts = naNewVector(p->context);
+    cg.constIndex = 0;
+    cg.constSlots = 0;
+    cg.nInterned = 0;
     cg.loopTop = 0;
     cg.lineIps = 0;
     cg.nLineIps = 0;
     cg.nextLineIp = 0;
     p->cg = &cg;
 
-    genExprList(p, block);
-    emit(p, OP_RETURN);
-    
     // Now make a code object
     codeObj = naNewCode(p->context);
     code = PTR(codeObj).code;
     
-    // Parse the argument list, if any
+    // Parse the argument list, if any.  This comes first so the
+    // argument symbols get the low constant indexes, which are all
+    // their unsigned short arrays can hold.
     p->cg->restArgSym = globals->argRef;
     code->nArgs = code->nOptArgs = 0;
     p->cg->argSyms = p->cg->optArgSyms = p->cg->optArgVals = 0;
@@ -904,6 +985,9 @@ naRef naCodeGen(struct Parser* p, struct Token* block, struct Token* arglist)
 
     code->restArgSym = internConstant(p, p->cg->restArgSym);
 
+    genExprList(p, block);
+    emit(p, OP_RETURN);
+
     /* Set the size fields and allocate the combined array buffer.
      * Note cute trick with null pointer to get the array size. */
     code->nConstants = naVec_size(cg.consts);
@@ -911,7 +995,7 @@ naRef naCodeGen(struct Parser* p, struct Token* block, struct Token* arglist)
     code->nLines = cg.nextLineIp;
     code->srcFile = p->srcFile;
     code->constants = 0;
-    code->constants = naAlloc((int)(size_t)(LINEIPS(code)+code->nLines));
+    code->constants = naAlloc((int)(size_t)(OPTARGVALS(code)+code->nOptArgs));
     for(int i=0; i<code->nConstants; i++) {
         code->constants[i] = naVec_get(p->cg->consts, i);
     }
@@ -71,6 +71,7 @@ enum {
     T_FUNC,
     T_CCODE,
     T_GHOST,
+    T_NUMVEC,
     NUM_NASAL_TYPES // This must be the last value in the enum
 };
 
@@ -91,6 +92,7 @@ static inline bool IS_OBJ(naRef r) {
 #define IS_FUNC(r) (IS_OBJ(r) && PTR(r).obj->type == T_FUNC)
 #define IS_CCODE(r) (IS_OBJ(r) && PTR(r).obj->type == T_CCODE)
 #define IS_GHOST(r) (IS_OBJ(r) && PTR(r).obj->type == T_GHOST)
+#define IS_NUMVEC(r) (IS_OBJ(r) && PTR(r).obj->type == T_NUMVEC)
 #define IS_CONTAINER(r) (IS_VEC(r)||IS_HASH(r))
 #define IS_SCALAR(r) (IS_NUM(r) || IS_STR(r))
 #define IDENTICAL(a, b) (IS_REF(a) && IS_REF(b) && PTR(a).obj == PTR(b).obj)
@@ -112,21 +114,38 @@ struct naObj {
 #define MAX_STR_EMBLEN 15
 struct naStr {
     GC_HEADER;
-    signed char emblen; /* [0-15], or -1 to indicate "not embedded" */
+    signed char emblen; /* [0-15], or <0 for "not embedded", see string.c */
+    unsigned char numstate; /* what cache holds, see string.c */
     unsigned int hashcode;
+    union {
+        double num; /* tonum() */
+        struct Utf8Index* utf8; /* for strings that aren't numbers */
+    } cache;
     union {
         unsigned char buf[16];
         struct {
             int len;
+            int off; /* of ptr in a shared buffer, see string.c */
             unsigned char* ptr;
         } ref;
     } data;
 };
 
+// The live elements are array[0..size), a window into store[0..alloced).
+// Popping from the front just advances array, and room left in front of
+// it is reused by naVec_prepend(), so the vector works as a deque.
+//
+// Slices share storage copy-on-write: the shared record is handed to a
+// hidden "owner" vector, which frees it when the GC finds it unused,
+// and each slice gets a view record (alloced 0, no store) whose array
+// points into it.  Records with an owner are read-only; writers first
+// copy the elements into a private record (see vector.c).
 struct VecRec {
     int size;
     int alloced;
-    naRef array[];
+    naRef* array;
+    naRef owner; // nil unless shared
+    naRef store[];
 };
 
 struct naVec {
@@ -142,7 +161,9 @@ struct HashNode {
 
 struct naHash {
     GC_HEADER;
+    unsigned int mods; // bumped when keys are added or removed
     struct HashRec* rec;
+    struct HashArr* arr; // dense integer keys, see hash.c
 };
 
 struct naCode {
@@ -150,22 +171,23 @@ struct naCode {
     unsigned int nArgs : 5;
     unsigned int nOptArgs : 5;
     unsigned int needArgVector : 1;
-    unsigned short nConstants;
-    unsigned short codesz;
-    unsigned short restArgSym; // The "..." vector name, defaults to "arg"
-    unsigned short nLines;
+    int nConstants;
+    int codesz;
+    int restArgSym; // The "..." vector name, defaults to "arg"
+    int nLines;
     naRef srcFile;
     naRef* constants;
 };
 
 /* naCode objects store their variable length arrays in a single block
  * starting with their constants table.  Compute indexes at runtime
- * for space efficiency: */
-#define BYTECODE(c) ((unsigned short*)((c)->constants+(c)->nConstants))
+ * for space efficiency.  The {ip, line} pairs are ints, so they go
+ * ahead of the unsigned short arrays: */
+#define LINEIPS(c) ((unsigned int*)((c)->constants+(c)->nConstants))
+#define BYTECODE(c) ((unsigned short*)(LINEIPS(c)+(c)->nLines))
 #define ARGSYMS(c) (BYTECODE(c)+(c)->codesz)
 #define OPTARGSYMS(c) (ARGSYMS(c)+(c)->nArgs)
 #define OPTARGVALS(c) (OPTARGSYMS(c)+(c)->nOptArgs)
-#define LINEIPS(c) (OPTARGVALS(c)+(c)->nOptArgs)
 
 struct naFunc {
     GC_HEADER;
@@ -194,6 +216,15 @@ struct naGhost {
     naRef data; //!< Nasal data bound to the lifetime of the ghost.
 };
 
+// A fixed size array of unboxed numbers, all of type etype (one of
+// the NA_NUM_* element types in nasal.h).
+struct naNumVec {
+    GC_HEADER;
+    unsigned char etype;
+    int size;
+    void* data;
+};
+
 struct naPool {
     int           type;
     int           elemsz;
@@ -235,19 +266,42 @@ int naStr_parsenum(char* str, int len, double* result);
 int naStr_tonum(naRef str, double* out);
 naRef naStr_buf(naRef str, int len);
 
+void naiHash_init(); // picks the per-process hash seed
 int naiHash_tryset(naRef hash, naRef key, naRef val); // sets if exists
 int naiHash_sym(struct naHash* h, struct naStr* sym, naRef* out);
 void naiHash_newsym(struct naHash* h, naRef* sym, naRef* val);
+int naiHash_next(naRef hash, int* pos, naRef* key, naRef* val);
+unsigned int naiHash_code(naRef key); // of a string or number key
+#ifdef NASAL_HASHSTATS
+int naiHash_probes(naRef hash, int* total, int* worst, int* others);
+#endif
+
+void naiStr_gcmark(struct naStr* s);
+void naiStr_gckeep(struct naStr* s);
+void naiStr_gcsweep();
+// Read only, not nul terminated, and only until the next allocation
+const unsigned char* naiStr_bytes(naRef s);
+int naiStr_find(const unsigned char* s, int len, const unsigned char* pat,
+                int patlen, int start);
+// The utf8 library's character index of s, if it has one (see utf8lib.c)
+struct Utf8Index* naiStr_utf8index(naRef s);
+// Gives s the index, which must be naAlloc()ed, unless s is a number
+int naiStr_setutf8index(naRef s, struct Utf8Index* index);
+
+void naiVec_appendrange(naContext c, naRef dst, naRef src, int start, int len,
+                        int share);
 
 void naGC_init(struct naPool* p, int type);
 struct naObj** naGC_get(struct naPool* p, int n, int* nout);
 void naGC_swapfree(void** target, void* val);
+void naiGC_deferfree(void* p);
 void naGC_freedead();
 void naiGCMark(naRef r);
 void naiGCMarkHash(naRef h);
 
 void naStr_gcclean(struct naStr* s);
 void naVec_gcclean(struct naVec* s);
+void naNumVec_gcclean(struct naNumVec* v);
 void naiGCHashClean(struct naHash* h);
 
 #endif // _DATA_H
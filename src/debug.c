@@ -62,7 +62,11 @@ const char* opcodeNames[] = {
     "OP_BIT_AND",
     "OP_BIT_OR",
     "OP_BIT_XOR",
-    "OP_BIT_NEG"
+    "OP_BIT_NEG",
+    "OP_EACH2",
+    "OP_PUSHCONSTW",
+    "OP_MEMBERW",
+    "OP_LOCALW"
 };
 
 const char* getOpcodeNames(int opcode) {
@@ -75,15 +79,16 @@ const char* getOpcodeNames(int opcode) {
 void printNaStr(struct naStr* str) {
     if (str == NULL) {
         printf("str: <null string>");
-    } else if (str->emblen != -1) {
+    } else if (str->emblen >= 0) {
         // String is embedded (use buf)
         printf("str: %.*s", str->emblen, (char*)str->data.buf);
     } else if (str->data.ref.ptr == NULL) {
         // External string pointer is null
         printf("str: <empty string>");
     } else {
-        // Print the string from the external pointer
-        printf("%s", str->data.ref.ptr);
+        // Print the string from the external pointer (which need not
+        // be terminated, see string.c)
+        printf("%.*s", str->data.ref.len, (char*)str->data.ref.ptr);
     }
 }
 
@@ -0,0 +1,319 @@
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef _MSC_VER // sigh...
+#define snprintf _snprintf
+#endif
+
+#include "nasal.h"
+#include "code.h"
+
+/*
+ * sprintf() formats are nearly always constants used over and over
+ * (display updates run them every frame), so each is parsed only once:
+ * compile() turns it into a list of Convs, literal text followed by one
+ * conversion, kept in a small per-context cache under the format's
+ * bytes.  Formatting then appends to one growable buffer, also per
+ * context, which becomes the result string with a single copy.
+ * Strings and integers are formatted here; floating point still goes
+ * through snprintf(), which is handed the specifier kept nul
+ * terminated in the compiled format.
+ */
+
+#define NCACHE 64 // formats cached per context, direct mapped
+#define MAXOUT 65536 // larger output buffers are not kept between calls
+
+#define F_MINUS 1
+#define F_PLUS 2
+#define F_SPACE 4
+#define F_ZERO 8
+#define F_ALT 16
+
+struct Conv {
+    int lit, litlen; // literal text before the conversion, in Fmt::text
+    int spec; // the "%..." specifier, nul terminated in Fmt::text
+    char type; // 0 when there is only the literal text
+    unsigned char flags;
+    int width, prec; // -1 if not given
+};
+
+struct Fmt {
+    unsigned int hash;
+    int len; // of the format, which starts Fmt::text
+    int nconv;
+    char* text;
+    struct Conv* conv;
+};
+
+struct FmtCache {
+    struct Fmt fmts[NCACHE];
+    char* out;
+    int outlen, outcap;
+};
+
+static unsigned int hashfmt(const char* s, int len)
+{
+    unsigned int h = 2166136261u;
+    while(len--) h = (h ^ (unsigned char)*s++) * 16777619u;
+    return h;
+}
+
+// Reads a width or precision, saturating instead of overflowing
+static int digits(const char** sp, const char* end)
+{
+    const char* s = *sp;
+    int n = 0;
+    for(; s < end && *s >= '0' && *s <= '9'; s++)
+        n = n < 100000000 ? n * 10 + (*s - '0') : 1000000000;
+    *sp = s;
+    return n;
+}
+
+// Parses the len bytes of format s, accepting all of ANSI C's syntax
+// except for the "length modifier" feature, and returns the number of
+// Convs.  This runs twice: first with a null f to count them and raise
+// any errors, then to fill in f, which has room for them.  The type
+// characters are not validated; formatting does that.
+static int compile(naContext c, const char* s, int len, struct Fmt* f)
+{
+    const char *p = s, *end = s + len, *lit = s, *spec;
+    char* tail = f ? f->text + len + 1 : 0;
+    int n = 0;
+    while(1) {
+        struct Conv cv;
+        while(p < end && *p != '%') p++;
+        cv.lit = lit - s;
+        cv.spec = -1;
+        cv.type = 0;
+        cv.flags = 0;
+        cv.width = cv.prec = -1;
+        if(p == end) {
+            cv.litlen = p - lit;
+            if(f) f->conv[n] = cv;
+            return n + 1;
+        }
+        spec = p++;
+        if(p < end && *p == '%') {
+            // "%%" is literal text: keep the first '%', skip the second
+            cv.litlen = p - lit;
+            lit = ++p;
+            if(f) f->conv[n] = cv;
+            n++;
+            continue;
+        }
+        cv.litlen = spec - lit;
+        for(; p < end; p++) {
+            int flag = *p == '-' ? F_MINUS : *p == '+' ? F_PLUS
+                : *p == ' ' ? F_SPACE : *p == '0' ? F_ZERO
+                : *p == '#' ? F_ALT : 0;
+            if(!flag) break;
+            // Duplicate flags are pure pedantry, and could be allowed
+            // on all known platforms, but just to be safe...
+            if(cv.flags & flag)
+                naRuntimeError(c, "duplicate flag in format string");
+            cv.flags |= flag;
+        }
+        if(p < end && *p >= '0' && *p <= '9') cv.width = digits(&p, end);
+        if(p < end && *p == '.') { p++; cv.prec = digits(&p, end); }
+        if(p == end) naRuntimeError(c, "invalid format string");
+        cv.type = *p++;
+        if(f) {
+            cv.spec = tail - f->text;
+            memcpy(tail, spec, p - spec);
+            tail += p - spec;
+            *tail++ = 0;
+            f->conv[n] = cv;
+        }
+        lit = p;
+        n++;
+    }
+}
+
+// The compiled form of format, from the cache if it is there
+static struct Fmt* lookup(naContext c, naRef format)
+{
+    const char* s = (const char*)naiStr_bytes(format);
+    const char* nul;
+    int len = naStr_len(format), n;
+    unsigned int h;
+    struct Fmt* f;
+
+    // Like the C function, the format ends at any nul
+    if((nul = memchr(s, 0, len))) len = nul - s;
+    if(!c->fmtcache) {
+        c->fmtcache = naAlloc(sizeof(struct FmtCache));
+        naBZero(c->fmtcache, sizeof(struct FmtCache));
+    }
+    h = hashfmt(s, len);
+    f = &c->fmtcache->fmts[h % NCACHE];
+    if(f->text && f->hash == h && f->len == len && !memcmp(f->text, s, len))
+        return f;
+
+    // No Nasal allocation happens in here, so s stays valid
+    n = compile(c, s, len, 0);
+    if(f->text) {
+        naFree(f->text);
+        naFree(f->conv);
+    }
+    // The format, then each specifier (no longer than it) with a nul
+    f->text = naAlloc(2 * len + n + 1);
+    f->conv = naAlloc(n * sizeof(struct Conv));
+    memcpy(f->text, s, len);
+    f->text[len] = 0;
+    compile(c, s, len, f);
+    f->hash = h;
+    f->len = len;
+    f->nconv = n;
+    return f;
+}
+
+// Room for n more bytes of output
+static char* room(struct FmtCache* fc, int n)
+{
+    if(!fc->out || fc->outlen + n > fc->outcap) {
+        int cap = fc->outcap ? fc->outcap : 256;
+        char* out;
+        while(cap < fc->outlen + n) cap *= 2;
+        out = naAlloc(cap);
+        if(fc->outlen) memcpy(out, fc->out, fc->outlen);
+        naFree(fc->out);
+        fc->out = out;
+        fc->outcap = cap;
+    }
+    return fc->out + fc->outlen;
+}
+
+static void put(struct FmtCache* fc, const char* s, int n)
+{
+    memcpy(room(fc, n), s, n);
+    fc->outlen += n;
+}
+
+// Pads body (n bytes, after a prefix of np bytes and nz zeros) out to
+// the conversion's width
+static void putpadded(struct FmtCache* fc, struct Conv* cv, const char* pre,
+                      int np, int nz, const char* body, int n)
+{
+    int pad = cv->width > np + nz + n ? cv->width - np - nz - n : 0;
+    char* d = room(fc, pad + np + nz + n);
+    if(!(cv->flags & F_MINUS)) { memset(d, ' ', pad); d += pad; }
+    memcpy(d, pre, np); d += np;
+    memset(d, '0', nz); d += nz;
+    memcpy(d, body, n); d += n;
+    if(cv->flags & F_MINUS) memset(d, ' ', pad);
+    fc->outlen += pad + np + nz + n;
+}
+
+// What the C casts do on x86, without the undefined behaviour when the
+// number is out of range: the formats used to be fed (int)num and
+// (unsigned int)num
+static int toint(double d)
+{
+    return d > -2147483649.0 && d < 2147483648.0 ? (int)d : INT_MIN;
+}
+
+static unsigned int touint(double d)
+{
+    return d > -9223372036854775808.0 && d < 9223372036854775808.0
+        ? (unsigned int)(long long)d : 0;
+}
+
+static void putint(struct FmtCache* fc, struct Conv* cv, double num)
+{
+    char buf[24], pre[2], *p = buf + sizeof(buf);
+    const char* hex = cv->type == 'X' ? "0123456789ABCDEF" : "0123456789abcdef";
+    unsigned int u, base = 10;
+    int np = 0, nd, nz;
+
+    if(cv->type == 'd' || cv->type == 'i') {
+        int v = toint(num);
+        u = v < 0 ? 0u - (unsigned int)v : (unsigned int)v;
+        if(v < 0) pre[np++] = '-';
+        else if(cv->flags & F_PLUS) pre[np++] = '+';
+        else if(cv->flags & F_SPACE) pre[np++] = ' ';
+    } else {
+        u = touint(num);
+        if(cv->type == 'o') base = 8;
+        else if(cv->type != 'u') base = 16;
+    }
+    if(base == 16 && u && (cv->flags & F_ALT)) {
+        pre[np++] = '0';
+        pre[np++] = cv->type;
+    }
+
+    // No digits at all for zero with a zero precision
+    if(u || cv->prec != 0)
+        do { *--p = hex[u % base]; u /= base; } while(u);
+    nd = buf + sizeof(buf) - p;
+    if(base == 8 && (cv->flags & F_ALT) && (nd == 0 || *p != '0'))
+        *--p = '0', nd++;
+
+    nz = cv->prec > nd ? cv->prec - nd : 0;
+    if(cv->prec < 0 && (cv->flags & (F_ZERO|F_MINUS)) == F_ZERO
+       && cv->width > np + nd)
+        nz = cv->width - np - nd;
+    putpadded(fc, cv, pre, np, nz, p, nd);
+}
+
+static void putfloat(struct FmtCache* fc, struct Fmt* f, struct Conv* cv,
+                     double num)
+{
+    int avail = 64, n;
+    n = snprintf(room(fc, avail), avail, f->text + cv->spec, num);
+    if(n >= avail) {
+        avail = n + 1;
+        n = snprintf(room(fc, avail), avail, f->text + cv->spec, num);
+    }
+    if(n > 0) fc->outlen += n;
+}
+
+naRef naiFormat(naContext c, naRef format, int argc, naRef* args)
+{
+    struct Fmt* f = lookup(c, format);
+    struct FmtCache* fc = c->fmtcache;
+    int i, argn = 0;
+    naRef arg, result;
+
+    fc->outlen = 0;
+    for(i=0; i<f->nconv; i++) {
+        struct Conv* cv = &f->conv[i];
+        put(fc, f->text + cv->lit, cv->litlen);
+        if(!cv->type) continue;
+        if(argn >= argc) naRuntimeError(c, "not enough arguments to sprintf()");
+        arg = args[argn++];
+        if(cv->type == 's') {
+            const char* s = "nil";
+            int n = 3;
+            arg = naStringValue(c, arg);
+            if(!naIsNil(arg)) {
+                s = (const char*)naiStr_bytes(arg);
+                n = naStr_len(arg);
+            }
+            if(cv->prec >= 0 && cv->prec < n) n = cv->prec;
+            putpadded(fc, cv, 0, 0, 0, s, n);
+            continue;
+        }
+        arg = naNumValue(arg);
+        if(naIsNil(arg)) {
+            put(fc, "nil", 3);
+        } else if(cv->type == 'c') {
+            char ch = (char)toint(arg.num);
+            putpadded(fc, cv, 0, 0, 0, &ch, 1);
+        } else if(strchr("diouxX", cv->type)) {
+            putint(fc, cv, arg.num);
+        } else if(strchr("eEfFgG", cv->type)) {
+            putfloat(fc, f, cv, arg.num);
+        } else {
+            naRuntimeError(c, "invalid sprintf format type");
+        }
+    }
+
+    result = naStr_fromdata(naNewString(c), fc->out, fc->outlen);
+    if(fc->outcap > MAXOUT) {
+        naFree(fc->out);
+        fc->out = 0;
+        fc->outcap = 0;
+    }
+    return result;
+}
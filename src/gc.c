@@ -1,6 +1,7 @@
 #include "nasal.h"
 #include "data.h"
 #include "code.h"
+#include "util.h"
 
 #define MIN_BLOCK_SIZE 32
 
@@ -63,6 +64,7 @@ static void garbageCollect()
     // Finally collect all the freed objects
     for(i=0; i<NUM_NASAL_TYPES; i++)
         reap(&(globals->pools[i]));
+    naiStr_gcsweep();
 
     // Make enough space for the dead blocks we need to free during
     // execution.  This works out to 1 spot for every 2 live objects,
@@ -105,7 +107,7 @@ void naModUnlock()
 static void bottleneck()
 {
     struct Globals* g = globals;
-    g->bottleneck = 1;
+    naStoreRelaxed(&g->bottleneck, 1);
     while(g->bottleneck && g->waitCount < g->nThreads - 1) {
         g->waitCount++;
         UNLOCK(); naSemDown(g->sem); LOCK();
@@ -115,7 +117,7 @@ static void bottleneck()
         freeDead();
         if(g->needGC) garbageCollect();
         if(g->waitCount) naSemUp(g->sem, g->waitCount);
-        g->bottleneck = 0;
+        naStoreRelaxed(&g->bottleneck, 0);
     }
 }
 
@@ -130,7 +132,8 @@ void naGC()
 
 void naCheckBottleneck()
 {
-    if(globals->bottleneck) { LOCK(); bottleneck(); UNLOCK(); }
+    // Polled without the lock; bottleneck() rechecks it
+    if(naLoadRelaxed(&globals->bottleneck)) { LOCK(); bottleneck(); UNLOCK(); }
 }
 
 static void naCode_gcclean(struct naCode* o)
@@ -160,6 +163,7 @@ static void freeelem(struct naPool* p, struct naObj* o)
     case T_CODE:  naCode_gcclean ((struct naCode*) o); break;
     case T_CCODE: naCCode_gcclean((struct naCCode*)o); break;
     case T_GHOST: naGhost_gcclean((struct naGhost*)o); break;
+    case T_NUMVEC: naNumVec_gcclean((struct naNumVec*)o); break;
     }
     p->free[p->nfree++] = o;  // ...and add it to the free list
 }
@@ -235,6 +239,11 @@ static void markvec(naRef r)
     int i;
     struct VecRec* vr = PTR(r).vec->rec;
     if(!vr) return;
+    if(!IS_NIL(vr->owner)) {
+        // The owner's own elements are those of the vectors sharing them
+        if(PTR(vr->owner).vec == PTR(r).vec) return;
+        mark(vr->owner);
+    }
     for(i=0; i<vr->size; i++)
         mark(vr->array[i]);
 }
@@ -253,6 +262,7 @@ static void mark(naRef r)
 
     PTR(r).obj->mark = 1;
     switch(PTR(r).obj->type) {
+    case T_STR: naiStr_gcmark(PTR(r).str); break;
     case T_VEC: markvec(r); break;
     case T_HASH: naiGCMarkHash(r); break;
     case T_CODE:
@@ -300,6 +310,8 @@ static void reap(struct naPool* p)
             struct naObj* o = (struct naObj*)(b->block + elem * p->elemsz);
             if(o->mark == 0)
                 freeelem(p, o);
+            else if(p->type == T_STR)
+                naiStr_gckeep((struct naStr*)o);
             o->mark = 0;
         }
 
@@ -319,24 +331,31 @@ static void reap(struct naPool* p)
     }
 }
 
-// Does the swap, returning the old value
+// Does the swap, returning the old value.  The new block is published
+// with a release store, so lock-free readers that load the pointer
+// see its contents fully written.
 static void* doswap(void** target, void* val)
 {
     void* old = *target;
-    *target = val;
+    naStoreRelease(target, val);
     return old;
 }
 
-// Atomically replaces target with a new pointer, and adds the old one
-// to the list of blocks to free the next time something holds the
-// giant lock.
-void naGC_swapfree(void** target, void* val)
+// Adds a block to the list of blocks to free the next time something
+// holds the giant lock, by which time no thread can still be reading
+// it.  Must be called with the lock held.
+void naiGC_deferfree(void* p)
 {
-    void* old;
-    LOCK();
-    old = doswap(target, val);
     while(globals->ndead >= globals->deadsz)
         bottleneck();
-    globals->deadBlocks[globals->ndead++] = old;
+    globals->deadBlocks[globals->ndead++] = p;
+}
+
+// Atomically replaces target with a new pointer, and frees the old one
+// later with naiGC_deferfree().
+void naGC_swapfree(void** target, void* val)
+{
+    LOCK();
+    naiGC_deferfree(doswap(target, val));
     UNLOCK();
 }
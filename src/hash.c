@@ -1,22 +1,36 @@
+#include <stdio.h>
 #include <string.h>
 #include <stdint.h>
+#include <time.h>
+#include <math.h>
 
 #include "nasal.h"
 #include "data.h"
+#include "code.h"
 #include "debug.h"
 #include "util.h"
 
-#define ENT_EMPTY -1
-#define ENT_DELETED -2
-
 typedef struct { naRef key, val; } HashEnt;
 
 /**
  * @brief A HashRec lives in a single allocated block. The layout is the
  * header struct, then a table of 2^lgsz hash entries (key/value
- * pairs), then an index table of 2*2^lgsz integers storing index
- * values into the entry table. There are two tokens needed for
- * "unused" and "used but empty".
+ * pairs) kept in insertion order, then a table of one control byte
+ * per cell, then an index table of one integer per cell storing
+ * index values into the entry table.  There are 2*2^lgsz cells, but
+ * never fewer than one probe group.
+ *
+ * The control byte of a used cell holds the low 7 bits of the key's
+ * hash code; unused cells are marked with CTRL_EMPTY and deleted ones
+ * with CTRL_DELETED (both have the high bit set).  Lookups scan a
+ * whole group of GROUPSZ control bytes at once and only compare the
+ * entry keys of cells whose hash fragment matches.
+ *
+ * Small hashes (objects with a handful of fields, function locals)
+ * are stored without control bytes or index table: just the header
+ * and SMALLSZ entries, which lookups scan linearly.  Such a table is
+ * allocated once at full size and is upgraded to the indexed layout
+ * when it outgrows SMALLSZ entries.
  */
 typedef struct HashRec {
     /**
@@ -31,50 +45,289 @@ typedef struct HashRec {
      * @brief Next entry to use
      */
     int next;
+    /**
+     * @brief Nonzero for a small, linearly scanned table (no CTRL/TAB)
+     */
+    int small;
 } HashRec;
 
-#define REC(h) (PTR(h).hash->rec)
-#define NCELLS(hr) (2*pow2((hr)->lgsz))
+/**
+ * @brief The array part of a hash: the values of the integer keys
+ * 0..len-1, indexed directly.  Deleted keys leave a DEAD_PTR hole.
+ *
+ * Integer keys are only appended here while the hash part holds no
+ * live entries, so every array key was inserted before every key of
+ * the hash part, and listing the array part first keeps the keys in
+ * insertion order.  Any other key (including an integer that went
+ * missing from the array) lives in the hash part.
+ */
+typedef struct HashArr {
+    /**
+     * @brief Number of slots in use, including holes
+     */
+    int len;
+    /**
+     * @brief Number of allocated slots
+     */
+    int alloced;
+    /**
+     * @brief Number of live (non-hole) slots
+     */
+    int count;
+    naRef elems[];
+} HashArr;
+
+#define SMALLSZ 8
+#define SMALL_LGSZ 3 /* log2(SMALLSZ) */
+
+#define GROUPSZ 16
+#define CTRL_EMPTY   0x80
+#define CTRL_DELETED 0xfe
+#define CTRL_FREE    0x80 /* high bit: empty or deleted */
+
+#define REC(h) naLoadAcquire(&PTR(h).hash->rec)
+#define ARR(h) naLoadAcquire(&PTR(h).hash->arr)
+#define NCELLS(hr) (pow2((hr)->lgsz+1) < GROUPSZ ? GROUPSZ : pow2((hr)->lgsz+1))
+#define NGROUPS(hr) (NCELLS(hr) / GROUPSZ)
 #define ROUNDUPOFF(n,m) ((((n)+(m-1))/m)*m)-(n)
 #define ALIGN(p,sz) (((char*)p)+ROUNDUPOFF(((size_t)p)%sz,sz))
 #define ENTS(h) ((HashEnt*)ALIGN(&((HashRec*)h)[1],sizeof(naRef)))
-#define TAB(h) ((int*)&(ENTS(h)[1<<(h)->lgsz]))
-#define HBITS(hr,code) ((hr)->lgsz ? ((code)>>(32-(hr)->lgsz)) : 0)
-#define LROT(h,n) (((h)<<n)|((h)>>((8*sizeof(h))-n)))
+#define CTRL(h) ((unsigned char*)&(ENTS(h)[1<<(h)->lgsz]))
+#define TAB(h) ((int*)&(CTRL(h)[NCELLS(h)]))
+#define H1(hr,code) (((code) >> 7) & (NGROUPS(hr) - 1))
+#define H2(code) ((code) & 0x7f)
+
+// Deleted entries stay in the entry table (to keep the remaining ones
+// in insertion order) with their key replaced by this marker.  It is
+// never dereferenced: everything walking the entry table skips it.
+#define DEAD_PTR ((void*)1)
+#define IS_DEAD(r) (IS_REF(r) && PTR(r).obj == DEAD_PTR)
+
+/*
+ * Concurrent readers
+ *
+ * Nasal threads run truly in parallel, and one may read a hash (say,
+ * a shared namespace) while another writes it.  Readers take no locks
+ * and never block; what they rely on is:
+ *
+ * - A HashRec or HashArr that readers can see is not rebuilt in place.
+ *   Resizing builds a new record and publishes it with a release
+ *   store in naGC_swapfree(), and the old one stays valid until the
+ *   next GC bottleneck, when no thread can still be reading it (RCU,
+ *   with the bottleneck as the grace period).  The one exception is
+ *   compact(), which only runs when no other thread is running.
+ * - New entries are written before they are published with a release
+ *   store: of "next" for the linear scan and iteration, of the control
+ *   byte for indexed lookups, and of "len" for the array part.
+ * - Entries never move, so a key is only ever read with its own
+ *   value.  Deletion replaces the key with DEAD_PTR and the value with
+ *   nil, so a racing reader gets the old value, nil, or a miss.
+ * - Single naRefs are stored with release and loaded with acquire
+ *   ordering, so the objects they point to are seen fully built.
+ *   Counters are accessed untorn (relaxed atomics).
+ *
+ * Writers must still be serialized among themselves, with a thread
+ * lock.  Racing writers can lose updates, but will not crash.
+ */
+static inline naRef getref(const naRef* p)
+{
+#if defined(__GNUC__) && defined(NASAL_NAN64)
+    naRef r;
+    __atomic_load(p, &r, __ATOMIC_ACQUIRE);
+    return r;
+#else
+    return *p;
+#endif
+}
+
+static inline void setref(naRef* p, naRef v)
+{
+#if defined(__GNUC__) && defined(NASAL_NAN64)
+    __atomic_store(p, &v, __ATOMIC_RELEASE);
+#else
+    *p = v;
+#endif
+}
+
+static inline naRef deadref()
+{
+    naRef r;
+    SETPTR(r, DEAD_PTR);
+    return r;
+}
+
+// Readers load control bytes with relaxed loads followed by an acquire
+// fence (free on x86).  ThreadSanitizer doesn't understand fences, so
+// builds using it do every load with acquire ordering instead.
+#ifdef NASAL_TSAN
+# define CTRLLOAD(p) naLoadAcquire(p)
+# define CTRLFENCE() ((void)0)
+#else
+# define CTRLLOAD(p) naLoadRelaxed(p)
+# define CTRLFENCE() naFenceAcquire()
+#endif
+
+// Bitmask of the cells in the group at g whose control byte is b
+static inline unsigned int groupmatch(const unsigned char* g, unsigned char b)
+{
+    unsigned int m;
+#if defined(NASAL_SSE2) && !defined(NASAL_TSAN)
+    __m128i ctrl = _mm_loadu_si128((const __m128i*)g);
+    m = _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8((char)b)));
+#else
+    unsigned int i;
+    for(i=0, m=0; i<GROUPSZ; i++) if(CTRLLOAD(&g[i]) == b) m |= 1u << i;
+#endif
+    CTRLFENCE();
+    return m;
+}
+
+// Bitmask of the empty or deleted cells in the group at g
+static inline unsigned int groupfree(const unsigned char* g)
+{
+#ifdef NASAL_SSE2
+    return _mm_movemask_epi8(_mm_loadu_si128((const __m128i*)g));
+#else
+    unsigned int i, m = 0;
+    for(i=0; i<GROUPSZ; i++) if(g[i] & CTRL_FREE) m |= 1u << i;
+    return m;
+#endif
+}
+
+// Number of entry slots in use (and published to readers)
+static inline int nents(HashRec* hr)
+{
+    return naLoadAcquire(&hr->next);
+}
+
+/*
+ * String and number keys are hashed with a seeded, word-at-a-time
+ * function in the style of wyhash: input is consumed 8 or 16 bytes at
+ * a time and folded with a 64x64->128 bit multiply.  The seed is
+ * chosen randomly per process (see naiHash_init()), so hash codes
+ * cannot be predicted from outside to force collisions.
+ */
+static uint64_t hashseed = 0x9e3779b97f4a7c15ull;
+
+#define HK0 0xa0761d6478bd642full
+#define HK1 0xe7037ed1a0b428dbull
+#define HK2 0x8ebc6af09c88c6e3ull
+#define HK3 0x589965cc75374cc3ull
 
-static unsigned int mix32(unsigned int h)
+// Multiplies a and b, and returns the xor of the two product halves
+static inline uint64_t mum(uint64_t a, uint64_t b)
 {
-    h ^= 0x2e63823a;  h += LROT(h, 15); h -= LROT(h, 9);
-    h += LROT(h, 4);  h -= LROT(h, 1);  h ^= LROT(h, 2);
-    return h;
+#if defined(__SIZEOF_INT128__)
+    __uint128_t r = (__uint128_t)a * b;
+    return (uint64_t)r ^ (uint64_t)(r >> 64);
+#else
+    uint64_t ha = a >> 32, hb = b >> 32, la = (uint32_t)a, lb = (uint32_t)b;
+    uint64_t rh = ha*hb, rm0 = ha*lb, rm1 = hb*la, rl = la*lb;
+    uint64_t t = rl + (rm0 << 32), c = t < rl, lo, hi;
+    lo = t + (rm1 << 32); c += lo < t;
+    hi = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+    return lo ^ hi;
+#endif
 }
-static unsigned int hash32(const unsigned char* in, int len)
+
+static inline uint64_t rd8(const unsigned char* p)
+{
+    uint64_t v; memcpy(&v, p, 8); return v;
+}
+
+static inline uint64_t rd4(const unsigned char* p)
+{
+    uint32_t v; memcpy(&v, p, 4); return v;
+}
+
+// Folds the 64 bit hash down to 32, never returning zero: a zero
+// hashcode marks a string that has not been hashed yet.
+static inline unsigned int fold32(uint64_t h)
+{
+    unsigned int r = (unsigned int)(h ^ (h >> 32));
+    return r ? r : 1;
+}
+
+static unsigned int hashbytes(const unsigned char* p, int len)
 {
-    unsigned int h = len, val = 0;
-    int i, count = 0;
-    for(i=0; i<len; i++) {
-        val = (val<<8) ^ in[i];
-        if(++count == 4) {
-            h = mix32(h ^ val);
-            val = count = 0;
+    uint64_t a, b, seed = hashseed;
+    int i = len;
+    if(len <= 16) {
+        if(len >= 4) {
+            int off = (len >> 3) << 2;
+            a = (rd4(p) << 32) | rd4(p + off);
+            b = (rd4(p + len - 4) << 32) | rd4(p + len - 4 - off);
+        } else if(len > 0) {
+            a = ((uint64_t)p[0] << 16) | ((uint64_t)p[len>>1] << 8) | p[len-1];
+            b = 0;
+        } else {
+            a = b = 0;
         }
+    } else {
+        if(i > 48) {
+            uint64_t s1 = seed, s2 = seed;
+            do {
+                seed = mum(rd8(p) ^ HK1, rd8(p+8) ^ seed);
+                s1 = mum(rd8(p+16) ^ HK2, rd8(p+24) ^ s1);
+                s2 = mum(rd8(p+32) ^ HK3, rd8(p+40) ^ s2);
+                p += 48; i -= 48;
+            } while(i > 48);
+            seed ^= s1 ^ s2;
+        }
+        while(i > 16) {
+            seed = mum(rd8(p) ^ HK1, rd8(p+8) ^ seed);
+            p += 16; i -= 16;
+        }
+        a = rd8(p + i - 16);
+        b = rd8(p + i - 8);
     }
-    return mix32(h ^ val);
+    return fold32(mum(HK1 ^ (uint64_t)len, mum(a ^ HK1, b ^ seed)));
+}
+
+static unsigned int hashnum(double d)
+{
+    uint64_t u;
+    if(d == 0) d = 0; /* remember negative zero! */
+    memcpy(&u, &d, sizeof(u));
+    return fold32(mum(u ^ hashseed, HK0));
+}
+
+void naiHash_init()
+{
+    uint64_t s = (uint64_t)time(0) ^ ((uint64_t)clock() << 32);
+    FILE* f = fopen("/dev/urandom", "rb");
+    if(f) {
+        uint64_t r;
+        if(fread(&r, sizeof(r), 1, f) == 1) s ^= r;
+        fclose(f);
+    }
+    // Mix in some addresses too, for whatever ASLR is worth
+    s ^= (uint64_t)(uintptr_t)&s;
+    s ^= (uint64_t)(uintptr_t)&naiHash_init << 16;
+    hashseed = mum(s ^ HK0, HK2) ^ s;
 }
 
 static unsigned int refhash(naRef key)
 {
     if(IS_STR(key)) {
+        // Threads may race to cache the code, but they all store the
+        // same value
         struct naStr* s = PTR(key).str;
-        if(s->hashcode) return s->hashcode;
-        return s->hashcode = hash32((void*)naStr_data(key), naStr_len(key));
+        unsigned int h = naLoadRelaxed(&s->hashcode);
+        if(h) return h;
+        h = hashbytes((void*)naStr_data(key), naStr_len(key));
+        naStoreRelaxed(&s->hashcode, h);
+        return h;
     } else { /* must be a number */
-        union { double d; unsigned int u[2]; } n;
-        n.d = key.num == -0.0 ? 0.0 : key.num; /* remember negative zero! */ 
-        return mix32(mix32(n.u[0]) ^ n.u[1]);
+        return hashnum(key.num);
     }
 }
 
+unsigned int naiHash_code(naRef key)
+{
+    return refhash(key);
+}
+
 /**
  * @brief Compares to Nasal references for equality.
  * @param a The first naRef to compare.
@@ -103,50 +356,160 @@ static int equal(naRef a, naRef b)
 }
 
 /**
- * @brief Returns the index of a cell that either contains a matching key, or
- * is the empty slot to receive a new insertion.
+ * @brief Returns the index of the entry of a small table holding a
+ * matching key, or -1 if there is none.
+ *
+ * The first pass only compares the raw key bits, which finds interned
+ * symbols and numbers without touching any string data.  Only string
+ * keys that miss go on to the slower pass, which checks the (cached)
+ * hash code before comparing the contents.  Every string stored in a
+ * table has been hashed on insertion.
  */
-static int findcell(struct HashRec *hr, naRef key, unsigned int hash)
+static int findsmall(struct HashRec *hr, naRef key)
 {
-    int i;
-    int mask = pow2(hr->lgsz + 1) - 1;
-    int step = (2 * hash + 1) & mask;
+    HashEnt* ents = ENTS(hr);
+    int i, n = nents(hr);
+    unsigned int hash;
+
+    if(IS_NUM(key)) {
+        for(i=0; i<n; i++) {
+            naRef k = getref(&ents[i].key);
+            if(IS_NUM(k) && k.num == key.num)
+                return i;
+        }
+        return -1;
+    }
+    for(i=0; i<n; i++) {
+        naRef k = getref(&ents[i].key);
+        if(IS_REF(k) && PTR(k).obj == PTR(key).obj)
+            return i;
+    }
+    hash = refhash(key);
+    for(i=0; i<n; i++) {
+        naRef k = getref(&ents[i].key);
+        if(!IS_DEAD(k) && IS_STR(k) &&
+           PTR(k).str->hashcode == hash && equal(key, k))
+            return i;
+    }
+    return -1;
+}
 
-    for(i=HBITS(hr,hash); TAB(hr)[i] != ENT_EMPTY; i=(i+step)&mask) {
+/**
+ * @brief Returns the index of the cell holding a matching key, or -1
+ * if there is none.
+ *
+ * Groups are visited in triangular order, which covers every group of
+ * a power-of-two table.  The table is never more than half full, so
+ * there is always an empty cell to stop the probe.
+ */
+static int findcell(struct HashRec *hr, naRef key, unsigned int hash)
+{
+    unsigned char* ctrl = CTRL(hr);
+    int* tab = TAB(hr);
+    HashEnt* ents = ENTS(hr);
+    int g = H1(hr, hash), gmask = NGROUPS(hr) - 1, step = 0;
+
+    for(;;) {
+        unsigned char* grp = ctrl + g*GROUPSZ;
+        unsigned int m = groupmatch(grp, H2(hash));
+        while(m) {
+            int cell = g*GROUPSZ + ctz32(m);
+            naRef k = getref(&ents[naLoadRelaxed(&tab[cell])].key);
+            if(!IS_DEAD(k) && equal(key, k))
+                return cell;
+            m &= m - 1;
+        }
+        if(groupmatch(grp, CTRL_EMPTY))
+            return -1;
+        g = (g + ++step) & gmask;
+    }
+}
 
-        if(TAB(hr)[i] != ENT_DELETED && equal(key, ENTS(hr)[TAB(hr)[i]].key)) {
-            break;
+#ifdef NASAL_HASHSTATS
+// Number of groups findcell() visits to find entry e, whose key has
+// the hash code; the fragment matches that were other keys are added
+// to *others
+static int probecount(struct HashRec *hr, int e, unsigned int hash, int* others)
+{
+    int g = H1(hr, hash), gmask = NGROUPS(hr) - 1, step = 0, n = 1;
+    for(;; n++) {
+        unsigned int m = groupmatch(CTRL(hr) + g*GROUPSZ, H2(hash));
+        for(; m; m &= m - 1) {
+            if(TAB(hr)[g*GROUPSZ + ctz32(m)] == e) return n;
+            (*others)++;
         }
+        g = (g + ++step) & gmask;
     }
-    return i;
 }
+#endif
 
-static void hashset(HashRec* hr, naRef key, naRef val)
+// Returns the first empty or deleted cell in the probe sequence for
+// the hash code: where a key known to be absent gets inserted.
+static int findfree(struct HashRec *hr, unsigned int hash)
 {
-    int cell = findcell(hr, key, refhash(key));
-    int ent;
-    if((ent = TAB(hr)[cell]) == ENT_EMPTY) {
-        ent = hr->next++;
+    int g = H1(hr, hash), gmask = NGROUPS(hr) - 1, step = 0;
+    unsigned int m;
+    while(!(m = groupfree(CTRL(hr) + g*GROUPSZ)))
+        g = (g + ++step) & gmask;
+    return g*GROUPSZ + ctz32(m);
+}
 
-        if(ent >= NCELLS(hr)) {
-            return; /* race protection, don't overrun */
-        }
+// Returns the index of the entry holding a matching key, or -1
+static int findent(struct HashRec *hr, naRef key)
+{
+    int cell;
+    if(hr->small)
+        return findsmall(hr, key);
+    cell = findcell(hr, key, refhash(key));
+    return cell < 0 ? -1 : naLoadRelaxed(&TAB(hr)[cell]);
+}
 
-        TAB(hr)[cell] = ent;
-        hr->size++;
-        ENTS(hr)[ent].key = key;
+// Stores a new entry, filling it in before publishing it through
+// "next" (for the linear scan) and the index and control bytes.
+// Returns zero if the entry table is full.
+static int newent(HashRec* hr, unsigned int hash, naRef key, naRef val)
+{
+    int ent = hr->next, cell;
+    if(ent >= pow2(hr->lgsz))
+        return 0;
+    setref(&ENTS(hr)[ent].key, key);
+    setref(&ENTS(hr)[ent].val, val);
+    naStoreRelease(&hr->next, ent + 1);
+    if(!hr->small) {
+        cell = findfree(hr, hash);
+        naStoreRelaxed(&TAB(hr)[cell], ent);
+        naStoreRelease(&CTRL(hr)[cell], (unsigned char)H2(hash));
     }
-    ENTS(hr)[ent].val = val;
+    naStoreRelaxed(&hr->size, hr->size + 1);
+    return 1;
+}
+
+// Sets the value of a key, returning zero if it needed a new entry
+// and there was no room for it.
+static int hashset(HashRec* hr, naRef key, naRef val)
+{
+    int ent = findent(hr, key);
+    if(ent < 0)
+        return newent(hr, refhash(key), key, val);
+    setref(&ENTS(hr)[ent].val, val);
+    return 1;
 }
 
-static int recsize(int lgsz)
+static int recsize(int lgsz, int small)
 {
     HashRec hr;
     hr.lgsz = lgsz;
-    return (int)((char*)&TAB(&hr)[pow2(lgsz+1)] - (char*)&hr) + sizeof(naRef);
+    if(small)
+        return (int)((char*)&ENTS(&hr)[SMALLSZ] - (char*)&hr);
+    return (int)((char*)&TAB(&hr)[NCELLS(&hr)] - (char*)&hr) + sizeof(naRef);
 }
 
-static HashRec* resize(struct naHash* hash)
+// Rebuilds the hash part with room for "need" more entries, and at
+// least as many free entries as live ones, so that growing and
+// shrinking by a factor of two each cost amortized O(1).  If "fold"
+// is given, the live entries of that array part are moved into the
+// new table first.
+static HashRec* resize(struct naHash* hash, HashArr* fold, int need)
 {
 
     if (!hash || !hash->rec) {
@@ -157,48 +520,185 @@ static HashRec* resize(struct naHash* hash)
     }
 
     HashRec *hr = hash->rec, *hr2;
-    int i, lgsz = 0;
-    if(hr) {
-        int oldsz = hr->size;
-        while(oldsz) { oldsz >>= 1; lgsz++; }
-    }
+    int i, lgsz = 0, small;
+    int oldsz = (hr ? hr->size : 0) + (fold ? fold->count : 0);
+    if((small = oldsz + (need > 1 ? need : 1) <= SMALLSZ))
+        lgsz = SMALL_LGSZ;
+    else
+        while(pow2(lgsz) < 2*oldsz || pow2(lgsz) < oldsz + need) lgsz++;
 
     // REVIEW: Memory Leak - 196,628 bytes in 1 blocks are still reachable
     // Since method returns a HashRec*, assuming caller is responsible for freeing the memory
     // trace: codegen::naInternSymbol() > naHash_set() > size()
     // seems to be a known issue - refer to comment @ codegen::naInternSymbol()
-    hr2 = naAlloc(recsize(lgsz));
+    hr2 = naAlloc(recsize(lgsz, small));
 
-    DEBUG_LOG("resize(): Allocating memory for HashRec of size: %d bytes", recsize(lgsz));
+    DEBUG_LOG("resize(): Allocating memory for HashRec of size: %d bytes", recsize(lgsz, small));
 
     hr2->size = hr2->next = 0;
     hr2->lgsz = lgsz;
-    for(i=0; i<(2*(1<<lgsz)); i++)
-        TAB(hr2)[i] = ENT_EMPTY;
-    for(i=0; hr && i < pow2(hr->lgsz+1); i++)
-        if(TAB(hr)[i] >= 0)
-            hashset(hr2, ENTS(hr)[TAB(hr)[i]].key, ENTS(hr)[TAB(hr)[i]].val);
+    hr2->small = small;
+    if(!small)
+        memset(CTRL(hr2), CTRL_EMPTY, NCELLS(hr2));
+    for(i=0; fold && i < fold->len; i++)
+        if(!IS_DEAD(fold->elems[i]))
+            hashset(hr2, naNum(i), fold->elems[i]);
+    for(i=0; hr && i < nents(hr); i++)
+        if(!IS_DEAD(ENTS(hr)[i].key))
+            hashset(hr2, ENTS(hr)[i].key, ENTS(hr)[i].val);
     naGC_swapfree((void*)&hash->rec, hr2);
     return hr2;
 }
 
+// Squeezes the deleted entries out of a table without reallocating
+// it, keeping the live ones in order.  This moves entries around under
+// any concurrent readers, so it is only done while holding the giant
+// lock with no other thread running Nasal code (none can start while
+// we hold the lock).  Returns zero if that isn't the case.
+static int compact(HashRec* hr)
+{
+    HashEnt* ents = ENTS(hr);
+    int i, j, n = nents(hr);
+    LOCK();
+    if(globals->nThreads > 1) {
+        UNLOCK();
+        return 0;
+    }
+    if(!hr->small)
+        memset(CTRL(hr), CTRL_EMPTY, NCELLS(hr));
+    for(i=j=0; i<n; i++)
+        if(!IS_DEAD(ents[i].key))
+            ents[j++] = ents[i];
+    hr->next = j;
+    for(i=j; i<n; i++)
+        ents[i].key = ents[i].val = naNil();
+    for(i=0; !hr->small && i<j; i++) {
+        unsigned int hash = refhash(ents[i].key);
+        int cell = findfree(hr, hash);
+        TAB(hr)[cell] = i;
+        CTRL(hr)[cell] = H2(hash);
+    }
+    UNLOCK();
+    return 1;
+}
+
+// Makes room for at least one new entry.  A table that is at least
+// half deleted entries is compacted in place; otherwise it grows.
+static HashRec* makeroom(struct naHash* hash)
+{
+    HashRec* hr = hash->rec;
+    if(hr && hr->size < (hr->small ? SMALLSZ : pow2(hr->lgsz-1))
+       && compact(hr))
+        return hr;
+    return resize(hash, 0, 1);
+}
+
 /**
  * @brief Returns the size of a hashmap
  * @param h The hashmap to get the size of
  * @returns The size of the hashmap.
  */
 int naHash_size(naRef h) {
-    DEBUG_LOG("naHash_size(): Hash size of ", REC(h) ? REC(h)->size: 0);
-    return REC(h) ? REC(h)->size : 0;
+    HashRec* hr = REC(h);
+    HashArr* ha = ARR(h);
+    DEBUG_LOG("naHash_size(): Hash size of ", hr ? hr->size: 0);
+    return (hr ? naLoadRelaxed(&hr->size) : 0)
+        + (ha ? naLoadRelaxed(&ha->count) : 0);
+}
+
+// Array index for a key, or -1 if it isn't a (small enough)
+// non-negative integer
+static inline int arrindex(naRef key)
+{
+    double d;
+    int i;
+    if(!IS_NUM(key)) return -1;
+    d = key.num;
+    if(!(d >= 0 && d < 0x7fffffff)) return -1;
+    i = (int)d;
+    return (double)i == d ? i : -1;
+}
+
+// The live array slot holding a key, or null
+static inline naRef* arrslot(struct naHash* h, naRef key)
+{
+    HashArr* ha = h->arr;
+    int i;
+    if(!ha || (i = arrindex(key)) < 0 || i >= ha->len)
+        return 0;
+    return IS_DEAD(ha->elems[i]) ? 0 : &ha->elems[i];
+}
+
+// Reader-side lookup in the array part
+static inline int arrget(struct naHash* h, naRef key, naRef* out)
+{
+    HashArr* ha = naLoadAcquire(&h->arr);
+    int i;
+    naRef v;
+    if(!ha || (i = arrindex(key)) < 0 || i >= naLoadAcquire(&ha->len))
+        return 0;
+    v = getref(&ha->elems[i]);
+    if(IS_DEAD(v))
+        return 0;
+    *out = v;
+    return 1;
+}
+
+// Appends a new key to the array part if it is the next integer and
+// the hash part is empty.  Returns zero if the key doesn't belong
+// there.
+static int arrappend(struct naHash* h, naRef key, naRef val)
+{
+    HashArr *ha = h->arr, *ha2;
+    int i = arrindex(key), len = ha ? ha->len : 0;
+    if(i != len || (h->rec && h->rec->size))
+        return 0;
+    if(i == 0 && signbit(key.num))
+        return 0; /* keep -0 a distinct key, as naHash_keys() sees it */
+    if(!ha || len >= ha->alloced) {
+        int sz = len + (len >> 1) + 4;
+        ha2 = naAlloc(sizeof(HashArr) + sz * sizeof(naRef));
+        ha2->len = len;
+        ha2->alloced = sz;
+        ha2->count = ha ? ha->count : 0;
+        if(ha) memcpy(ha2->elems, ha->elems, len * sizeof(naRef));
+        naGC_swapfree((void*)&h->arr, ha2);
+        ha = ha2;
+    }
+    setref(&ha->elems[len], val);
+    naStoreRelease(&ha->len, len + 1);
+    naStoreRelaxed(&ha->count, ha->count + 1);
+    return 1;
+}
+
+// Removes a key from the array part, returning zero if it isn't there.
+// Trailing holes are dropped; once the array gets mostly holes (say,
+// an integer-keyed queue) its entries move to the hash part.
+static int arrdelete(struct naHash* h, naRef key)
+{
+    naRef* slot = arrslot(h, key);
+    HashArr* ha = h->arr;
+    if(!slot) return 0;
+    setref(slot, deadref());
+    naStoreRelaxed(&ha->count, ha->count - 1);
+    while(ha->len && IS_DEAD(ha->elems[ha->len-1]))
+        naStoreRelaxed(&ha->len, ha->len - 1);
+    if(ha->len > 16 && ha->count < ha->len / 4) {
+        resize(h, ha, 0);
+        naGC_swapfree((void*)&h->arr, 0);
+    }
+    return 1;
 }
 
 int naHash_get(naRef hash, naRef key, naRef* out)
 {
-    HashRec* hr = REC(hash);
-    if(hr) {
-        int ent, cell = findcell(hr, key, refhash(key));
-        if((ent = TAB(hr)[cell]) < 0) return 0;
-        *out = ENTS(hr)[ent].val;
+    HashRec* hr;
+    if(arrget(PTR(hash).hash, key, out))
+        return 1;
+    if((hr = REC(hash))) {
+        int ent = findent(hr, key);
+        if(ent < 0) return 0;
+        *out = getref(&ENTS(hr)[ent].val);
         return 1;
     }
     return 0;
@@ -221,47 +721,151 @@ static inline HashRec* safe_rec(naRef h) {
     DEBUG_LOG("safe_rec(): ptr.hash->rec value: %p", (void*)ptr.hash->rec);
 
     // Safely return the rec field from the hash structure
-    return ptr.hash->rec;
+    return naLoadAcquire(&ptr.hash->rec);
 }
 
 void naHash_set(naRef hash, naRef key, naRef val)
 {
+    struct naHash* h = PTR(hash).hash;
     HashRec* hr = safe_rec(hash);
-    if(!hr || hr->next >= pow2(hr->lgsz))
-        hr = resize(PTR(hash).hash);
-    hashset(hr, key, val);
+    naRef* slot = arrslot(h, key);
+    int size;
+    if(slot) {
+        setref(slot, val);
+    } else if(arrappend(h, key, val)) {
+        h->mods++;
+    } else {
+        size = hr ? hr->size : 0;
+        if(!hr || !hashset(hr, key, val))
+            hashset(makeroom(h), key, val);
+        if(h->rec->size != size)
+            h->mods++;
+    }
 }
 
 void naHash_delete(naRef hash, naRef key)
 {
     HashRec* hr = REC(hash);
+    if(arrdelete(PTR(hash).hash, key)) {
+        PTR(hash).hash->mods++;
+        return;
+    }
     if(hr) {
-        int cell = findcell(hr, key, refhash(key));
-        if(TAB(hr)[cell] >= 0) {
-            TAB(hr)[cell] = ENT_DELETED;
-            if(--hr->size < pow2(hr->lgsz-1))
-                resize(PTR(hash).hash);
+        int ent, cell = -1;
+        if(hr->small) {
+            ent = findsmall(hr, key);
+        } else {
+            cell = findcell(hr, key, refhash(key));
+            ent = cell < 0 ? -1 : TAB(hr)[cell];
+        }
+        if(ent >= 0) {
+            if(cell >= 0)
+                naStoreRelaxed(&CTRL(hr)[cell], (unsigned char)CTRL_DELETED);
+            setref(&ENTS(hr)[ent].key, deadref());
+            setref(&ENTS(hr)[ent].val, naNil());
+            PTR(hash).hash->mods++;
+            // Shrink only once a quarter full, to leave a factor of two
+            // between the grow and shrink thresholds.  Small tables
+            // just get compacted when they fill up.
+            naStoreRelaxed(&hr->size, hr->size - 1);
+            if(hr->size < pow2(hr->lgsz-2) && !hr->small)
+                resize(PTR(hash).hash, 0, 0);
         }
     }
 }
 
+void naHash_reserve(naRef hash, int n)
+{
+    HashRec* hr = REC(hash);
+    int size = hr ? hr->size : 0;
+    if(n > size && (!hr || pow2(hr->lgsz) - nents(hr) < n - size)) {
+        resize(PTR(hash).hash, 0, n - size);
+        PTR(hash).hash->mods++;
+    }
+}
+
+void naHash_setMany(naRef hash, naRef* keys, naRef* vals, int n)
+{
+    int i;
+    naHash_reserve(hash, naHash_size(hash) + n);
+    for(i=0; i<n; i++)
+        naHash_set(hash, keys[i], vals[i]);
+}
+
+void naHash_merge(naRef dst, naRef src)
+{
+    int pos = 0;
+    naRef key, val;
+    if(PTR(dst).hash == PTR(src).hash)
+        return;
+    naHash_reserve(dst, naHash_size(dst) + naHash_size(src));
+    while(naiHash_next(src, &pos, &key, &val))
+        naHash_set(dst, key, val);
+}
+
+/**
+ * @brief Steps an iteration over a hash, in the order of naHash_keys().
+ * @param pos Iteration position, starting at zero.  Advanced past the
+ * entry returned.  Only valid while no keys are added or removed.
+ * @returns False if there are no more entries.
+ */
+int naiHash_next(naRef hash, int* pos, naRef* key, naRef* val)
+{
+    HashRec* hr = REC(hash);
+    HashArr* ha = ARR(hash);
+    int i = *pos, alen = ha ? naLoadAcquire(&ha->len) : 0;
+    for(; i < alen; i++) {
+        naRef v = getref(&ha->elems[i]);
+        if(!IS_DEAD(v)) {
+            *key = naNum(i);
+            *val = v;
+            *pos = i + 1;
+            return 1;
+        }
+    }
+    for(; hr && i - alen < nents(hr); i++) {
+        HashEnt* e = &ENTS(hr)[i - alen];
+        naRef k = getref(&e->key);
+        if(!IS_DEAD(k)) {
+            *key = k;
+            *val = getref(&e->val);
+            *pos = i + 1;
+            return 1;
+        }
+    }
+    *pos = i;
+    return 0;
+}
+
 void naHash_keys(naRef dst, naRef hash)
 {
     int i;
     HashRec* hr = REC(hash);
-    for(i=0; hr && i < NCELLS(hr); i++)
-        if(TAB(hr)[i] >= 0)
-            naVec_append(dst, ENTS(hr)[TAB(hr)[i]].key);
+    HashArr* ha = ARR(hash);
+    int n = ha ? naLoadAcquire(&ha->len) : 0;
+    for(i=0; i < n; i++)
+        if(!IS_DEAD(getref(&ha->elems[i])))
+            naVec_append(dst, naNum(i));
+    n = hr ? nents(hr) : 0;
+    for(i=0; i < n; i++) {
+        naRef k = getref(&ENTS(hr)[i].key);
+        if(!IS_DEAD(k))
+            naVec_append(dst, k);
+    }
 }
 
 void naiGCMarkHash(naRef hash)
 {
     int i;
     HashRec* hr = REC(hash);
-    for(i=0; hr && i < NCELLS(hr); i++)
-        if(TAB(hr)[i] >= 0) {
-            naiGCMark(ENTS(hr)[TAB(hr)[i]].key);
-            naiGCMark(ENTS(hr)[TAB(hr)[i]].val);
+    HashArr* ha = ARR(hash);
+    for(i=0; ha && i < ha->len; i++)
+        if(!IS_DEAD(ha->elems[i]))
+            naiGCMark(ha->elems[i]);
+    for(i=0; hr && i < nents(hr); i++)
+        if(!IS_DEAD(ENTS(hr)[i].key)) {
+            naiGCMark(ENTS(hr)[i].key);
+            naiGCMark(ENTS(hr)[i].val);
         }
 }
 
@@ -270,6 +874,7 @@ static void tmpStr(naRef* out, struct naStr* str, const char* key)
     str->type = T_STR;
     str->hashcode = 0;
     str->emblen = -1;
+    str->numstate = 0;
     str->data.ref.ptr = (unsigned char*)key;
     str->data.ref.len = strlen(key);
     SETPTR(*out, str);
@@ -300,13 +905,17 @@ void naHash_cset(naRef hash, char* key, naRef val)
 int naiHash_tryset(naRef hash, naRef key, naRef val)
 {
     HashRec* hr = REC(hash);
+    naRef* slot = arrslot(PTR(hash).hash, key);
+    if(slot) {
+        setref(slot, val);
+        return 1;
+    }
     if(hr) {
 
-        int cell = findcell(hr, key, refhash(key));
-        int ent;
+        int ent = findent(hr, key);
 
-        if((ent = TAB(hr)[cell]) >= 0) {
-            ENTS(hr)[ent].val = val;
+        if(ent >= 0) {
+            setref(&ENTS(hr)[ent].val, val);
             return 1;
         }
     }
@@ -314,10 +923,34 @@ int naiHash_tryset(naRef hash, naRef key, naRef val)
     return 0;
 }
 
+#ifdef NASAL_HASHSTATS
+/* Measures how well the keys of a hash are spread: the probe groups
+ * visited looking up each key of the hash part, in total and at worst,
+ * and the key comparisons wasted on other keys' fragment matches.  A
+ * small table counts one probe per key. */
+int naiHash_probes(naRef hash, int* total, int* worst, int* others)
+{
+    HashRec* hr = REC(hash);
+    int e, n, keys = 0;
+    *total = *worst = *others = 0;
+    for(e=0; hr && e<nents(hr); e++) {
+        naRef key = ENTS(hr)[e].key;
+        if(IS_DEAD(key)) continue;
+        n = hr->small ? 1 : probecount(hr, e, refhash(key), others);
+        *total += n;
+        if(n > *worst) *worst = n;
+        keys++;
+    }
+    return keys;
+}
+#endif
+
 void naiGCHashClean(struct naHash* h)
 {
     naFree(h->rec);
+    naFree(h->arr);
     h->rec = 0;
+    h->arr = 0;
 }
 
 /* Optimized naHash_get for looking up local variables (OP_LOCAL is by
@@ -327,19 +960,39 @@ void naiGCHashClean(struct naHash* h)
  * pointer identity). */
 int naiHash_sym(struct naHash* hash, struct naStr* sym, naRef* out)
 {
-    HashRec* hr = hash->rec;
-    if(hr) {
+    HashRec* hr = naLoadAcquire(&hash->rec);
+    if(hr && hr->small) {
+        HashEnt* ents = ENTS(hr);
+        int i, n = nents(hr);
+        for(i=0; i<n; i++) {
+            naRef k = getref(&ents[i].key);
+            if(IS_REF(k) && sym == PTR(k).str) {
+                *out = getref(&ents[i].val);
+                return 1;
+            }
+        }
+    } else if(hr) {
+        unsigned char* ctrl = CTRL(hr);
         int* tab = TAB(hr);
         HashEnt* ents = ENTS(hr);
         unsigned int hc = sym->hashcode;
-        int mask = pow2(hr->lgsz + 1) - 1;
-        int step = (2 * hc + 1) & mask;
-
-        for(int cell=HBITS(hr,hc); tab[cell] != ENT_EMPTY; cell=(cell+step)&mask)
-            if(tab[cell]!=ENT_DELETED && sym==PTR(ents[tab[cell]].key).str) {
-                *out = ents[tab[cell]].val;
-                return 1;
+        int g = H1(hr, hc), gmask = NGROUPS(hr) - 1, step = 0;
+
+        for(;;) {
+            unsigned char* grp = ctrl + g*GROUPSZ;
+            unsigned int m = groupmatch(grp, H2(hc));
+            while(m) {
+                int ent = naLoadRelaxed(&tab[g*GROUPSZ + ctz32(m)]);
+                if(sym == PTR(getref(&ents[ent].key)).str) {
+                    *out = getref(&ents[ent].val);
+                    return 1;
+                }
+                m &= m - 1;
             }
+            if(groupmatch(grp, CTRL_EMPTY))
+                return 0;
+            g = (g + ++step) & gmask;
+        }
     }
     return 0;
 }
@@ -351,20 +1004,7 @@ int naiHash_sym(struct naHash* hash, struct naStr* sym, naRef* out)
 void naiHash_newsym(struct naHash* hash, naRef* sym, naRef* val)
 {
     HashRec* hr = hash->rec;
-    int mask, step, cell, ent;
-    struct naStr *s = PTR(*sym).str;
-    if(!hr || hr->next >= pow2(hr->lgsz))
-        hr = resize(hash);
-    mask = pow2(hr->lgsz+1) - 1;
-    step = (2*s->hashcode+1) & mask;
-    cell = HBITS(hr, s->hashcode);
-    while(TAB(hr)[cell] != ENT_EMPTY)
-        cell = (cell + step) & mask;
-    ent = hr->next++;
-    if(ent >= NCELLS(hr)) return; /* race protection, don't overrun */
-    TAB(hr)[cell] = ent;
-    hr->size++;
-    ENTS(hr)[TAB(hr)[cell]].key = *sym;
-    ENTS(hr)[TAB(hr)[cell]].val = *val;
+    if(!hr || !newent(hr, PTR(*sym).str->hashcode, *sym, *val))
+        newent(makeroom(hash), PTR(*sym).str->hashcode, *sym, *val);
+    hash->mods++;
 }
-
@@ -8,73 +8,108 @@
  * @brief Data structure containing the string and token for a lexeme.
  * A lexeme is a basic unit of meaning in a language. In the context of language interpreters and compilers, a lexeme is a sequence of characters that matches a pattern defined by the lexical grammar. Lexemes correspond to tokens that are produced during lexical analysis (scanning) in the first phase of interpreting or compiling a programming language.
  */
-static const struct Lexeme {
+struct Lexeme {
     /** string! */
-    char* str;
+    const char* str;
     /** Token ! */
     int   tok;
-}
+};
+
+/**
+ * @brief Keywords, each at its perfect hash in the table.
+ * (length + 3 * first character) & 31 is different for every keyword,
+ * so a symbol is a keyword only if it is the one in its slot.  A new
+ * keyword may need a new multiplier or table size.
+ */
+static const struct Lexeme KEYWORDS[32] = {
+    [0] = {"true", TOK_TRUE},
+    [5] = {"var", TOK_VAR},
+    [6] = {"and", TOK_AND},
+    [10] = {"while", TOK_WHILE},
+    [11] = {"break", TOK_BREAK},
+    [13] = {"nil", TOK_NIL},
+    [15] = {"or", TOK_OR},
+    [17] = {"continue", TOK_CONTINUE},
+    [19] = {"else", TOK_ELSE},
+    [20] = {"elsif", TOK_ELSIF},
+    [21] = {"for", TOK_FOR},
+    [22] = {"func", TOK_FUNC},
+    [23] = {"false", TOK_FALSE},
+    [25] = {"foreach", TOK_FOREACH},
+    [26] = {"forindex", TOK_FORINDEX},
+    [28] = {"return", TOK_RETURN},
+    [29] = {"if", TOK_IF},
+};
+
+/**
+ * @brief Operators, listed under their first character.  Longer ones
+ * come first, so the first that matches is the longest.
+ */
+static const struct Lexeme OPS_NOT[] = {{"!=", TOK_NEQ}, {"!", TOK_NOT}, {0}};
+static const struct Lexeme OPS_AND[] = {{"&=", TOK_BIT_ANDEQ}, {"&", TOK_BIT_AND}, {0}};
+static const struct Lexeme OPS_OR[] = {{"|=", TOK_BIT_OREQ}, {"|", TOK_BIT_OR}, {0}};
+static const struct Lexeme OPS_XOR[] = {{"^=", TOK_BIT_XOREQ}, {"^", TOK_BIT_XOR}, {0}};
+static const struct Lexeme OPS_LPAR[] = {{"(", TOK_LPAR}, {0}};
+static const struct Lexeme OPS_RPAR[] = {{")", TOK_RPAR}, {0}};
+static const struct Lexeme OPS_LBRA[] = {{"[", TOK_LBRA}, {0}};
+static const struct Lexeme OPS_RBRA[] = {{"]", TOK_RBRA}, {0}};
+static const struct Lexeme OPS_LCURL[] = {{"{", TOK_LCURL}, {0}};
+static const struct Lexeme OPS_RCURL[] = {{"}", TOK_RCURL}, {0}};
+static const struct Lexeme OPS_MUL[] = {{"*=", TOK_MULEQ}, {"*", TOK_MUL}, {0}};
+static const struct Lexeme OPS_PLUS[] = {{"+=", TOK_PLUSEQ}, {"+", TOK_PLUS}, {0}};
+static const struct Lexeme OPS_MINUS[] = {{"-=", TOK_MINUSEQ}, {"-", TOK_MINUS}, {0}};
+static const struct Lexeme OPS_DIV[] = {{"/=", TOK_DIVEQ}, {"/", TOK_DIV}, {0}};
+static const struct Lexeme OPS_CAT[] = {{"~=", TOK_CATEQ}, {"~", TOK_CAT}, {0}};
+static const struct Lexeme OPS_COLON[] = {{":", TOK_COLON}, {0}};
+static const struct Lexeme OPS_DOT[] = {{"...", TOK_ELLIPSIS}, {".", TOK_DOT}, {0}};
+static const struct Lexeme OPS_COMMA[] = {{",", TOK_COMMA}, {0}};
+static const struct Lexeme OPS_SEMI[] = {{";", TOK_SEMI}, {0}};
+static const struct Lexeme OPS_ASSIGN[] = {{"==", TOK_EQ}, {"=", TOK_ASSIGN}, {0}};
+static const struct Lexeme OPS_LT[] = {{"<=", TOK_LTE}, {"<", TOK_LT}, {0}};
+static const struct Lexeme OPS_GT[] = {{">=", TOK_GTE}, {">", TOK_GT}, {0}};
+static const struct Lexeme OPS_QUESTION[] = {{"??", TOK_NULL_CHAIN}, {"?.", TOK_NULL_ACCESS},
+                                            {"?", TOK_QUESTION}, {0}};
+
+/**
+ * @brief The operators starting with each character, if any
+ */
+static const struct Lexeme* const OPERATORS[256] = {
+    ['!'] = OPS_NOT, ['&'] = OPS_AND, ['|'] = OPS_OR, ['^'] = OPS_XOR,
+    ['('] = OPS_LPAR, [')'] = OPS_RPAR, ['['] = OPS_LBRA, [']'] = OPS_RBRA,
+    ['{'] = OPS_LCURL, ['}'] = OPS_RCURL, ['*'] = OPS_MUL, ['+'] = OPS_PLUS,
+    ['-'] = OPS_MINUS, ['/'] = OPS_DIV, ['~'] = OPS_CAT, [':'] = OPS_COLON,
+    ['.'] = OPS_DOT, [','] = OPS_COMMA, [';'] = OPS_SEMI, ['='] = OPS_ASSIGN,
+    ['<'] = OPS_LT, ['>'] = OPS_GT, ['?'] = OPS_QUESTION,
+};
+
+#define C_SPACE 1
+#define C_ALPHA 2 // starts a symbol
+#define C_DIGIT 4
+#define C_QUOTE 8 // starts a string or character literal
 
 /**
- * @brief Static table of recognized lexemes in the language
+ * @brief The class of each input byte, which picks how naLex() reads
+ * the token starting with it
  */
-LEXEMES[] = {
-    {"and", TOK_AND},
-    {"or", TOK_OR},
-    {"!", TOK_NOT},
-    {"&", TOK_BIT_AND},
-    {"|", TOK_BIT_OR},
-    {"^", TOK_BIT_XOR},
-    {"(", TOK_LPAR},
-    {")", TOK_RPAR},
-    {"[", TOK_LBRA},
-    {"]", TOK_RBRA},
-    {"{", TOK_LCURL},
-    {"}", TOK_RCURL},
-    {"*", TOK_MUL},
-    {"+", TOK_PLUS},
-    {"-", TOK_MINUS},
-    {"/", TOK_DIV},
-    {"~", TOK_CAT},
-    {":", TOK_COLON},
-    {".", TOK_DOT},
-    {",", TOK_COMMA},
-    {";", TOK_SEMI},
-    {"=", TOK_ASSIGN},
-    {"<", TOK_LT},
-    {"<=", TOK_LTE},
-    {"==", TOK_EQ},
-    {"!=", TOK_NEQ},
-    {">", TOK_GT},
-    {">=", TOK_GTE},
-    {"nil", TOK_NIL},
-    {"true", TOK_TRUE},
-    {"false", TOK_FALSE},
-    {"if", TOK_IF},
-    {"elsif", TOK_ELSIF},
-    {"else", TOK_ELSE},
-    {"for", TOK_FOR},
-    {"foreach", TOK_FOREACH},
-    {"while", TOK_WHILE},
-    {"return", TOK_RETURN},
-    {"break", TOK_BREAK},
-    {"continue", TOK_CONTINUE},
-    {"func", TOK_FUNC},
-    {"...", TOK_ELLIPSIS},
-    {"?", TOK_QUESTION},
-    {"var", TOK_VAR},
-    {"+=", TOK_PLUSEQ},
-    {"-=", TOK_MINUSEQ},
-    {"*=", TOK_MULEQ},
-    {"/=", TOK_DIVEQ},
-    {"~=", TOK_CATEQ},
-    {"&=", TOK_BIT_ANDEQ},
-    {"|=", TOK_BIT_OREQ},
-    {"^=", TOK_BIT_XOREQ},
-    {"??", TOK_NULL_CHAIN},
-    {"?.", TOK_NULL_ACCESS},
-    {"forindex", TOK_FORINDEX},
+#define S C_SPACE
+#define A C_ALPHA
+#define D C_DIGIT
+#define Q C_QUOTE
+static const unsigned char CHARS[256] = {
+    0,0,0,0,0,0,0,0,0,S,S,S,S,S,0,0, /* 0x00 */
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, /* 0x10 */
+    S,0,Q,0,0,0,0,Q,0,0,0,0,0,0,0,0, /* 0x20 */
+    D,D,D,D,D,D,D,D,D,D,0,0,0,0,0,0, /* 0x30 */
+    0,A,A,A,A,A,A,A,A,A,A,A,A,A,A,A, /* 0x40 */
+    A,A,A,A,A,A,A,A,A,A,A,0,0,0,0,A, /* 0x50 */
+    Q,A,A,A,A,A,A,A,A,A,A,A,A,A,A,A, /* 0x60 */
+    A,A,A,A,A,A,A,A,A,A,A,0,0,0,0,0, /* 0x70 */
+    /* 0x80-0xff: none */
 };
+#undef S
+#undef A
+#undef D
+#undef Q
 
 // Build a table of where each line ending is
 static int* findLines(struct Parser* p)
@@ -108,14 +143,17 @@ static int* findLines(struct Parser* p)
     return lines;
 }
 
-// What line number is the index on?
+// What line number is the index on?  The line endings are in order,
+// so the first one after the index is found by binary search.
 static int getLine(struct Parser* p, int index)
 {
-    int i;
-    for(i=0; i<p->nLines; i++)
-        if(p->lines[i] > index)
-            return (p->firstLine-1) + i+1;
-    return (p->firstLine-1) + p->nLines+1;
+    int lo = 0, hi = p->nLines;
+    while(lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if(p->lines[mid] > index) hi = mid;
+        else lo = mid + 1;
+    }
+    return (p->firstLine-1) + lo+1;
 }
 
 static void error(struct Parser* p, char* msg, int index)
@@ -345,109 +383,35 @@ static int lexNumLiteral(struct Parser* p, int index)
 static int trySymbol(struct Parser* p, int start)
 {
     int i = start;
-    while((i < p->len) &&
-          ((p->buf[i] == '_') ||
-           (p->buf[i] >= 'A' && p->buf[i] <= 'Z') ||
-           (p->buf[i] >= 'a' && p->buf[i] <= 'z') ||
-           (p->buf[i] >= '0' && p->buf[i] <= '9')))
-    { i++; }
+    while(i < p->len && (CHARS[(unsigned char)p->buf[i]] & (C_ALPHA|C_DIGIT)))
+        i++;
     return i-start;
 }
 
-/**
- * @brief Returns the length of lexeme `l` if the buffer prefix matches, or zero if there was
- * no match.
- *
- * This function compares the beginning of the buffer `buf` with the lexeme `l`. If the
- * buffer starts with the lexeme `l`, the function returns the length of the lexeme. If there
- * is no match, the function returns 0. The function is designed to safely handle both
- * null-terminated lexeme strings and non-null-terminated buffers by using explicit length
- * checking.
- *
- * @param buf A pointer to the buffer containing the input data. The buffer is not required to be
- * null-terminated, but the caller must ensure that `buf` points to valid memory.
- * @param len The length of the buffer, specifying how many bytes are available for reading
- * from `buf`. The caller is responsible for ensuring that `len` accurately reflects the
- * number of valid bytes in `buf`.
- * @param l A pointer to the lexeme string. The lexeme must be a null-terminated string.
- *
- * @return The length of the lexeme `l` if the buffer prefix matches, or 0 if there was no match.
- *
- * @warning
- * - The buffer `buf` is not required to be null-terminated, but the caller must ensure that
- *   `buf` is valid and that `len` correctly reflects the length of the valid memory. Failure
- *   to do so may result in undefined behavior, such as buffer over-read or memory access
- *   violations.
- * - The lexeme `l` must be null-terminated. If `l` is not null-terminated, functions like
- *   `strlen()` and `strncmp()` will read beyond the intended bounds, leading to undefined
- *   behavior.
- * - If `buf` or `l` is `NULL`, the function will safely return 0, but the caller should ensure
- *   that valid pointers are passed to avoid runtime errors.
- * - The caller must ensure that `len` is large enough to cover any comparison with the lexeme.
- * @note
- * - If `len` is smaller than the length of the lexeme `l`, the function will return 0, as no
- *   valid match can occur.
- * - The function does not handle cases where `buf` contains multibyte characters (e.g., UTF-8
- *   encoded strings), as it compares single bytes from `buf` and `l`.
- * - This function is designed for comparing lexemes and buffer prefixes; it should not be used
- *   for general-purpose string searching or comparisons of arbitrary buffer contents beyond
- *   lexeme matching.
- */
-static int matchLexeme(char* buf, int len, char* l)
+// The token of a keyword, or zero if the symbol isn't one
+static int keyword(const char* sym, int len)
 {
-    // Null check
-    if (buf == NULL || l == NULL) {
-        return 0;
-    }
-
-    // Check if the lexeme is an empty string
-    if (l[0] == '\0') {
-        return 0;
-    }
-
-    // Get length of the lexeme
-    int lex_len = strlen(l);
-
-    // Early exit if buffer length is shorter than lexeme length
-    if (len < lex_len) {
-        return 0;
-    }
-
-    if (strncmp(buf, l, lex_len) == 0 ) {
-        return lex_len;
-    }
-
-    return 0;
+    const struct Lexeme* k = &KEYWORDS[(len + 3 * (unsigned char)sym[0]) & 31];
+    if(!k->str || strncmp(k->str, sym, len) || k->str[len]) return 0;
+    return k->tok;
 }
 
-// This is dumb and algorithmically slow.  It would be much more
-// elegant to sort and binary search the lexeme list, but that's a lot
-// more code and this really isn't very slow in practice; it checks
-// every byte of every lexeme for each input byte.  There are less
-// than 100 bytes of lexemes in the grammar.  Returns the number of
-// bytes in the lexeme read (or zero if none was recognized)
-static int tryLexemes(struct Parser* p, int index, int* lexemeOut)
+// Reads the longest operator at the index, returning its length (or
+// zero if there is none) and its token
+static int tryOperator(struct Parser* p, int index, int* tokOut)
 {
-    int i, n, best, bestIndex=-1;
-    char* start = p->buf + index;
-    int len = p->len - index;
-
-    n = sizeof(LEXEMES) / sizeof(struct Lexeme);
-    best = 0;
-    for(i=0; i<n; i++) {
-        int l = matchLexeme(start, len, LEXEMES[i].str);
-        if(l > best) {
-            best = l;
-            bestIndex = i;
+    const struct Lexeme* op = OPERATORS[(unsigned char)p->buf[index]];
+    const char* start = p->buf + index;
+    int len = p->len - index, n;
+    if(!op) return 0;
+    for(; op->str; op++) {
+        for(n=0; op->str[n] && n < len && start[n] == op->str[n]; n++) {}
+        if(!op->str[n]) {
+            *tokOut = op->tok;
+            return n;
         }
     }
-    if(best > 0) *lexemeOut = bestIndex;
-    return best;
-}
-
-// Helper function to check if a character is whitespace
-inline static bool isWhitespace(char c) {
-    return (c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f' || c == '\v');
+    return 0;
 }
 
 // Helper function to handle comments
@@ -455,70 +419,50 @@ int handleComment(struct Parser* p, int i) {
     return lineEnd(p, getLine(p, i));
 }
 
-// Helper function to check if a character is a string delimiter
-inline static bool isStringDelimiter(char c) {
-    return (c == '\'' || c == '"' || c == '`');
-}
-
-// Helper function to check if the current character is part of a number
-inline static bool isNumeric(char c, struct Parser* p, int i) {
-    return ISNUM(c) || (c == '.' && (i + 1) < p->len && ISNUM(p->buf[i + 1]));
-}
-
 void naLex(struct Parser* p)
 {
     int i = 0;
     findLines(p);
     while(i<p->len) {
         char c = p->buf[i];
+        int cls = CHARS[(unsigned char)c], len, tok;
 
-        // Whitespace, comments and string literals have obvious
-        // markers and can be handled by a switch:
-        bool handled = true;
-
-        if (isWhitespace(c)) {
+        if(cls & C_SPACE) {
             i++;
             continue;
         }
 
         // TODO: Comments should probably be defined somewhere
         // as a token, not here as a magic character.
-        if (c == '#') {
+        if(c == '#') {
             i = handleComment(p, i);
             continue;
         }
 
-        if (isStringDelimiter(c)) {
+        if(cls & C_QUOTE) {
             i = lexStringLiteral(p, i, c);
             continue;
         }
 
-        if (isNumeric(c, p, i)) {
+        if((cls & C_DIGIT)
+           || (c == '.' && i+1 < p->len && ISNUM(p->buf[i+1]))) {
             i = lexNumLiteral(p, i);
             continue;
         }
 
-        // Lexemes and symbols are a little more complicated.  Pick
-        // the longest one that matches.  Since some lexemes look like
-        // symbols (e.g. "or") they need a higher precedence, but we
-        // don't want a lexeme match to clobber the beginning of a
-        // symbol (e.g. "orchid").  If neither match, we have a bad
-        // character in the mix.
-        int symlen = 0;
-        int lexlen = 0;
-        int lexeme = -1;
-
-        lexlen = tryLexemes(p, i, &lexeme);
-
-        if((c>='A' && c<='Z') || (c>='a' && c<='z') || (c=='_')) {
-            symlen = trySymbol(p, i);
-        }
-        if(lexlen && lexlen >= symlen) {
-            newToken(p, i, LEXEMES[lexeme].tok, 0, 0, 0);
-            i += lexlen;
-        } else if(symlen) {
-            newToken(p, i, TOK_SYMBOL, p->buf+i, symlen, 0);
-            i += symlen;
+        // Symbols are read whole, so that a keyword doesn't clobber
+        // the beginning of one (e.g. "orchid"), and are keywords only
+        // if all of them is.
+        if(cls & C_ALPHA) {
+            len = trySymbol(p, i);
+            if((tok = keyword(p->buf+i, len)))
+                newToken(p, i, tok, 0, 0, 0);
+            else
+                newToken(p, i, TOK_SYMBOL, p->buf+i, len, 0);
+            i += len;
+        } else if((len = tryOperator(p, i, &tok))) {
+            newToken(p, i, tok, 0, 0, 0);
+            i += len;
         } else {
             //const char* line_begin = p->buf;
             int line = 1;
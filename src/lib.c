@@ -26,6 +26,7 @@ static naRef f_size(naContext c, naRef me, int argc, naRef* args)
     if(naIsString(args[0])) return naNum(naStr_len(args[0]));
     if(naIsVector(args[0])) return naNum(naVec_size(args[0]));
     if(naIsHash(args[0])) return naNum(naHash_size(args[0]));
+    if(naIsNumVec(args[0])) return naNum(naNumVec_size(args[0]));
     naRuntimeError(c, "object has no size()");
     return naNil();
 }
@@ -86,6 +87,21 @@ static naRef f_pop(naContext c, naRef me, int argc, naRef* args)
     return naVec_removelast(args[0]);
 }
 
+static naRef f_shift(naContext c, naRef me, int argc, naRef* args)
+{
+    if(argc < 1 || !naIsVector(args[0])) ARGERR();
+    return naVec_removefirst(args[0]);
+}
+
+// unshift(v, a, b) leaves a and b at the front in that order
+static naRef f_unshift(naContext c, naRef me, int argc, naRef* args)
+{
+    int i;
+    if(argc < 2 || !naIsVector(args[0])) ARGERR();
+    for(i=argc-1; i>0; i--) naVec_prepend(args[0], args[i]);
+    return args[0];
+}
+
 static naRef f_setsize(naContext c, naRef me, int argc, naRef* args)
 {
     if(argc < 2 || !naIsVector(args[0])) ARGERR();
@@ -95,7 +111,6 @@ static naRef f_setsize(naContext c, naRef me, int argc, naRef* args)
 
 static naRef f_subvec(naContext c, naRef me, int argc, naRef* args)
 {
-    int i;
     naRef nlen, result, v = args[0];
     int len = 0, start = (int)naNumValue(args[1]).num;
     if(argc < 2) return naNil();
@@ -107,9 +122,7 @@ static naRef f_subvec(naContext c, naRef me, int argc, naRef* args)
     if(naIsNil(nlen) || len > naVec_size(v) - start)
         len = naVec_size(v) - start;
     result = naNewVector(c);
-    naVec_setsize(c, result, len);
-    for(i=0; i<len; i++)
-        naVec_set(result, i, naVec_get(v, start + i));
+    naiVec_appendrange(c, result, v, start, len, 1);
     return result;
 }
 
@@ -164,21 +177,29 @@ static naRef f_streq(naContext c, naRef me, int argc, naRef* args)
     return argc > 1 ? naNum(naStrEqual(args[0], args[1])) : naNil();
 }
 
+// Byte-wise comparison, as chars (i.e. signed on most platforms)
+static int bytecompare(const char* ap, int alen, const char* bp, int blen)
+{
+    int i;
+    for(i=0; i<alen && i<blen; i++) {
+        int diff = ap[i] - bp[i];
+        if(diff) return diff < 0 ? -1 : 1;
+    }
+    return alen == blen ? 0 : (alen < blen ? -1 : 1);
+}
+
+// Reads the bytes in place, so builders and views aren't flattened
+static int strcompare(naRef a, naRef b)
+{
+    return bytecompare((const char*)naiStr_bytes(a), naStr_len(a),
+                       (const char*)naiStr_bytes(b), naStr_len(b));
+}
+
 static naRef f_cmp(naContext c, naRef me, int argc, naRef* args)
 {
-    char *a, *b;
-    int i, alen, blen;
     if(argc < 2 || !naIsString(args[0]) || !naIsString(args[1]))
         ARGERR();
-    a = naStr_data(args[0]);
-    alen = naStr_len(args[0]);
-    b = naStr_data(args[1]);
-    blen = naStr_len(args[1]);
-    for(i=0; i<alen && i<blen; i++) {
-        int diff = a[i] - b[i];
-        if(diff) return naNum(diff < 0 ? -1 : 1);
-    }
-    return naNum(alen == blen ? 0 : (alen < blen ? -1 : 1));
+    return naNum(strcompare(args[0], args[1]));
 }
 
 static naRef f_str(naContext c, naRef me, int argc, naRef* args)
@@ -261,6 +282,13 @@ static naRef f_contains(naContext c, naRef me, int argc, naRef* args)
         return naNum(0); // not found in the vector
     } else if (naIsHash(hashOrVec)) {
         return naHash_get(hashOrVec, key, &key) ? naNum(1) : naNum(0);
+    } else if (naIsString(hashOrVec)) {
+        // substring test
+        if (!naIsString(key)) ARGERR();
+        return naNum(naiStr_find(naiStr_bytes(hashOrVec),
+                                 naStr_len(hashOrVec),
+                                 naiStr_bytes(key), naStr_len(key),
+                                 0) >= 0);
     }
 
     return naNil();
@@ -290,6 +318,7 @@ static naRef f_typeof(naContext c, naRef me, int argc, naRef* args)
     else if(naIsNum(r)) t = "scalar";
     else if(naIsString(r)) t = "scalar";
     else if(naIsVector(r)) t = "vector";
+    else if(naIsNumVec(r)) t = "numvec";
     else if(naIsHash(r)) t = "hash";
     else if(naIsFunc(r)) t = "func";
     else if(naIsGhost(r)) t = "ghost";
@@ -457,88 +486,14 @@ char* dosprintf(char* f, ...)
     return buf;
 }
 
-// Inspects a printf format string f, and finds the next "%..." format
-// specifier.  Stores the start of the specifier in out, the length in
-// len, and the type in type.  Returns a pointer to the remainder of
-// the format string, or 0 if no format string was found.  Recognizes
-// all of ANSI C's syntax except for the "length modifier" feature.
-// Note: this does not validate the format character returned in
-// "type". That is the caller's job.
-static char* nextFormat(naContext c, char* f, char** out, int* len, char* type)
-{
-    // Skip to the start of the format string
-    while(*f && *f != '%') f++;
-    if(!*f) return 0;
-    *out = f++;
-
-    while(*f && (*f=='-' || *f=='+' || *f==' ' || *f=='0' || *f=='#')) f++;
-
-    // Test for duplicate flags.  This is pure pedantry and could
-    // be removed on all known platforms, but just to be safe...
-    {   char *p1, *p2;
-        for(p1 = *out + 1; p1 < f; p1++)
-            for(p2 = p1+1; p2 < f; p2++)
-                if(*p1 == *p2)
-                    naRuntimeError(c, "duplicate flag in format string"); }
-
-    while(*f && *f >= '0' && *f <= '9') f++;
-    if(*f && *f == '.') f++;
-    while(*f && *f >= '0' && *f <= '9') f++;
-    if(!*f) naRuntimeError(c, "invalid format string");
-
-    *type = *f++;
-    *len = f - *out;
-    return f;
-}
-
 #define ERR(m) naRuntimeError(c, m)
-#define APPEND(r) result = naStr_concat(naNewString(c), result, r)
 static naRef f_sprintf(naContext c, naRef me, int argc, naRef* args)
 {
-    char t, nultmp, *fstr, *next, *fout=0, *s;
-    int flen, argn=1;
-    naRef format, arg, result = naNewString(c);
-
+    naRef format;
     if(argc < 1) ERR("not enough arguments to sprintf()");
-    format = naStringValue(c, argc > 0 ? args[0] : naNil());
+    format = naStringValue(c, args[0]);
     if(naIsNil(format)) ERR("bad format string in sprintf()");
-    s = naStr_data(format);
-                               
-    while((next = nextFormat(c, s, &fstr, &flen, &t))) {
-        APPEND(NEWSTR(c, s, fstr-s)); // stuff before the format string
-        if(flen == 2 && fstr[1] == '%') {
-            APPEND(NEWSTR(c, "%", 1));
-            s = next;
-            continue;
-        }
-        if(argn >= argc) ERR("not enough arguments to sprintf()");
-        arg = args[argn++];
-        nultmp = fstr[flen]; // sneaky nul termination...
-        fstr[flen] = 0;
-        if(t == 's') {
-            arg = naStringValue(c, arg);
-            if(naIsNil(arg)) fout = dosprintf(fstr, "nil");
-            else             fout = dosprintf(fstr, naStr_data(arg));
-        } else {
-            arg = naNumValue(arg);
-            if(naIsNil(arg))
-                fout = dosprintf("nil");
-            else if(t=='d' || t=='i' || t=='c')
-                fout = dosprintf(fstr, (int)naNumValue(arg).num);
-            else if(t=='o' || t=='u' || t=='x' || t=='X')
-                fout = dosprintf(fstr, (unsigned int)naNumValue(arg).num);
-            else if(t=='e' || t=='E' || t=='f' || t=='F' || t=='g' || t=='G')
-                fout = dosprintf(fstr, naNumValue(arg).num);
-            else
-                ERR("invalid sprintf format type");
-        }
-        fstr[flen] = nultmp;
-        APPEND(NEWSTR(c, fout, strlen(fout)));
-        naFree(fout);
-        s = next;
-    }
-    APPEND(NEWSTR(c, s, strlen(s)));
-    return result;
+    return naiFormat(c, format, argc - 1, args + 1);
 }
 
 // FIXME: needs to honor subcontext list
@@ -573,53 +528,38 @@ static naRef f_closure(naContext c, naRef me, int argc, naRef* args)
     return f->namespace;
 }
 
-static int match(unsigned char* a, unsigned char* b, int l)
-{
-    int i;
-    for(i=0; i<l; i++) if(a[i] != b[i]) return 0;
-    return 1;
-}
-
-static int find(unsigned char* a, int al, unsigned char* s, int sl, int start)
-{
-    int i;
-    if(al == 0) return 0;
-    for(i=start; i<sl-al+1; i++) if(match(a, s+i, al)) return i;
-    return -1;
-}
-
 static naRef f_find(naContext c, naRef me, int argc, naRef* args)
 {
     int start = 0;
     if(argc < 2 || !IS_STR(args[0]) || !IS_STR(args[1])) ARGERR();
     if(argc > 2) start = (int)(naNumValue(args[2]).num);
-    return naNum(find((void*)naStr_data(args[0]), naStr_len(args[0]),
-                      (void*)naStr_data(args[1]), naStr_len(args[1]),
-                      start));
+    if(naStr_len(args[0]) == 0) return naNum(0);
+    return naNum(naiStr_find(naiStr_bytes(args[1]), naStr_len(args[1]),
+                             naiStr_bytes(args[0]), naStr_len(args[0]),
+                             start));
 }
 
+// The pieces are substrings, which share the string's storage.  That
+// storage can move when allocating them, hence naiStr_bytes() each time.
 static naRef f_split(naContext c, naRef me, int argc, naRef* args)
 {
-    int sl, dl, i;
-    char *s, *d, *s0;
-    naRef result;
+    int sl, dl, i, s0;
+    naRef result, s, d;
     if(argc < 2 || !IS_STR(args[0]) || !IS_STR(args[1])) ARGERR();
-    d = naStr_data(args[0]); dl = naStr_len(args[0]);
-    s = naStr_data(args[1]); sl = naStr_len(args[1]);
+    d = args[0];
+    s = args[1];
+    dl = naStr_len(d);
+    sl = naStr_len(s);
     result = naNewVector(c);
     if(dl == 0) { // special case zero-length delimiter
-        for(i=0; i<sl; i++) naVec_append(result, NEWSTR(c, s+i, 1));
+        for(i=0; i<sl; i++)
+            naVec_append(result, naStr_substr(naNewString(c), s, i, 1));
         return result;
     }
-    s0 = s;
-    for(i=0; i <= sl-dl; i++) {
-        if(match((unsigned char*)(s+i), (unsigned char*)d, dl)) {
-            naVec_append(result, NEWSTR(c, s0, s+i-s0));
-            s0 = s + i + dl;
-            i += dl - 1;
-        }
-    }
-    if(s0 - s <= sl) naVec_append(result, NEWSTR(c, s0, s+sl-s0));
+    for(s0 = 0; (i = naiStr_find(naiStr_bytes(s), sl, naiStr_bytes(d), dl,
+                                 s0)) >= 0; s0 = i + dl)
+        naVec_append(result, naStr_substr(naNewString(c), s, s0, i-s0));
+    naVec_append(result, naStr_substr(naNewString(c), s, s0, sl-s0));
     return result;
 }
 
@@ -653,61 +593,549 @@ static naRef f_bind(naContext c, naRef me, int argc, naRef* args)
     return func;
 }
 
-/* We use the "SortRec" gadget for two reasons: first, because ANSI
- * qsort() doesn't give us a mechanism for passing a "context" pointer
- * to the comparison routine we have to store one in every sorted
- * record.  Second, using an index into the original vector here
- * allows us to make the sort stable in the event of a zero returned
- * from the Nasal comparison function. */
-struct SortData { naContext ctx, subc; struct SortRec* recs;
-                  naRef* elems; int n; naRef fn; };
-struct SortRec { struct SortData* sd; int i; };
-
-static int sortcmp(struct SortRec* a, struct SortRec* b)
-{
-    struct SortData* sd = a->sd;
-    naRef args[2], d;
-    args[0] = sd->elems[a->i];
-    args[1] = sd->elems[b->i];
-    d = naCall(sd->subc, sd->fn, 2, args, naNil(), naNil());
-    if(naGetError(sd->subc)) {
-        naFree(sd->recs);
-        naRethrowError(sd->subc);
-    } else if(!naIsNum(d = naNumValue(d))) {
-        naFree(sd->recs);
+/*
+ * sort() and sortby() are a stable natural merge sort (a cut-down
+ * timsort) of an index permutation.  Comparisons go through sortcmp(),
+ * which compares numbers or strings natively when it can, and only
+ * calls back into Nasal for a general comparison function.
+ *
+ * Everything that must survive a longjmp from a failing callback
+ * lives in GC-managed objects held on the operand stack: the values in
+ * a vector, the index arrays in string buffers.
+ */
+enum { SORT_CALL, SORT_NUM, SORT_STR };
+
+#define MINRUN 32
+#define MAXRUNS 85 // enough for 2^64 elements under the run invariants
+
+struct SortKey {
+    const char* s;
+    int len;
+};
+
+struct SortData {
+    naContext ctx;
+    naRef* vals; // compared values, indexed by the permutation
+    struct SortKey* keys; // private copies of string vals, or null
+    int* idx;
+    int* tmp;
+    int mode;
+    int desc;
+    naRef fn;
+};
+
+// >0 if value a belongs after value b
+static int sortcmp(struct SortData* sd, int a, int b)
+{
+    naRef x = sd->vals[a], y = sd->vals[b], args[2], d;
+    if(sd->desc) { x = y; y = sd->vals[a]; }
+    switch(sd->mode) {
+    case SORT_NUM:
+        return (x.num > y.num) - (x.num < y.num);
+    case SORT_STR:
+        if(sd->keys) {
+            struct SortKey* p = &sd->keys[sd->desc ? b : a];
+            struct SortKey* q = &sd->keys[sd->desc ? a : b];
+            return bytecompare(p->s, p->len, q->s, q->len);
+        }
+        return strcompare(x, y);
+    }
+    args[0] = x;
+    args[1] = y;
+    d = naNumValue(naiCallInline(sd->ctx, sd->fn, 2, args));
+    if(!naIsNum(d))
         naRuntimeError(sd->ctx, "sort() comparison returned non-number");
+    return (d.num > 0) - (d.num < 0);
+}
+
+// Index of the first element of idx[lo..hi) that sorts after key
+// (after=1), or that does not sort before it (after=0).
+static int sortsearch(struct SortData* sd, int key, int lo, int hi, int after)
+{
+    while(lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if(sortcmp(sd, sd->idx[mid], key) >= after) hi = mid;
+        else lo = mid + 1;
     }
-    return (d.num > 0) ? 1 : ((d.num < 0) ? -1 : (a->i - b->i));
+    return lo;
 }
 
-static naRef f_sort(naContext c, naRef me, int argc, naRef* args)
+// Extends the sorted idx[lo..start) to idx[lo..hi) by binary insertion
+static void insertsort(struct SortData* sd, int lo, int start, int hi)
+{
+    int* idx = sd->idx;
+    for(; start < hi; start++) {
+        int key = idx[start];
+        int pos = sortsearch(sd, key, lo, start, 1);
+        memmove(idx + pos + 1, idx + pos, (start - pos) * sizeof(int));
+        idx[pos] = key;
+    }
+}
+
+// Length of the run starting at lo.  A strictly descending run is
+// reversed in place (strictly, so reversing it keeps the sort stable).
+static int findrun(struct SortData* sd, int lo, int hi)
+{
+    int* idx = sd->idx;
+    int n = lo + 1, i, j, t;
+    if(n == hi) return 1;
+    if(sortcmp(sd, idx[n], idx[lo]) < 0) {
+        while(n + 1 < hi && sortcmp(sd, idx[n+1], idx[n]) < 0) n++;
+        for(i=lo, j=n; i<j; i++, j--) {
+            t = idx[i]; idx[i] = idx[j]; idx[j] = t;
+        }
+    } else {
+        while(n + 1 < hi && sortcmp(sd, idx[n+1], idx[n]) >= 0) n++;
+    }
+    return n + 1 - lo;
+}
+
+// Merges the adjacent sorted runs idx[lo..mid) and idx[mid..hi)
+static void merge(struct SortData* sd, int lo, int mid, int hi)
+{
+    int *idx = sd->idx, *tmp = sd->tmp;
+    int i, j, k, n;
+
+    // Elements already in their final place at either end are left
+    // alone, which makes merging nearly ordered runs cheap.
+    lo = sortsearch(sd, idx[mid], lo, mid, 1);
+    if(lo == mid) return;
+    hi = sortsearch(sd, idx[mid-1], mid, hi, 0);
+
+    n = mid - lo;
+    memcpy(tmp, idx + lo, n * sizeof(int));
+    for(i=0, j=mid, k=lo; i<n && j<hi; k++)
+        idx[k] = sortcmp(sd, tmp[i], idx[j]) <= 0 ? tmp[i++] : idx[j++];
+    memcpy(idx + k, tmp + i, (n - i) * sizeof(int));
+}
+
+static int minrun(int n)
+{
+    int r = 0;
+    while(n >= MINRUN) { r |= n & 1; n >>= 1; }
+    return n + r;
+}
+
+static void mergesort(struct SortData* sd, int n)
+{
+    int base[MAXRUNS], len[MAXRUNS], top = 0, lo = 0, min = minrun(n);
+    while(lo < n) {
+        int run = findrun(sd, lo, n);
+        if(run < min) {
+            int end = lo + min < n ? lo + min : n;
+            insertsort(sd, lo, lo + run, end);
+            run = end - lo;
+        }
+        base[top] = lo;
+        len[top++] = run;
+        lo += run;
+
+        // Keep run lengths growing faster than Fibonacci from the top
+        // of the stack down, which bounds its depth (as in timsort).
+        while(top > 1) {
+            int m = top - 2;
+            if((m > 0 && len[m-1] <= len[m] + len[m+1]) ||
+               (m > 1 && len[m-2] <= len[m-1] + len[m])) {
+                if(len[m-1] < len[m+1]) m--;
+            } else if(len[m] > len[m+1]) {
+                break;
+            }
+            merge(sd, base[m], base[m+1], base[m+1] + len[m+1]);
+            len[m] += len[m+1];
+            for(m++; m < top - 1; m++) {
+                base[m] = base[m+1];
+                len[m] = len[m+1];
+            }
+            top--;
+        }
+    }
+    while(top > 1) {
+        merge(sd, base[top-2], base[top-1], n);
+        len[top-2] += len[top-1];
+        top--;
+    }
+}
+
+// Native sort modes for a vector of values: SORT_NUM if all numbers,
+// SORT_STR if all strings, else SORT_CALL.
+static int valmode(naRef* v, int n)
+{
+    int i, nums = 0;
+    for(i=0; i<n; i++)
+        if(IS_NUM(v[i])) nums++;
+        else if(!IS_STR(v[i])) return SORT_CALL;
+    return nums == n ? SORT_NUM : (nums ? SORT_CALL : SORT_STR);
+}
+
+// Resolves a symbol as the code of func would see it, minus locals
+static int closuresym(naRef func, naRef sym, naRef* out)
 {
+    while(IS_FUNC(func)) {
+        if(IS_HASH(PTR(func).func->namespace)
+           && naHash_get(PTR(func).func->namespace, sym, out))
+            return 1;
+        func = PTR(func).func->next;
+    }
+    return 0;
+}
+
+// Recognizes the common comparison functions, so that they can be
+// evaluated natively: the builtin cmp, and Nasal functions whose whole
+// body is a-b, b-a, cmp(a, b) or cmp(b, a) on their two arguments.
+// Returns SORT_NUM or SORT_STR and sets *desc, or SORT_CALL.
+static int fnmode(naRef fn, int* desc)
+{
+    struct naCode* cd;
+    unsigned short* bc;
+    naRef cmpfn, *k;
+    int a, b, i = 0;
+
+    *desc = 0;
+    if(IS_CCODE(PTR(fn).func->code)) {
+        struct naCCode* cc = PTR(PTR(fn).func->code).ccode;
+        return !cc->fptru && cc->fptr == f_cmp ? SORT_STR : SORT_CALL;
+    }
+    cd = PTR(PTR(fn).func->code).code;
+    bc = BYTECODE(cd);
+    k = cd->constants;
+    if(cd->nArgs != 2 || cd->nOptArgs || cd->needArgVector || cd->codesz < 6)
+        return SORT_CALL;
+    a = ARGSYMS(cd)[0];
+    b = ARGSYMS(cd)[1];
+
+    // "cmp(x, y)" starts by looking up cmp, which must be the builtin
+    if(bc[0] == OP_LOCAL && cd->codesz >= 9) {
+        if(!closuresym(fn, k[bc[1]], &cmpfn) || !naIsFunc(cmpfn)
+           || !IS_CCODE(PTR(cmpfn).func->code)
+           || fnmode(cmpfn, desc) != SORT_STR)
+            i = -1;
+        else
+            i = 2;
+    }
+    if(i < 0 || bc[i] != OP_LOCAL || bc[i+2] != OP_LOCAL)
+        return SORT_CALL;
+    if(naStrEqual(k[bc[i+1]], k[b]) && naStrEqual(k[bc[i+3]], k[a]))
+        *desc = 1;
+    else if(!naStrEqual(k[bc[i+1]], k[a]) || !naStrEqual(k[bc[i+3]], k[b]))
+        return SORT_CALL;
+    if(i == 0 && bc[4] == OP_MINUS && bc[5] == OP_RETURN)
+        return SORT_NUM;
+    if(i == 2 && bc[6] == OP_FCALL && bc[7] == 2 && bc[8] == OP_RETURN)
+        return SORT_STR;
+    return SORT_CALL;
+}
+
+/*
+ * Large native sorts (no Nasal comparison function) run in parallel:
+ * one chunk per pool thread is sorted as above, then the chunks are
+ * merged pairwise in rounds.  Each merge of runs A and B is cut into
+ * pieces at evenly spaced points of A, with B split before the first
+ * element not sorting before that point of A, so the pieces can be
+ * merged independently into their final places and the result is the
+ * same as the sequential stable sort's.  The modlock is released
+ * meanwhile, so strings are compared through private copies.
+ */
+#define PARSORT_MIN 65536 // smallest vector sorted in parallel
+#define MAXPARTS 16
+
+struct ParSort {
+    struct SortData* sd;
+    int parts; // chunks, one per thread
+    int bound[MAXPARTS+1]; // chunk k is idx[bound[k]..bound[k+1])
+    int width; // chunks per run in the current merge round
+    int pieces; // tasks per merge in the current round
+};
+
+static void sortchunk(void* arg, int k)
+{
+    struct ParSort* ps = arg;
+    struct SortData sd = *ps->sd;
+    sd.idx += ps->bound[k];
+    sd.tmp += ps->bound[k];
+    mergesort(&sd, ps->bound[k+1] - ps->bound[k]);
+}
+
+// Piece t of the current round, merging from tmp back into idx
+static void mergepiece(void* arg, int t)
+{
+    struct ParSort* ps = arg;
+    struct SortData src = *ps->sd;
+    int *a = ps->sd->tmp, *out = ps->sd->idx;
+    int run = (t / ps->pieces) * 2 * ps->width, p = t % ps->pieces;
+    int lo = ps->bound[run], mid, hi, a0, a1, b0, b1, k;
+    if(run + ps->width >= ps->parts) return;
+    mid = ps->bound[run + ps->width];
+    hi = ps->bound[run + 2*ps->width < ps->parts
+                   ? run + 2*ps->width : ps->parts];
+
+    src.idx = a;
+    a0 = lo + (int)((double)(mid - lo) * p / ps->pieces);
+    a1 = lo + (int)((double)(mid - lo) * (p + 1) / ps->pieces);
+    b0 = p ? sortsearch(&src, a[a0], mid, hi, 0) : mid;
+    b1 = p < ps->pieces - 1 ? sortsearch(&src, a[a1], mid, hi, 0) : hi;
+
+    k = a0 + b0 - mid;
+    while(a0 < a1 && b0 < b1)
+        out[k++] = sortcmp(&src, a[a0], a[b0]) <= 0 ? a[a0++] : a[b0++];
+    memcpy(out + k, a + a0, (a1 - a0) * sizeof(int));
+    memcpy(out + k + (a1 - a0), a + b0, (b1 - b0) * sizeof(int));
+}
+
+// Called with the modlock released; must not touch the interpreter
+static void parsort(struct SortData* sd, int n, int threads)
+{
+    struct ParSort ps;
+    int k, merges;
+    ps.sd = sd;
+    ps.parts = threads < MAXPARTS ? threads : MAXPARTS;
+    for(k=0; k<=ps.parts; k++)
+        ps.bound[k] = (int)((double)n * k / ps.parts);
+    naParallelFor(sortchunk, &ps, ps.parts);
+
+    for(ps.width = 1; ps.width < ps.parts; ps.width *= 2) {
+        merges = (ps.parts + 2*ps.width - 1) / (2*ps.width);
+        ps.pieces = ps.parts / merges;
+        memcpy(sd->tmp, sd->idx, n * sizeof(int));
+        naParallelFor(mergepiece, &ps, merges * ps.pieces);
+    }
+}
+
+// NaNs make the numeric order inconsistent, and with it the result
+// of a parallel sort nondeterministic
+static int hasnan(naRef* vals, int n, int mode)
+{
+    int i;
+    if(mode == SORT_NUM)
+        for(i=0; i<n; i++)
+            if(vals[i].num != vals[i].num) return 1;
+    return 0;
+}
+
+// Copies the string vals into one private block, or returns null if
+// they are too big for it.  Other threads may rewrite or free a
+// string's bytes while the modlock is released (the GC compacts
+// builder buffers), so a parallel sort must not read them in place.
+static struct SortKey* copykeys(naRef* vals, int n)
+{
+    struct SortKey* keys;
+    char* p;
+    double total = (double)n * sizeof(struct SortKey);
     int i;
+    for(i=0; i<n; i++) total += naStr_len(vals[i]);
+    if(total > 0x7fffffff) return 0;
+    keys = naAlloc((int)total);
+    p = (char*)(keys + n);
+    for(i=0; i<n; i++) {
+        keys[i].s = p;
+        keys[i].len = naStr_len(vals[i]);
+        memcpy(p, naiStr_bytes(vals[i]), keys[i].len);
+        p += keys[i].len;
+    }
+    return keys;
+}
+
+// Sorts vals[0..n) (held by the caller), returning the permutation
+static int* dosort(naContext c, naRef* vals, int n, int mode, int desc,
+                   naRef fn)
+{
     struct SortData sd;
-    naRef out;
-    if(argc != 2 || !naIsVector(args[0]) || !naIsFunc(args[1]))
+    naRef buf;
+    int i, threads;
+
+    sd.ctx = c;
+    sd.vals = vals;
+    sd.keys = 0;
+    sd.mode = mode;
+    sd.desc = desc;
+    sd.fn = fn;
+    buf = naStr_buf(naNewString(c), (n ? n : 1) * sizeof(int));
+    naiHold(c, buf);
+    sd.idx = (int*)naStr_data(buf);
+    buf = naStr_buf(naNewString(c), (n ? n : 1) * sizeof(int));
+    naiHold(c, buf);
+    sd.tmp = (int*)naStr_data(buf);
+
+    for(i=0; i<n; i++) sd.idx[i] = i;
+    if(mode != SORT_CALL && n >= PARSORT_MIN && !hasnan(vals, n, mode)
+       && (threads = naPoolSize()) > 1
+       && (mode != SORT_STR || (sd.keys = copykeys(vals, n)))) {
+        naModUnlock();
+        parsort(&sd, n, threads);
+        naModLock();
+        naFree(sd.keys);
+    } else {
+        mergesort(&sd, n);
+    }
+    return sd.idx;
+}
+
+// A held copy of the elements of vec
+static naRef heldcopy(naContext c, naRef vec)
+{
+    int i, n = naVec_size(vec);
+    naRef v = naNewVector(c);
+    naiHold(c, v);
+    naVec_setsize(c, v, n);
+    for(i=0; i<n; i++)
+        PTR(v).vec->rec->array[i] = naVec_get(vec, i);
+    return v;
+}
+
+static naRef permute(naContext c, naRef src, int* idx)
+{
+    int i, n = naVec_size(src);
+    naRef out = naNewVector(c);
+    naVec_setsize(c, out, n);
+    for(i=0; i<n; i++)
+        PTR(out).vec->rec->array[i] = PTR(src).vec->rec->array[idx[i]];
+    return out;
+}
+
+// sort(vec[, fn[, descending]]): a stable sort by comparison function
+// fn, or without one, of all numbers or all strings (as by cmp)
+static naRef f_sort(naContext c, naRef me, int argc, naRef* args)
+{
+    naRef fn = argc > 1 ? args[1] : naNil(), elems;
+    int n, mode, desc = 0, *idx;
+    if(argc < 1 || !naIsVector(args[0]) || (!naIsNil(fn) && !naIsFunc(fn)))
         naRuntimeError(c, "bad/missing argument to sort()");
-    sd.subc = naSubContext(c);
-    if(!PTR(args[0]).vec->rec) return naNewVector(c);
-    sd.elems = PTR(args[0]).vec->rec->array;
-    sd.n = PTR(args[0]).vec->rec->size;
-    sd.fn = args[1];
-    sd.recs = naAlloc(sizeof(struct SortRec) * sd.n);
-    for(i=0; i<sd.n; i++) {
-        sd.recs[i].sd = &sd;
-        sd.recs[i].i = i;
-    }
-    qsort(sd.recs, sd.n, sizeof(sd.recs[0]),
-          (int(*)(const void*,const void*))sortcmp);
+    elems = heldcopy(c, args[0]);
+    n = naVec_size(elems);
+    if(!n) return elems;
+    mode = valmode(PTR(elems).vec->rec->array, n);
+    if(!naIsNil(fn)) {
+        int fmode = fnmode(fn, &desc);
+        if(fmode != mode) mode = SORT_CALL, desc = 0;
+    } else if(mode == SORT_CALL) {
+        naRuntimeError(c, "sort() without a function needs all numbers"
+                       " or all strings");
+    }
+    if(argc > 2 && naTrue(args[2])) desc = !desc;
+    idx = dosort(c, PTR(elems).vec->rec->array, n, mode, desc, fn);
+    return permute(c, elems, idx);
+}
+
+// sortby(vec, keyfn[, descending]): stable sort by keyfn(element),
+// which is called once per element and must give all numbers or all
+// strings
+static naRef f_sortby(naContext c, naRef me, int argc, naRef* args)
+{
+    naRef elems, keys;
+    int i, n, mode, *idx;
+    if(argc < 2 || !naIsVector(args[0]) || !naIsFunc(args[1]))
+        ARGERR();
+    elems = heldcopy(c, args[0]);
+    n = naVec_size(elems);
+    keys = naNewVector(c);
+    naiHold(c, keys);
+    naVec_setsize(c, keys, n);
+    for(i=0; i<n; i++) {
+        naRef e = PTR(elems).vec->rec->array[i];
+        naVec_set(keys, i, naiCallInline(c, args[1], 1, &e));
+    }
+    mode = valmode(PTR(keys).vec->rec->array, n);
+    if(n && mode == SORT_CALL)
+        naRuntimeError(c, "sortby() keys must be all numbers or all strings");
+    idx = dosort(c, PTR(keys).vec->rec->array, n, mode,
+                 argc > 2 && naTrue(args[2]), naNil());
+    return permute(c, elems, idx);
+}
+
+// The higher-order functions below call back into Nasal with
+// naiCallInline(), which is much cheaper per element than naCall().
+// The vector is reread on each step, as the callback may change it.
+static naRef f_map(naContext c, naRef me, int argc, naRef* args)
+{
+    naRef out, v;
+    int i;
+    if(argc < 2 || !naIsVector(args[0]) || !naIsFunc(args[1])) ARGERR();
+    out = naNewVector(c);
+    naiHold(c, out);
+    naVec_setsize(c, out, naVec_size(args[0]));
+    for(i=0; i<naVec_size(args[0]) && i<naVec_size(out); i++) {
+        v = naVec_get(args[0], i);
+        naVec_set(out, i, naiCallInline(c, args[1], 1, &v));
+    }
+    if(i < naVec_size(out)) naVec_setsize(c, out, i);
+    return out;
+}
+
+static naRef f_filter(naContext c, naRef me, int argc, naRef* args)
+{
+    naRef out, v;
+    int i;
+    if(argc < 2 || !naIsVector(args[0]) || !naIsFunc(args[1])) ARGERR();
     out = naNewVector(c);
-    naVec_setsize(c, out, sd.n);
-    for(i=0; i<sd.n; i++)
-        PTR(out).vec->rec->array[i] = sd.elems[sd.recs[i].i];
-    naFree(sd.recs);
-    naFreeContext(sd.subc);
+    naiHold(c, out);
+    for(i=0; i<naVec_size(args[0]); i++) {
+        v = naVec_get(args[0], i);
+        if(naiBoolify(c, naiCallInline(c, args[1], 1, &v)))
+            naVec_append(out, v);
+    }
     return out;
 }
 
+// reduce(vec, fn[, init]): without init, the first element starts
+// the accumulation; an empty vector then gives nil.
+static naRef f_reduce(naContext c, naRef me, int argc, naRef* args)
+{
+    naRef fargs[2], *acc;
+    int i = 0;
+    if(argc < 2 || !naIsVector(args[0]) || !naIsFunc(args[1])) ARGERR();
+    if(argc > 2) acc = naiHold(c, args[2]);
+    else acc = naiHold(c, naVec_get(args[0], i++));
+    for(; i<naVec_size(args[0]); i++) {
+        fargs[0] = *acc;
+        fargs[1] = naVec_get(args[0], i);
+        *acc = naiCallInline(c, args[1], 2, fargs);
+    }
+    return *acc;
+}
+
+static naRef doany(naContext c, int argc, naRef* args, int want)
+{
+    naRef v;
+    int i;
+    if(argc < 2 || !naIsVector(args[0]) || !naIsFunc(args[1]))
+        naRuntimeError(c, "bad/missing argument to %s()", want ? "any" : "all");
+    for(i=0; i<naVec_size(args[0]); i++) {
+        v = naVec_get(args[0], i);
+        if(naiBoolify(c, naiCallInline(c, args[1], 1, &v)) == want)
+            return naNum(want);
+    }
+    return naNum(!want);
+}
+
+static naRef f_any(naContext c, naRef me, int argc, naRef* args)
+{
+    return doany(c, argc, args, 1);
+}
+
+static naRef f_all(naContext c, naRef me, int argc, naRef* args)
+{
+    return doany(c, argc, args, 0);
+}
+
+#ifdef NASAL_HASHSTATS
+// hashstats(hash): a diagnostic of how well a hash spreads its keys,
+// as {keys, probes, worst, others}: the probe groups visited looking
+// up every key, the most for any one key, and the comparisons with
+// other keys (see naiHash_probes()).
+static naRef f_hashstats(naContext c, naRef me, int argc, naRef* args)
+{
+    naRef h;
+    int keys, total, worst, others;
+    if(argc < 1 || !naIsHash(args[0])) ARGERR();
+    keys = naiHash_probes(args[0], &total, &worst, &others);
+    h = naNewHash(c);
+    naAddSym(c, h, "keys", naNum(keys));
+    naAddSym(c, h, "probes", naNum(total));
+    naAddSym(c, h, "worst", naNum(worst));
+    naAddSym(c, h, "others", naNum(others));
+    return h;
+}
+#endif
+
 static naRef f_id(naContext c, naRef me, int argc, naRef* args)
 {
     char *t = "unk", buf[64];
@@ -800,6 +1228,8 @@ static naCFuncItem funcs[] = {
     {"keys", f_keys},
     {"append", f_append},
     {"pop", f_pop},
+    {"shift", f_shift},
+    {"unshift", f_unshift},
     {"setsize", f_setsize},
     {"subvec", f_subvec},
     {"vecindex", f_vecindex},
@@ -829,7 +1259,16 @@ static naCFuncItem funcs[] = {
     {"rand", f_rand},
     {"bind", f_bind},
     {"sort", f_sort},
+    {"sortby", f_sortby},
+    {"map", f_map},
+    {"filter", f_filter},
+    {"reduce", f_reduce},
+    {"any", f_any},
+    {"all", f_all},
     {"id", f_id},
+#ifdef NASAL_HASHSTATS
+    {"hashstats", f_hashstats},
+#endif
     {"isscalar", f_isscalar},
     {"isint", f_isint},
     {"isnum", f_isnum},
@@ -146,6 +146,7 @@ naRef naNewString(struct Context* c)
 {
     naRef s = naNew(c, T_STR);
     PTR(s).str->emblen = 0;
+    PTR(s).str->numstate = 0;
     PTR(s).str->data.ref.len = 0;
     PTR(s).str->data.ref.ptr = 0;
     PTR(s).str->hashcode = 0;
@@ -163,6 +164,8 @@ naRef naNewHash(struct Context* c)
 {
     naRef r = naNew(c, T_HASH);
     PTR(r).hash->rec = 0;
+    PTR(r).hash->arr = 0;
+    PTR(r).hash->mods = 0;
     return r;
 }
 
@@ -338,6 +341,8 @@ int naTypeSize(int type)
             return sizeof(struct naCCode);
         case T_GHOST:
             return sizeof(struct naGhost);
+        case T_NUMVEC:
+            return sizeof(struct naNumVec);
     };
 
     return -1; // Return a negative value to indicate an unsupported type, invalid size, etc.
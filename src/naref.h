@@ -37,6 +37,7 @@ typedef union {
     struct naFunc* func;
     struct naCCode* ccode;
     struct naGhost* ghost;
+    struct naNumVec* numvec;
 } naPtr;
 
 /* On supported 64 bit platforms (those where all memory returned from
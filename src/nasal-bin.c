@@ -122,18 +122,21 @@ int main(int argc, char** argv)
     // the math library) to the namespace if desired.
     naAddSym(ctx, namespace, "print", naNewFunc(ctx, naNewCCode(ctx, print)));
 
+    // The methods of strings are not in any namespace, so they must be
+    // saved from the garbage collector.
+    naSave(ctx, naInit_string(ctx));
+
     // Add extra libraries as needed.
     naAddSym(ctx, namespace, "utf8", naInit_utf8(ctx));
     naAddSym(ctx, namespace, "math", naInit_math(ctx));
     naAddSym(ctx, namespace, "bits", naInit_bits(ctx));
+    naAddSym(ctx, namespace, "numvec", naInit_numvec(ctx));
     naAddSym(ctx, namespace, "io", naInit_io(ctx));
 #ifndef _WIN32
     naAddSym(ctx, namespace, "unix", naInit_unix(ctx));
 #endif
     naAddSym(ctx, namespace, "thread", naInit_thread(ctx));
-#ifdef HAVE_PCRE
     naAddSym(ctx, namespace, "regex", naInit_regex(ctx));
-#endif
 #ifdef HAVE_SQLITE
     naAddSym(ctx, namespace, "sqlite", naInit_sqlite(ctx));
 #endif
@@ -194,6 +194,7 @@ naRef naInit_regex(naContext c);
 naRef naInit_unix(naContext c);
 naRef naInit_thread(naContext c);
 naRef naInit_utf8(naContext c);
+naRef naInit_numvec(naContext c);
 naRef naInit_sqlite(naContext c);
 naRef naInit_readline(naContext c);
 naRef naInit_gtk(naContext ctx);
@@ -252,7 +253,7 @@ naRef naStringValue(naContext c, naRef n);
 
 // String utilities:
 int naStr_len(naRef s) GCC_PURE;
-char* naStr_data(naRef s) GCC_PURE;
+char* naStr_data(naRef s);
 naRef naStr_fromdata(naRef dst, const char* data, int len);
 naRef naStr_concat(naRef dest, naRef s1, naRef s2);
 naRef naStr_substr(naRef dest, naRef str, int start, int len);
@@ -266,11 +267,19 @@ void naVec_set(naRef vec, int i, naRef o);
 int naVec_append(naRef vec, naRef o);
 void naVec_setsize(naContext c, naRef vec, int sz);
 
+/**
+ * Insert an element at the begin of the vector.
+ *
+ * Storage freed by naVec_removefirst() is reused, so this is amortized
+ * constant time just like naVec_append().
+ */
+void naVec_prepend(naRef vec, naRef o);
+
 /**
  * Remove and retrieve the first element of the vector.
  *
- * This operation reduces the size of the vector by one and moves all elements
- * by one towards the begin of the vector.
+ * This operation reduces the size of the vector by one. It runs in constant
+ * time; the remaining elements are not moved.
  *
  * @return The element removed from the begin
  */
@@ -299,6 +308,21 @@ naRef naHash_cget(naRef hash, char* key);
 void naHash_set(naRef hash, naRef key, naRef val);
 void naHash_cset(naRef hash, char* key, naRef val);
 void naHash_delete(naRef hash, naRef key);
+/**
+ * Make room in @p hash for a total of @p n entries, so that filling it
+ * up to that size needs no further reallocation.
+ */
+void naHash_reserve(naRef hash, int n);
+/**
+ * Set @p n keys at once: @p vals[i] under @p keys[i].  Sizes the hash
+ * for all of them up front instead of growing it step by step.
+ */
+void naHash_setMany(naRef hash, naRef* keys, naRef* vals, int n);
+/**
+ * Copy every entry of hash @p src into @p dst, replacing the values
+ * of keys already there.
+ */
+void naHash_merge(naRef dst, naRef src);
 /**
  * Store the keys in @p hash into the vector at @p dst
  *
@@ -306,6 +330,28 @@ void naHash_delete(naRef hash, naRef key);
  */
 void naHash_keys(naRef dst, naRef hash);
 
+// Numeric vector utilities.  A numvec is a fixed size array of unboxed
+// numbers of a single element type, for bulk math (see naInit_numvec).
+enum { NA_NUM_F64, NA_NUM_F32, NA_NUM_I32 };
+/**
+ * Create a zero-filled numvec of @p size elements of type @p etype
+ * (one of the NA_NUM_* values above).
+ */
+naRef naNewNumVec(naContext c, int etype, int size);
+int naIsNumVec(naRef r) GCC_PURE;
+int naNumVec_size(naRef v);
+int naNumVec_type(naRef v);
+/**
+ * Raw element storage, @p size elements of the numvec's element type.
+ */
+void* naNumVec_data(naRef v);
+double naNumVec_get(naRef v, int i);
+/**
+ * Store @p d converted to the element type.  Integer elements truncate
+ * towards zero and saturate; NaN stores as zero.
+ */
+void naNumVec_set(naRef v, int i, double d);
+
 // Ghost utilities:
 typedef struct naGhostType {
     void(*destroy)(void*);
@@ -0,0 +1,77 @@
+#include "data.h"
+#include "nasal.h"
+
+static const int elemsz[] = { sizeof(double), sizeof(float), sizeof(int32_t) };
+
+naRef naNewNumVec(naContext c, int etype, int size)
+{
+    naRef r = naNew(c, T_NUMVEC);
+    struct naNumVec* v = PTR(r).numvec;
+    v->etype = etype;
+    v->size = 0;
+    v->data = 0;
+    if(size > 0) {
+        // naAlloc() zero fills, which is 0.0 for the float types too
+        v->data = naAlloc(size * elemsz[etype]);
+        v->size = size;
+    }
+    return r;
+}
+
+void naNumVec_gcclean(struct naNumVec* v)
+{
+    naFree(v->data);
+    v->data = 0;
+    v->size = 0;
+}
+
+int naIsNumVec(naRef r)
+{
+    return IS_NUMVEC(r);
+}
+
+int naNumVec_size(naRef v)
+{
+    return IS_NUMVEC(v) ? PTR(v).numvec->size : 0;
+}
+
+int naNumVec_type(naRef v)
+{
+    return IS_NUMVEC(v) ? PTR(v).numvec->etype : -1;
+}
+
+void* naNumVec_data(naRef v)
+{
+    return IS_NUMVEC(v) ? PTR(v).numvec->data : 0;
+}
+
+double naNumVec_get(naRef v, int i)
+{
+    struct naNumVec* nv;
+    if(!IS_NUMVEC(v)) return 0;
+    nv = PTR(v).numvec;
+    if(i < 0 || i >= nv->size) return 0;
+    switch(nv->etype) {
+    case NA_NUM_F32: return ((float*)nv->data)[i];
+    case NA_NUM_I32: return ((int32_t*)nv->data)[i];
+    }
+    return ((double*)nv->data)[i];
+}
+
+void naNumVec_set(naRef v, int i, double d)
+{
+    struct naNumVec* nv;
+    if(!IS_NUMVEC(v)) return;
+    nv = PTR(v).numvec;
+    if(i < 0 || i >= nv->size) return;
+    switch(nv->etype) {
+    case NA_NUM_F64: ((double*)nv->data)[i] = d; break;
+    case NA_NUM_F32: ((float*)nv->data)[i] = (float)d; break;
+    case NA_NUM_I32:
+        if(d != d) d = 0;
+        else if(d > INT32_MAX) d = INT32_MAX;
+        else if(d < INT32_MIN) d = INT32_MIN;
+        ((int32_t*)nv->data)[i] = (int32_t)d;
+        break;
+    }
+}
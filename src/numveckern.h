@@ -0,0 +1,201 @@
+/*
+ * Kernel bodies for numveclib.c, which includes this file once per
+ * element type and instruction set.  No include guard on purpose.
+ *
+ * The includer defines:
+ *   KNAME(f)      name of the instance of kernel f
+ *   KATTR         function attributes (e.g. a target() for AVX)
+ *   T, AT         element type, and the type to do arithmetic in
+ *   FROM_A(x)     convert an AT back to T
+ *
+ *   W             lanes per vector for element-wise kernels, or 0
+ *   V, LD, ST     the vector type and its unaligned load/store
+ *   SET1, ADD, MUL, MIN, MAX
+ *
+ *   DW            lanes of the double vector used by the reductions,
+ *   DV, DLD, DST  or 0.  DLD loads DW elements and widens them.
+ *   DSET1, DADD, DMUL, DMIN, DMAX
+ *
+ * The vector loops and the scalar tails must round identically, so the
+ * tails do their arithmetic in AT (float for f32 data), and MIN(a, b)
+ * and MAX(a, b) must mean a<b?a:b and a>b?a:b, as minpd/maxpd do.
+ * Reductions always accumulate in double.
+ */
+
+KATTR static void KNAME(add)(void* ap, const void* bp, int n)
+{
+    T* a = ap;
+    const T* b = bp;
+    int i = 0;
+#if W
+    for(; i + W <= n; i += W)
+        ST(a+i, ADD(LD(a+i), LD(b+i)));
+#endif
+    for(; i < n; i++)
+        a[i] = FROM_A((AT)a[i] + (AT)b[i]);
+}
+
+KATTR static void KNAME(adds)(void* ap, double s, int n)
+{
+    T* a = ap;
+    int i = 0;
+#if W
+    V vs = SET1(s);
+    for(; i + W <= n; i += W)
+        ST(a+i, ADD(LD(a+i), vs));
+#endif
+    for(; i < n; i++)
+        a[i] = FROM_A((AT)a[i] + (AT)s);
+}
+
+KATTR static void KNAME(scale)(void* ap, double s, int n)
+{
+    T* a = ap;
+    int i = 0;
+#if W
+    V vs = SET1(s);
+    for(; i + W <= n; i += W)
+        ST(a+i, MUL(LD(a+i), vs));
+#endif
+    for(; i < n; i++)
+        a[i] = FROM_A((AT)a[i] * (AT)s);
+}
+
+KATTR static void KNAME(axpy)(void* yp, double alpha, const void* xp, int n)
+{
+    T* y = yp;
+    const T* x = xp;
+    int i = 0;
+#if W
+    V va = SET1(alpha);
+    for(; i + W <= n; i += W)
+        ST(y+i, ADD(LD(y+i), MUL(va, LD(x+i))));
+#endif
+    for(; i < n; i++) {
+        AT p = (AT)alpha * (AT)x[i];
+        y[i] = FROM_A((AT)y[i] + p);
+    }
+}
+
+KATTR static void KNAME(clamp)(void* ap, double lo, double hi, int n)
+{
+    T* a = ap;
+    AT x, l = (AT)lo, h = (AT)hi;
+    int i = 0;
+#if W
+    V vl = SET1(lo), vh = SET1(hi);
+    for(; i + W <= n; i += W)
+        ST(a+i, MIN(MAX(LD(a+i), vl), vh));
+#endif
+    for(; i < n; i++) {
+        x = (AT)a[i];
+        x = x > l ? x : l;
+        a[i] = FROM_A(x < h ? x : h);
+    }
+}
+
+KATTR static double KNAME(sum)(const void* ap, int n)
+{
+    const T* a = ap;
+    double s = 0;
+    int i = 0;
+#if DW
+    double lanes[DW];
+    int j;
+    DV acc = DSET1(0);
+    for(; i + DW <= n; i += DW)
+        acc = DADD(acc, DLD(a+i));
+    DST(lanes, acc);
+    for(j=0; j<DW; j++) s += lanes[j];
+#endif
+    for(; i < n; i++)
+        s += a[i];
+    return s;
+}
+
+KATTR static double KNAME(dot)(const void* ap, const void* bp, int n)
+{
+    const T* a = ap;
+    const T* b = bp;
+    double s = 0;
+    int i = 0;
+#if DW
+    double lanes[DW];
+    int j;
+    DV acc = DSET1(0);
+    for(; i + DW <= n; i += DW)
+        acc = DADD(acc, DMUL(DLD(a+i), DLD(b+i)));
+    DST(lanes, acc);
+    for(j=0; j<DW; j++) s += lanes[j];
+#endif
+    for(; i < n; i++)
+        s += (double)a[i] * (double)b[i];
+    return s;
+}
+
+// n must be at least 1 for min and max
+KATTR static double KNAME(min)(const void* ap, int n)
+{
+    const T* a = ap;
+    double m = a[0], x;
+    int i = 0;
+#if DW
+    double lanes[DW];
+    int j;
+    DV acc = DSET1(m);
+    for(; i + DW <= n; i += DW)
+        acc = DMIN(DLD(a+i), acc);
+    DST(lanes, acc);
+    for(j=0; j<DW; j++) m = lanes[j] < m ? lanes[j] : m;
+#endif
+    for(; i < n; i++) {
+        x = a[i];
+        m = x < m ? x : m;
+    }
+    return m;
+}
+
+KATTR static double KNAME(max)(const void* ap, int n)
+{
+    const T* a = ap;
+    double m = a[0], x;
+    int i = 0;
+#if DW
+    double lanes[DW];
+    int j;
+    DV acc = DSET1(m);
+    for(; i + DW <= n; i += DW)
+        acc = DMAX(DLD(a+i), acc);
+    DST(lanes, acc);
+    for(j=0; j<DW; j++) m = lanes[j] > m ? lanes[j] : m;
+#endif
+    for(; i < n; i++) {
+        x = a[i];
+        m = x > m ? x : m;
+    }
+    return m;
+}
+
+#undef KNAME
+#undef KATTR
+#undef T
+#undef AT
+#undef FROM_A
+#undef W
+#undef V
+#undef LD
+#undef ST
+#undef SET1
+#undef ADD
+#undef MUL
+#undef MIN
+#undef MAX
+#undef DW
+#undef DV
+#undef DLD
+#undef DST
+#undef DSET1
+#undef DADD
+#undef DMUL
+#undef DMIN
+#undef DMAX
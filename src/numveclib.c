@@ -0,0 +1,449 @@
+#include <limits.h>
+#include <string.h>
+
+#include "data.h"
+#include "util.h"
+
+#define NEWSTR(c, s, l) naStr_fromdata(naNewString(c), s, l)
+#define NEWCSTR(c, s) NEWSTR(c, s, strlen(s))
+
+#define ARGERR() \
+    naRuntimeError(c, "bad/missing argument to numvec.%s()", (__FUNCTION__ + 2))
+
+static const char* typenames[] = { "f64", "f32", "i32" };
+static const int elemsz[] = { sizeof(double), sizeof(float), sizeof(int32_t) };
+
+static int32_t tosat(double d)
+{
+    if(d != d) return 0;
+    if(d > INT32_MAX) return INT32_MAX;
+    if(d < INT32_MIN) return INT32_MIN;
+    return (int32_t)d;
+}
+
+//
+// The kernels.  Each element type gets a portable scalar instance of
+// numveckern.h, and the float types also get SSE2 and AVX instances.
+// The best one the CPU supports is picked in naInit_numvec().
+//
+
+#define KNAME(f) f##_f64
+#define T double
+#define AT double
+#define FROM_A(x) (x)
+#define KATTR
+#define W 0
+#define DW 0
+#include "numveckern.h"
+
+#define KNAME(f) f##_f32
+#define T float
+#define AT float
+#define FROM_A(x) (float)(x)
+#define KATTR
+#define W 0
+#define DW 0
+#include "numveckern.h"
+
+#define KNAME(f) f##_i32
+#define T int32_t
+#define AT double
+#define FROM_A(x) tosat(x)
+#define KATTR
+#define W 0
+#define DW 0
+#include "numveckern.h"
+
+#ifdef NASAL_SSE2
+#define KNAME(f) f##_f64_sse2
+#define KATTR
+#define T double
+#define AT double
+#define FROM_A(x) (x)
+#define W 2
+#define V __m128d
+#define LD _mm_loadu_pd
+#define ST _mm_storeu_pd
+#define SET1 _mm_set1_pd
+#define ADD _mm_add_pd
+#define MUL _mm_mul_pd
+#define MIN _mm_min_pd
+#define MAX _mm_max_pd
+#define DW 2
+#define DV __m128d
+#define DLD _mm_loadu_pd
+#define DST _mm_storeu_pd
+#define DSET1 _mm_set1_pd
+#define DADD _mm_add_pd
+#define DMUL _mm_mul_pd
+#define DMIN _mm_min_pd
+#define DMAX _mm_max_pd
+#include "numveckern.h"
+
+#define KNAME(f) f##_f32_sse2
+#define KATTR
+#define T float
+#define AT float
+#define FROM_A(x) (float)(x)
+#define W 4
+#define V __m128
+#define LD _mm_loadu_ps
+#define ST _mm_storeu_ps
+#define SET1(d) _mm_set1_ps((float)(d))
+#define ADD _mm_add_ps
+#define MUL _mm_mul_ps
+#define MIN _mm_min_ps
+#define MAX _mm_max_ps
+#define DW 2
+#define DV __m128d
+#define DLD(p) _mm_cvtps_pd(_mm_castsi128_ps(_mm_loadl_epi64((const __m128i*)(p))))
+#define DST _mm_storeu_pd
+#define DSET1 _mm_set1_pd
+#define DADD _mm_add_pd
+#define DMUL _mm_mul_pd
+#define DMIN _mm_min_pd
+#define DMAX _mm_max_pd
+#include "numveckern.h"
+#endif
+
+#ifdef NASAL_AVX
+#define KNAME(f) f##_f64_avx
+#define KATTR NASAL_AVX_TARGET
+#define T double
+#define AT double
+#define FROM_A(x) (x)
+#define W 4
+#define V __m256d
+#define LD _mm256_loadu_pd
+#define ST _mm256_storeu_pd
+#define SET1 _mm256_set1_pd
+#define ADD _mm256_add_pd
+#define MUL _mm256_mul_pd
+#define MIN _mm256_min_pd
+#define MAX _mm256_max_pd
+#define DW 4
+#define DV __m256d
+#define DLD _mm256_loadu_pd
+#define DST _mm256_storeu_pd
+#define DSET1 _mm256_set1_pd
+#define DADD _mm256_add_pd
+#define DMUL _mm256_mul_pd
+#define DMIN _mm256_min_pd
+#define DMAX _mm256_max_pd
+#include "numveckern.h"
+
+#define KNAME(f) f##_f32_avx
+#define KATTR NASAL_AVX_TARGET
+#define T float
+#define AT float
+#define FROM_A(x) (float)(x)
+#define W 8
+#define V __m256
+#define LD _mm256_loadu_ps
+#define ST _mm256_storeu_ps
+#define SET1(d) _mm256_set1_ps((float)(d))
+#define ADD _mm256_add_ps
+#define MUL _mm256_mul_ps
+#define MIN _mm256_min_ps
+#define MAX _mm256_max_ps
+#define DW 4
+#define DV __m256d
+#define DLD(p) _mm256_cvtps_pd(_mm_loadu_ps(p))
+#define DST _mm256_storeu_pd
+#define DSET1 _mm256_set1_pd
+#define DADD _mm256_add_pd
+#define DMUL _mm256_mul_pd
+#define DMIN _mm256_min_pd
+#define DMAX _mm256_max_pd
+#include "numveckern.h"
+#endif
+
+struct Kernels {
+    void (*add)(void* a, const void* b, int n);
+    void (*adds)(void* a, double s, int n);
+    void (*scale)(void* a, double s, int n);
+    void (*axpy)(void* y, double alpha, const void* x, int n);
+    void (*clamp)(void* a, double lo, double hi, int n);
+    double (*sum)(const void* a, int n);
+    double (*dot)(const void* a, const void* b, int n);
+    double (*min)(const void* a, int n);
+    double (*max)(const void* a, int n);
+};
+
+#define KERNELS(sfx) { add_##sfx, adds_##sfx, scale_##sfx, axpy_##sfx, \
+        clamp_##sfx, sum_##sfx, dot_##sfx, min_##sfx, max_##sfx }
+
+static const struct Kernels scalarkern[] = {
+    KERNELS(f64), KERNELS(f32), KERNELS(i32)
+};
+#ifdef NASAL_SSE2
+static const struct Kernels sse2kern[] = {
+    KERNELS(f64_sse2), KERNELS(f32_sse2), KERNELS(i32)
+};
+#endif
+#ifdef NASAL_AVX
+static const struct Kernels avxkern[] = {
+    KERNELS(f64_avx), KERNELS(f32_avx), KERNELS(i32)
+};
+#endif
+
+static const struct Kernels* kern = scalarkern;
+static const char* kernname = "scalar";
+
+//
+// The library
+//
+
+static struct naNumVec* numvec(naRef r)
+{
+    return IS_NUMVEC(r) ? PTR(r).numvec : 0;
+}
+
+static double elem(struct naNumVec* v, int i)
+{
+    switch(v->etype) {
+    case NA_NUM_F32: return ((float*)v->data)[i];
+    case NA_NUM_I32: return ((int32_t*)v->data)[i];
+    }
+    return ((double*)v->data)[i];
+}
+
+// Element type named by args[i], defaulting to f64
+static int argtype(naContext c, int argc, naRef* args, int i)
+{
+    int t;
+    if(i >= argc || IS_NIL(args[i])) return NA_NUM_F64;
+    if(IS_STR(args[i]))
+        for(t=0; t<3; t++)
+            if(!strcmp(naStr_data(args[i]), typenames[t]))
+                return t;
+    naRuntimeError(c, "unknown numvec element type");
+    return -1;
+}
+
+static naRef newnv(naContext c, int etype, int n)
+{
+    if(n < 0 || n > INT_MAX / elemsz[etype])
+        naRuntimeError(c, "bad numvec size");
+    return naNewNumVec(c, etype, n);
+}
+
+// Checks that b matches a in element type and size
+static struct naNumVec* same(naContext c, struct naNumVec* a, naRef b)
+{
+    struct naNumVec* v = numvec(b);
+    if(!v || v->etype != a->etype || v->size != a->size)
+        naRuntimeError(c, "numvec arguments differ in type or size");
+    return v;
+}
+
+static double num(naContext c, naRef r)
+{
+    naRef n = naNumValue(r);
+    if(IS_NIL(n)) naRuntimeError(c, "non-numeric numvec argument");
+    return n.num;
+}
+
+static naRef f_new(naContext c, naRef me, int argc, naRef* args)
+{
+    int t;
+    double n;
+    if(argc < 1 || !naIsNum(args[0])) ARGERR();
+    t = argtype(c, argc, args, 1);
+    // Range check the double first: converting one out of int range
+    // (or a NaN) is undefined
+    n = args[0].num;
+    if(!(n >= 0 && n <= INT_MAX / elemsz[t]))
+        naRuntimeError(c, "bad numvec size");
+    return newnv(c, t, (int)n);
+}
+
+static naRef f_fromvec(naContext c, naRef me, int argc, naRef* args)
+{
+    naRef r;
+    int i, n;
+    if(argc < 1 || !naIsVector(args[0])) ARGERR();
+    n = naVec_size(args[0]);
+    r = newnv(c, argtype(c, argc, args, 1), n);
+    for(i=0; i<n; i++)
+        naNumVec_set(r, i, num(c, naVec_get(args[0], i)));
+    return r;
+}
+
+static naRef f_tovec(naContext c, naRef me, int argc, naRef* args)
+{
+    struct naNumVec* v = argc > 0 ? numvec(args[0]) : 0;
+    naRef r;
+    int i;
+    if(!v) ARGERR();
+    r = naNewVector(c);
+    naVec_setsize(c, r, v->size);
+    for(i=0; i<v->size; i++)
+        PTR(r).vec->rec->array[i] = naNum(elem(v, i));
+    return r;
+}
+
+static naRef f_copy(naContext c, naRef me, int argc, naRef* args)
+{
+    struct naNumVec* v = argc > 0 ? numvec(args[0]) : 0;
+    naRef r;
+    int i, t;
+    if(!v) ARGERR();
+    t = argc > 1 ? argtype(c, argc, args, 1) : v->etype;
+    r = newnv(c, t, v->size);
+    if(t == v->etype)
+        memcpy(PTR(r).numvec->data, v->data, (size_t)v->size * elemsz[t]);
+    else
+        for(i=0; i<v->size; i++)
+            naNumVec_set(r, i, elem(v, i));
+    return r;
+}
+
+static naRef f_type(naContext c, naRef me, int argc, naRef* args)
+{
+    struct naNumVec* v = argc > 0 ? numvec(args[0]) : 0;
+    if(!v) ARGERR();
+    return NEWCSTR(c, typenames[v->etype]);
+}
+
+static naRef f_fill(naContext c, naRef me, int argc, naRef* args)
+{
+    struct naNumVec* v = argc > 0 ? numvec(args[0]) : 0;
+    double d;
+    int i;
+    if(!v || argc < 2) ARGERR();
+    d = num(c, args[1]);
+    for(i=0; i<v->size; i++)
+        naNumVec_set(args[0], i, d);
+    return args[0];
+}
+
+static naRef f_add(naContext c, naRef me, int argc, naRef* args)
+{
+    struct naNumVec* v = argc > 0 ? numvec(args[0]) : 0;
+    if(!v || argc < 2) ARGERR();
+    if(IS_NUMVEC(args[1]))
+        kern[v->etype].add(v->data, same(c, v, args[1])->data, v->size);
+    else
+        kern[v->etype].adds(v->data, num(c, args[1]), v->size);
+    return args[0];
+}
+
+static naRef f_scale(naContext c, naRef me, int argc, naRef* args)
+{
+    struct naNumVec* v = argc > 0 ? numvec(args[0]) : 0;
+    if(!v || argc < 2) ARGERR();
+    kern[v->etype].scale(v->data, num(c, args[1]), v->size);
+    return args[0];
+}
+
+static naRef f_axpy(naContext c, naRef me, int argc, naRef* args)
+{
+    struct naNumVec* y = argc > 0 ? numvec(args[0]) : 0;
+    if(!y || argc < 3) ARGERR();
+    kern[y->etype].axpy(y->data, num(c, args[1]),
+                        same(c, y, args[2])->data, y->size);
+    return args[0];
+}
+
+static naRef f_clamp(naContext c, naRef me, int argc, naRef* args)
+{
+    struct naNumVec* v = argc > 0 ? numvec(args[0]) : 0;
+    if(!v || argc < 3) ARGERR();
+    kern[v->etype].clamp(v->data, num(c, args[1]), num(c, args[2]), v->size);
+    return args[0];
+}
+
+static naRef f_sum(naContext c, naRef me, int argc, naRef* args)
+{
+    struct naNumVec* v = argc > 0 ? numvec(args[0]) : 0;
+    if(!v) ARGERR();
+    return naNum(kern[v->etype].sum(v->data, v->size));
+}
+
+static naRef f_dot(naContext c, naRef me, int argc, naRef* args)
+{
+    struct naNumVec* v = argc > 0 ? numvec(args[0]) : 0;
+    if(!v || argc < 2) ARGERR();
+    return naNum(kern[v->etype].dot(v->data, same(c, v, args[1])->data,
+                                    v->size));
+}
+
+static naRef f_min(naContext c, naRef me, int argc, naRef* args)
+{
+    struct naNumVec* v = argc > 0 ? numvec(args[0]) : 0;
+    if(!v) ARGERR();
+    return v->size ? naNum(kern[v->etype].min(v->data, v->size)) : naNil();
+}
+
+static naRef f_max(naContext c, naRef me, int argc, naRef* args)
+{
+    struct naNumVec* v = argc > 0 ? numvec(args[0]) : 0;
+    if(!v) ARGERR();
+    return v->size ? naNum(kern[v->etype].max(v->data, v->size)) : naNil();
+}
+
+// Linear interpolation in a table at a fractional index, clamped to
+// the first and last entries.
+static double interp(struct naNumVec* t, double x)
+{
+    int i;
+    double a;
+    if(!(x > 0)) return elem(t, 0);
+    if(x >= t->size - 1) return elem(t, t->size - 1);
+    i = (int)x;
+    a = elem(t, i);
+    return a + (elem(t, i+1) - a) * (x - i);
+}
+
+static naRef f_interpolate(naContext c, naRef me, int argc, naRef* args)
+{
+    struct naNumVec *t = argc > 0 ? numvec(args[0]) : 0, *x, *out;
+    naRef r;
+    int i;
+    if(!t || !t->size || argc < 2) ARGERR();
+    if(!(x = numvec(args[1])))
+        return naNum(interp(t, num(c, args[1])));
+    r = newnv(c, NA_NUM_F64, x->size);
+    out = PTR(r).numvec;
+    for(i=0; i<x->size; i++)
+        ((double*)out->data)[i] = interp(t, elem(x, i));
+    return r;
+}
+
+static naCFuncItem funcs[] = {
+    { "new", f_new },
+    { "fromvec", f_fromvec },
+    { "tovec", f_tovec },
+    { "copy", f_copy },
+    { "type", f_type },
+    { "fill", f_fill },
+    { "add", f_add },
+    { "scale", f_scale },
+    { "axpy", f_axpy },
+    { "clamp", f_clamp },
+    { "sum", f_sum },
+    { "dot", f_dot },
+    { "min", f_min },
+    { "max", f_max },
+    { "interpolate", f_interpolate },
+    { 0 }
+};
+
+naRef naInit_numvec(naContext c)
+{
+    naRef ns = naGenLib(c, funcs);
+#ifdef NASAL_SSE2
+    kern = sse2kern;
+    kernname = "sse2";
+#endif
+#ifdef NASAL_AVX
+    if(naHasAVX()) {
+        kern = avxkern;
+        kernname = "avx";
+    }
+#endif
+    // Which kernels are in use, for benchmarks and bug reports
+    naAddSym(c, ns, "simd", NEWCSTR(c, kernname));
+    return ns;
+}
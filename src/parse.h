@@ -326,7 +326,7 @@ struct CodeGenerator {
     int codeAlloced;
 
     // Inst. -> line table, stores pairs of {ip, line}
-    unsigned short* lineIps;
+    unsigned int* lineIps;
     int nLineIps; // number of pairs
     int nextLineIp;
 
@@ -345,6 +345,12 @@ struct CodeGenerator {
 
     // Dynamic storage for constants, to be compiled into a static table
     naRef consts;
+
+    // Open addressed index of the interned constants by value: each
+    // slot holds an index into consts plus one, or zero when empty
+    int* constIndex;
+    int constSlots; // a power of two, or zero before the first constant
+    int nInterned;
 };
 
 void naParseError(struct Parser* p, char* msg, int line);
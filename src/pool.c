@@ -0,0 +1,113 @@
+#include "nasal.h"
+#include "code.h"
+
+// Most worker threads the pool will start
+#define MAXWORKERS 15
+
+/*
+ * A pool of plain C worker threads for data-parallel library code.
+ * Workers never touch the interpreter, so they are invisible to the
+ * GC bottleneck; a caller that hands them Nasal objects must keep
+ * those alive and unmodified until naParallelFor() returns (and
+ * should naModUnlock() around it, so other threads can collect
+ * meanwhile).
+ *
+ * Each job wakes every worker once through "work".  Workers (and the
+ * caller) claim task indices under "lock" until none are left, then
+ * each worker posts "done" once, so the caller knows that no worker
+ * can still be looking at the job when it returns.
+ */
+static struct {
+    int init;
+    int nworkers;
+    int busy; // a job is running; concurrent callers run serially
+    void* lock;
+    void* work;
+    void* done;
+    void (*fn)(void* arg, int i);
+    void* arg;
+    int next;
+    int n;
+} pool;
+
+// Claims and runs tasks of the current job until there are none left
+static void runtasks()
+{
+    for(;;) {
+        int i;
+        void (*fn)(void*, int);
+        void* arg;
+        naLock(pool.lock);
+        i = pool.next < pool.n ? pool.next++ : -1;
+        fn = pool.fn;
+        arg = pool.arg;
+        naUnlock(pool.lock);
+        if(i < 0) return;
+        fn(arg, i);
+    }
+}
+
+static void worker(void* unused)
+{
+    for(;;) {
+        naSemDown(pool.work);
+        runtasks();
+        naSemUp(pool.done, 1);
+    }
+}
+
+// Called with the global lock held
+static void initpool()
+{
+    int i, n = naNumCPUs() - 1;
+    if(n > MAXWORKERS) n = MAXWORKERS;
+    pool.lock = naNewLock();
+    pool.work = naNewSem();
+    pool.done = naNewSem();
+    for(i=0; i<n; i++)
+        if(!naStartThread(worker, 0))
+            break;
+    pool.nworkers = i;
+    pool.init = 1;
+}
+
+int naPoolSize()
+{
+    LOCK();
+    if(!pool.init) initpool();
+    UNLOCK();
+    return pool.nworkers + 1;
+}
+
+void naParallelFor(void (*fn)(void* arg, int i), void* arg, int n)
+{
+    int i, busy;
+    if(n < 2 || naPoolSize() < 2) {
+        for(i=0; i<n; i++) fn(arg, i);
+        return;
+    }
+
+    naLock(pool.lock);
+    busy = pool.busy;
+    if(!busy) {
+        pool.busy = 1;
+        pool.fn = fn;
+        pool.arg = arg;
+        pool.next = 0;
+        pool.n = n;
+    }
+    naUnlock(pool.lock);
+    if(busy) {
+        for(i=0; i<n; i++) fn(arg, i);
+        return;
+    }
+
+    naSemUp(pool.work, pool.nworkers);
+    runtasks();
+    for(i=0; i<pool.nworkers; i++)
+        naSemDown(pool.done);
+
+    naLock(pool.lock);
+    pool.busy = 0;
+    naUnlock(pool.lock);
+}
@@ -0,0 +1,1389 @@
+#include <limits.h>
+#include <setjmp.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "data.h"
+#include "code.h"
+
+/*
+ * Regular expressions that run in time linear in the text, however
+ * they are written, after Russ Cox's articles on RE2.  A pattern is
+ * parsed to a tree and compiled to a Thompson NFA program.  Searching
+ * runs the program as a DFA whose states (sets of program counters)
+ * are built lazily, as the text reaches them, and cached with the
+ * regex: one DFA finds where the leftmost match ends, and another, of
+ * the program compiled backwards, runs back from there to find where
+ * it starts.  Only then, and only if groups are wanted, does the much
+ * slower NFA simulation that tracks captures (a "Pike VM") run, over
+ * just the matched text.  Searches for patterns that start with a
+ * literal string skip ahead with naiStr_find() whenever the DFA is
+ * back in its start state, and patterns that are only a literal never
+ * run a DFA at all.
+ *
+ * Nothing backtracks, so there are no backreferences or lookaround,
+ * and alternatives and repeats are chosen as Perl would, leftmost
+ * first.  Matching is by byte: a UTF-8 character is several of them.
+ *
+ * Syntax: literal bytes and \-escaped punctuation, \n \t \r \f \v \0
+ * \xHH, . and [] [^] classes with ranges, \d \w \s and their negations
+ * \D \W \S (also in classes), ^ $ \A \z \b \B, ( ) (?: ) and |, and the
+ * repeats * + ? {n} {n,} {n,m}, each also lazy with a ? after it.
+ * Flags: i ignores ASCII case, m makes ^ and $ match at lines, and s
+ * lets . match newlines.  Without m, $ matches only at the very end,
+ * like \z: a final newline is not skipped over.
+ *
+ *   var re = regex.comp("(\\w+)@(\\w+)", "i");
+ *   re.exec(s, start)  -> [start, end, group1 start, end, ...] or []
+ *   re.search(s, start) -> [match, group1, ...] or nil
+ *   re.match(s)        -> 1 if all of s matches
+ *   re.split(s, max)   -> the pieces between matches
+ *   re.replace(s, repl, max) -> s with matches replaced: repl is a
+ *       string where $0..$99, ${n} and $$ stand for the groups and "$",
+ *       or a function called with the search() vector of each match
+ *
+ * The functions can also be called as regex.exec(re, s, start) etc.
+ * Groups that did not take part in a match are -1 in exec() and nil
+ * in search().
+ */
+
+#define MAXINST 20000 // program size, counted repeats expanded
+#define MAXREP 1000 // largest count in {n,m}
+#define MAXGROUPS 99
+#define MAXDEPTH 1000 // nesting of ( )
+#define MAXPREFIX 64
+#define DFAMEM (1 << 20) // bytes of cached states before a DFA starts over
+#define NBUCKET 1024
+
+#define F_ICASE 1
+#define F_MULTI 2
+#define F_DOTALL 4
+
+// What is on either side of a position, for the assertions
+#define EDGE 0 // the start or end of the text
+#define NEWLINE 1
+#define WORD 2
+#define OTHER 3
+
+enum { A_BOT, A_EOT, A_BOL, A_EOL, A_WORDB, A_NWORDB };
+
+enum { I_BYTE, I_SPLIT, I_JMP, I_SAVE, I_ASSERT, I_MATCH };
+
+struct Inst {
+    int op;
+    int arg; // byte class, capture slot or assertion
+    int x, y; // next instruction, and I_SPLIT's less preferred one
+};
+
+enum { N_BYTE, N_CAT, N_ALT, N_REP, N_GROUP, N_ASSERT };
+
+struct Node {
+    int type;
+    int a; // byte class, assertion, or first child (-1 for none)
+    int next; // next child of an N_CAT or N_ALT, or -1
+    int min, max, greedy; // N_REP (max -1 for no limit); min is
+                          // N_GROUP's number
+};
+
+typedef unsigned char Class[32];
+
+#define HASBIT(c, b) ((c)[(b) >> 3] & (1 << ((b) & 7)))
+#define SETBIT(c, b) ((c)[(b) >> 3] |= 1 << ((b) & 7))
+
+struct Prog {
+    struct Inst* inst;
+    int n, start;
+    int ustart; // start of an unanchored search, which loops over any byte
+};
+
+struct DState {
+    struct DState* chain; // in the hash bucket
+    unsigned int hash;
+    int index, ctx, n;
+    int start; // is the unanchored start state, where prefixes are skipped
+    int* pcs; // the threads, in priority order unless longest
+    int trans[1]; // per column: next state * 2, plus one when a match
+                  // ends before the byte; -1 until known
+};
+
+struct DFA {
+    struct Regex* re;
+    struct Prog* prog;
+    int longest; // or leftmost first
+    int back; // runs backwards through the text
+    struct DState** states;
+    int nstates, cap, flushes;
+    size_t mem;
+    struct DState* buckets[NBUCKET];
+    int *stack, *list, *seen, *added, gen; // scratch for step()
+};
+
+struct Regex {
+    struct Prog fwd, rev;
+    Class* cls;
+    int ncls;
+    int ngroups;
+    int anchored; // can only match at the start of the text
+    int literal; // is just the prefix, with no groups
+    unsigned char prefix[MAXPREFIX];
+    int prefixlen;
+    // Bytes that no class or assertion tells apart share a column of
+    // the DFA transition tables.  The last column is the text's edge.
+    unsigned char col[256];
+    unsigned char colbyte[257];
+    unsigned char colctx[257];
+    int ncols;
+    struct DFA *first, *longest, *back;
+    void* lock; // for the DFAs
+};
+
+static int isword(int b)
+{
+    return (b >= 'a' && b <= 'z') || (b >= 'A' && b <= 'Z')
+        || (b >= '0' && b <= '9') || b == '_';
+}
+
+static int bytectx(int b)
+{
+    return b == '\n' ? NEWLINE : isword(b) ? WORD : OTHER;
+}
+
+static int holds(int assertion, int before, int after)
+{
+    switch(assertion) {
+    case A_BOT: return before == EDGE;
+    case A_EOT: return after == EDGE;
+    case A_BOL: return before == EDGE || before == NEWLINE;
+    case A_EOL: return after == EDGE || after == NEWLINE;
+    case A_WORDB: return (before == WORD) != (after == WORD);
+    case A_NWORDB: return (before == WORD) == (after == WORD);
+    }
+    return 0;
+}
+
+// Doubles an array of *cap elements of size sz, if n have been used
+static void* grow(void* p, int n, int* cap, int sz)
+{
+    void* np;
+    if(n < *cap) return p;
+    *cap = *cap ? 2 * *cap : 16;
+    np = naAlloc(*cap * sz);
+    if(n) memcpy(np, p, n * sz);
+    naFree(p);
+    return np;
+}
+
+////////////////////////////////////////////////////////////////////////
+// Parsing
+////////////////////////////////////////////////////////////////////////
+
+struct Parser {
+    const unsigned char *p, *end;
+    int flags;
+    struct Node* nodes;
+    int nnodes, nodecap;
+    Class* cls;
+    int ncls, clscap;
+    int single[256]; // the class of just each byte, or -1
+    int ngroups, depth;
+    const char* err;
+    jmp_buf jump;
+};
+
+static void fail(struct Parser* p, const char* msg)
+{
+    p->err = msg;
+    longjmp(p->jump, 1);
+}
+
+static int newnode(struct Parser* p, int type, int a)
+{
+    struct Node* n;
+    p->nodes = grow(p->nodes, p->nnodes, &p->nodecap, sizeof(struct Node));
+    n = &p->nodes[p->nnodes];
+    n->type = type;
+    n->a = a;
+    n->next = -1;
+    n->min = n->max = 0;
+    n->greedy = 1;
+    return p->nnodes++;
+}
+
+// The only byte in c, or -1
+static int singlebyte(const unsigned char* c)
+{
+    int i, b = -1;
+    for(i=0; i<256; i++)
+        if(HASBIT(c, i)) {
+            if(b >= 0) return -1;
+            b = i;
+        }
+    return b;
+}
+
+// Adds the other case of each ASCII letter in c, for the i flag
+static void fold(struct Parser* p, unsigned char* c)
+{
+    int i;
+    if(p->flags & F_ICASE)
+        for(i='a'; i<='z'; i++)
+            if(HASBIT(c, i) || HASBIT(c, i - 32)) {
+                SETBIT(c, i);
+                SETBIT(c, i - 32);
+            }
+}
+
+// A node matching any byte of c.  Equal classes are stored once.
+static int classnode(struct Parser* p, const unsigned char* c)
+{
+    int i, b;
+    if((b = singlebyte(c)) >= 0 && p->single[b] >= 0)
+        return newnode(p, N_BYTE, p->single[b]);
+    if(b < 0)
+        for(i=0; i<p->ncls; i++)
+            if(!memcmp(p->cls[i], c, sizeof(Class)))
+                return newnode(p, N_BYTE, i);
+    p->cls = grow(p->cls, p->ncls, &p->clscap, sizeof(Class));
+    memcpy(p->cls[p->ncls], c, sizeof(Class));
+    if(b >= 0) p->single[b] = p->ncls;
+    return newnode(p, N_BYTE, p->ncls++);
+}
+
+// Adds \d, \w or \s (or their negations in upper case) to c, or
+// returns 0 if e is none of them
+static int perlclass(int e, unsigned char* c)
+{
+    int b, neg = e >= 'A' && e <= 'Z', in;
+    e |= 0x20;
+    if(e != 'd' && e != 'w' && e != 's') return 0;
+    for(b=0; b<256; b++) {
+        in = e == 'd' ? b >= '0' && b <= '9'
+            : e == 'w' ? isword(b)
+            : b == ' ' || (b >= '\t' && b <= '\r');
+        if(in != neg) SETBIT(c, b);
+    }
+    return 1;
+}
+
+static int hexval(int ch)
+{
+    if(ch >= '0' && ch <= '9') return ch - '0';
+    ch |= 0x20;
+    return ch >= 'a' && ch <= 'f' ? ch - 'a' + 10 : -1;
+}
+
+// The byte an escape stands for, after its backslash
+static int escbyte(struct Parser* p)
+{
+    int ch, i, h, v = 0;
+    if(p->p == p->end) fail(p, "trailing backslash");
+    switch(ch = *p->p++) {
+    case 'n': return '\n';
+    case 't': return '\t';
+    case 'r': return '\r';
+    case 'f': return '\f';
+    case 'v': return '\v';
+    case '0': return 0;
+    case 'x':
+        for(i=0; i<2; i++) {
+            if(p->p == p->end || (h = hexval(*p->p)) < 0)
+                fail(p, "bad \\x escape");
+            v = v * 16 + h;
+            p->p++;
+        }
+        return v;
+    }
+    // Escaped letters and digits are reserved for future meanings
+    if(isword(ch)) fail(p, "unknown escape");
+    return ch;
+}
+
+static int classbyte(struct Parser* p)
+{
+    if(*p->p++ != '\\') return p->p[-1];
+    return escbyte(p);
+}
+
+// A [...] class, after the [
+static int parsebracket(struct Parser* p)
+{
+    Class c;
+    int i, lo, hi, neg = 0, first = 1;
+    memset(c, 0, sizeof(c));
+    if(p->p < p->end && *p->p == '^') { neg = 1; p->p++; }
+    for(;; first = 0) {
+        if(p->p == p->end) fail(p, "missing ]");
+        if(*p->p == ']' && !first) { p->p++; break; }
+        if(*p->p == '\\' && p->p + 1 < p->end && perlclass(p->p[1], c)) {
+            p->p += 2;
+            continue;
+        }
+        lo = hi = classbyte(p);
+        if(p->p + 1 < p->end && *p->p == '-' && p->p[1] != ']') {
+            p->p++;
+            hi = classbyte(p);
+            if(hi < lo) fail(p, "bad range in []");
+        }
+        for(; lo <= hi; lo++) SETBIT(c, lo);
+    }
+    // Fold before negating, so [^a] excludes A too
+    fold(p, c);
+    if(neg) for(i=0; i<32; i++) c[i] = ~c[i];
+    return classnode(p, c);
+}
+
+static int parsealt(struct Parser* p);
+
+static int parseatom(struct Parser* p)
+{
+    Class c;
+    int ch = *p->p++, n, b;
+    memset(c, 0, sizeof(c));
+    switch(ch) {
+    case '(':
+        if(++p->depth > MAXDEPTH) fail(p, "nesting too deep");
+        if(p->p + 1 < p->end && p->p[0] == '?' && p->p[1] == ':') {
+            p->p += 2;
+            n = parsealt(p);
+        } else {
+            int g = ++p->ngroups;
+            if(g > MAXGROUPS) fail(p, "too many groups");
+            n = parsealt(p);
+            n = newnode(p, N_GROUP, n);
+            p->nodes[n].min = g;
+        }
+        if(p->p == p->end) fail(p, "missing )");
+        p->p++;
+        p->depth--;
+        return n;
+    case '[':
+        return parsebracket(p);
+    case '.':
+        for(b=0; b<256; b++)
+            if(b != '\n' || (p->flags & F_DOTALL)) SETBIT(c, b);
+        return classnode(p, c);
+    case '^':
+        return newnode(p, N_ASSERT, (p->flags & F_MULTI) ? A_BOL : A_BOT);
+    case '$':
+        return newnode(p, N_ASSERT, (p->flags & F_MULTI) ? A_EOL : A_EOT);
+    case '*': case '+': case '?':
+        fail(p, "nothing to repeat");
+        break;
+    case '\\':
+        if(p->p < p->end) {
+            switch(*p->p) {
+            case 'A': p->p++; return newnode(p, N_ASSERT, A_BOT);
+            case 'z': p->p++; return newnode(p, N_ASSERT, A_EOT);
+            case 'b': p->p++; return newnode(p, N_ASSERT, A_WORDB);
+            case 'B': p->p++; return newnode(p, N_ASSERT, A_NWORDB);
+            }
+            if(perlclass(*p->p, c)) {
+                p->p++;
+                return classnode(p, c);
+            }
+        }
+        ch = escbyte(p);
+        break;
+    }
+    SETBIT(c, ch);
+    fold(p, c);
+    return classnode(p, c);
+}
+
+// Reads a count for {n,m}, saturating at MAXREP+1
+static int count(const unsigned char** q)
+{
+    int n = 0;
+    for(; **q >= '0' && **q <= '9'; (*q)++)
+        if(n <= MAXREP) n = n * 10 + (**q - '0');
+    return n > MAXREP ? MAXREP + 1 : n;
+}
+
+// Parses {n}, {n,} or {n,m}.  Anything else starting with { is a
+// literal {, which consumes nothing here.
+static int parsecount(struct Parser* p, int* min, int* max)
+{
+    const unsigned char* q = p->p + 1;
+    const unsigned char* close = memchr(q, '}', p->end - q);
+    if(!close || q == close || *q < '0' || *q > '9') return 0;
+    *min = *max = count(&q);
+    if(*q == ',') {
+        q++;
+        *max = *q >= '0' && *q <= '9' ? count(&q) : -1;
+    }
+    if(q != close) return 0;
+    if(*min > MAXREP || *max > MAXREP) fail(p, "repeat count too large");
+    if(*max >= 0 && *max < *min) fail(p, "bad repeat count");
+    p->p = close + 1;
+    return 1;
+}
+
+static int parserep(struct Parser* p)
+{
+    int n = parseatom(p), min, max, r, ch, repeated = 0;
+    while(p->p < p->end) {
+        ch = *p->p;
+        if(ch == '*') { min = 0; max = -1; p->p++; }
+        else if(ch == '+') { min = 1; max = -1; p->p++; }
+        else if(ch == '?') { min = 0; max = 1; p->p++; }
+        else if(ch != '{' || !parsecount(p, &min, &max)) break;
+        if(repeated++) fail(p, "bad repetition");
+        r = newnode(p, N_REP, n);
+        p->nodes[r].min = min;
+        p->nodes[r].max = max;
+        if(p->p < p->end && *p->p == '?') {
+            p->nodes[r].greedy = 0;
+            p->p++;
+        }
+        n = r;
+    }
+    return n;
+}
+
+static int parsecat(struct Parser* p)
+{
+    int cat = newnode(p, N_CAT, -1), last = -1, n;
+    while(p->p < p->end && *p->p != '|' && *p->p != ')') {
+        n = parserep(p);
+        if(last < 0) p->nodes[cat].a = n;
+        else p->nodes[last].next = n;
+        last = n;
+    }
+    return cat;
+}
+
+static int parsealt(struct Parser* p)
+{
+    int alt, last, n;
+    n = parsecat(p);
+    alt = newnode(p, N_ALT, n);
+    for(last = n; p->p < p->end && *p->p == '|'; last = n) {
+        p->p++;
+        n = parsecat(p);
+        p->nodes[last].next = n;
+    }
+    return alt;
+}
+
+////////////////////////////////////////////////////////////////////////
+// Compiling
+////////////////////////////////////////////////////////////////////////
+
+// Instructions for node n, saturating at MAXINST+1
+static int progsize(struct Node* nodes, int n)
+{
+    struct Node* nd = &nodes[n];
+    double s = 0;
+    int k;
+    switch(nd->type) {
+    case N_BYTE: case N_ASSERT:
+        return 1;
+    case N_GROUP:
+        s = progsize(nodes, nd->a) + 2;
+        break;
+    case N_CAT:
+        for(k = nd->a; k >= 0 && s <= MAXINST; k = nodes[k].next)
+            s += progsize(nodes, k);
+        break;
+    case N_ALT:
+        for(k = nd->a; k >= 0 && s <= MAXINST; k = nodes[k].next)
+            s += progsize(nodes, k) + 2;
+        s -= 2;
+        break;
+    case N_REP:
+        k = progsize(nodes, nd->a);
+        s = (double)k * nd->min
+            + (nd->max < 0 ? k + 2 : (double)(nd->max - nd->min) * (k + 1));
+        break;
+    }
+    return s > MAXINST ? MAXINST + 1 : (int)s;
+}
+
+struct Emitter {
+    struct Node* nodes;
+    struct Inst* inst;
+    int n;
+    int back; // compiling the reversed program
+};
+
+static int emit(struct Emitter* e, int op, int arg)
+{
+    struct Inst* in = &e->inst[e->n];
+    in->op = op;
+    in->arg = arg;
+    in->x = e->n + 1;
+    in->y = -1;
+    return e->n++;
+}
+
+// Makes a split prefer its other branch
+static void lazy(struct Emitter* e, int pc)
+{
+    int x = e->inst[pc].x;
+    e->inst[pc].x = e->inst[pc].y;
+    e->inst[pc].y = x;
+}
+
+// Compiles node n.  Backwards, concatenations are reversed and groups
+// are not captured.
+static void gen(struct Emitter* e, int n)
+{
+    struct Node* nd = &e->nodes[n];
+    int i, k, split, jmp, patch = -1, nkids, *kids;
+    switch(nd->type) {
+    case N_BYTE:
+        emit(e, I_BYTE, nd->a);
+        break;
+    case N_ASSERT:
+        emit(e, I_ASSERT, nd->a);
+        break;
+    case N_GROUP:
+        if(!e->back) emit(e, I_SAVE, 2 * nd->min);
+        gen(e, nd->a);
+        if(!e->back) emit(e, I_SAVE, 2 * nd->min + 1);
+        break;
+    case N_CAT:
+        if(!e->back) {
+            for(k = nd->a; k >= 0; k = e->nodes[k].next) gen(e, k);
+            break;
+        }
+        for(nkids = 0, k = nd->a; k >= 0; k = e->nodes[k].next) nkids++;
+        if(!nkids) break;
+        kids = naAlloc(nkids * sizeof(int));
+        for(i = 0, k = nd->a; k >= 0; k = e->nodes[k].next) kids[i++] = k;
+        while(i--) gen(e, kids[i]);
+        naFree(kids);
+        break;
+    case N_ALT:
+        // The jumps out of each alternative are chained through their x
+        // until the end is known
+        for(k = nd->a; k >= 0; k = e->nodes[k].next) {
+            if(e->nodes[k].next < 0) { gen(e, k); break; }
+            split = emit(e, I_SPLIT, 0);
+            gen(e, k);
+            jmp = emit(e, I_JMP, 0);
+            e->inst[jmp].x = patch;
+            patch = jmp;
+            e->inst[split].y = e->n;
+        }
+        for(; patch >= 0; patch = k) {
+            k = e->inst[patch].x;
+            e->inst[patch].x = e->n;
+        }
+        break;
+    case N_REP:
+        for(i=0; i<nd->min; i++) gen(e, nd->a);
+        if(nd->max < 0) {
+            split = emit(e, I_SPLIT, 0);
+            gen(e, nd->a);
+            jmp = emit(e, I_JMP, 0);
+            e->inst[jmp].x = split;
+            e->inst[split].y = e->n;
+            if(!nd->greedy) lazy(e, split);
+            break;
+        }
+        // Each optional copy can skip to the end, chained through y
+        for(i = nd->min; i < nd->max; i++) {
+            split = emit(e, I_SPLIT, 0);
+            e->inst[split].y = patch;
+            patch = split;
+            gen(e, nd->a);
+        }
+        for(; patch >= 0; patch = k) {
+            k = e->inst[patch].y;
+            e->inst[patch].y = e->n;
+            if(!nd->greedy) lazy(e, patch);
+        }
+        break;
+    }
+}
+
+// Appends the bytes every match of node n starts with to the prefix,
+// and returns whether that is all n matches
+static int prefix(struct Regex* re, struct Node* nodes, int n)
+{
+    struct Node* nd = &nodes[n];
+    int k, b;
+    switch(nd->type) {
+    case N_BYTE:
+        if(re->prefixlen == MAXPREFIX
+           || (b = singlebyte(re->cls[nd->a])) < 0) return 0;
+        re->prefix[re->prefixlen++] = b;
+        return 1;
+    case N_GROUP:
+        return prefix(re, nodes, nd->a);
+    case N_CAT:
+        for(k = nd->a; k >= 0; k = nodes[k].next)
+            if(!prefix(re, nodes, k)) return 0;
+        return 1;
+    case N_ALT:
+        return nodes[nd->a].next < 0 && prefix(re, nodes, nd->a);
+    }
+    return 0;
+}
+
+// Whether every match of node n must be at the start of the text
+static int anchored(struct Node* nodes, int n)
+{
+    struct Node* nd = &nodes[n];
+    int k;
+    switch(nd->type) {
+    case N_ASSERT:
+        return nd->a == A_BOT;
+    case N_GROUP:
+        return anchored(nodes, nd->a);
+    case N_CAT:
+        return nd->a >= 0 && anchored(nodes, nd->a);
+    case N_ALT:
+        for(k = nd->a; k >= 0; k = nodes[k].next)
+            if(!anchored(nodes, k)) return 0;
+        return 1;
+    }
+    return 0;
+}
+
+// Splits the bytes into columns: first by their context for the
+// assertions, then by membership of each class in turn
+static void columns(struct Regex* re)
+{
+    int map[256], next[512], b, i, k, n = 4, m;
+    for(b=0; b<256; b++) map[b] = bytectx(b);
+    for(i=0; i<re->ncls; i++) {
+        for(k=0; k<2*n; k++) next[k] = -1;
+        for(m = b = 0; b<256; b++) {
+            k = 2 * map[b] + !!HASBIT(re->cls[i], b);
+            if(next[k] < 0) next[k] = m++;
+            map[b] = next[k];
+        }
+        n = m;
+    }
+    for(b=0; b<256; b++) {
+        re->col[b] = map[b];
+        re->colbyte[map[b]] = b;
+        re->colctx[map[b]] = bytectx(b);
+    }
+    re->colbyte[n] = 0;
+    re->colctx[n] = EDGE;
+    re->ncols = n + 1;
+}
+
+static struct DFA* newdfa(struct Regex* re, struct Prog* prog, int longest,
+                          int back)
+{
+    struct DFA* d = naAlloc(sizeof(struct DFA));
+    int n = prog->n;
+    memset(d, 0, sizeof(struct DFA));
+    d->re = re;
+    d->prog = prog;
+    d->longest = longest;
+    d->back = back;
+    d->stack = naAlloc(3 * n * sizeof(int));
+    d->list = naAlloc(n * sizeof(int));
+    d->seen = naAlloc(n * sizeof(int));
+    d->added = naAlloc(n * sizeof(int));
+    memset(d->seen, 0, n * sizeof(int));
+    memset(d->added, 0, n * sizeof(int));
+    return d;
+}
+
+static void flush(struct DFA* d)
+{
+    int i;
+    for(i=0; i<d->nstates; i++) naFree(d->states[i]);
+    d->nstates = 0;
+    d->mem = 0;
+    d->flushes++;
+    memset(d->buckets, 0, sizeof(d->buckets));
+}
+
+static void freedfa(struct DFA* d)
+{
+    flush(d);
+    naFree(d->states);
+    naFree(d->stack);
+    naFree(d->list);
+    naFree(d->seen);
+    naFree(d->added);
+    naFree(d);
+}
+
+static void refree(void* p)
+{
+    struct Regex* re = p;
+    freedfa(re->first);
+    freedfa(re->longest);
+    freedfa(re->back);
+    naFreeLock(re->lock);
+    naFree(re->fwd.inst);
+    naFree(re->rev.inst);
+    naFree(re->cls);
+    naFree(re);
+}
+
+static struct Regex* compile(naContext c, naRef pat, int flags)
+{
+    struct Parser p;
+    struct Emitter e;
+    struct Regex* re = 0;
+    Class all;
+    int i, root, size;
+
+    memset(&p, 0, sizeof(p));
+    // No Nasal allocation happens in here, so the bytes stay valid
+    p.p = naiStr_bytes(pat);
+    p.end = p.p + naStr_len(pat);
+    p.flags = flags;
+    for(i=0; i<256; i++) p.single[i] = -1;
+    if(setjmp(p.jump)) {
+        const unsigned char* s = naiStr_bytes(pat);
+        naFree(p.nodes);
+        naFree(p.cls);
+        naRuntimeError(c, "regex error: %s at offset %d", p.err,
+                       (int)(p.p - s));
+    }
+    root = parsealt(&p);
+    if(p.p != p.end) fail(&p, "unmatched )");
+    if((size = progsize(p.nodes, root)) > MAXINST)
+        fail(&p, "pattern too large");
+    memset(all, 0xff, sizeof(all));
+    i = classnode(&p, all);
+    i = p.nodes[i].a;
+
+    re = naAlloc(sizeof(struct Regex));
+    memset(re, 0, sizeof(struct Regex));
+    re->cls = p.cls;
+    re->ncls = p.ncls;
+    re->ngroups = p.ngroups;
+    re->anchored = anchored(p.nodes, root);
+    re->literal = prefix(re, p.nodes, root) && !re->ngroups;
+    columns(re);
+
+    // Forward: the match is group 0, and an unanchored search loops
+    // back to the start after any byte
+    e.nodes = p.nodes;
+    e.inst = naAlloc((size + 5) * sizeof(struct Inst));
+    e.n = 0;
+    e.back = 0;
+    emit(&e, I_SAVE, 0);
+    gen(&e, root);
+    emit(&e, I_SAVE, 1);
+    emit(&e, I_MATCH, 0);
+    re->fwd.start = 0;
+    re->fwd.ustart = emit(&e, I_SPLIT, 0);
+    e.inst[re->fwd.ustart].x = 0;
+    e.inst[re->fwd.ustart].y = e.n;
+    e.inst[emit(&e, I_BYTE, i)].x = re->fwd.ustart;
+    re->fwd.inst = e.inst;
+    re->fwd.n = e.n;
+
+    e.inst = naAlloc((size + 1) * sizeof(struct Inst));
+    e.n = 0;
+    e.back = 1;
+    gen(&e, root);
+    emit(&e, I_MATCH, 0);
+    re->rev.inst = e.inst;
+    re->rev.n = e.n;
+    re->rev.start = re->rev.ustart = 0;
+    naFree(p.nodes);
+
+    re->first = newdfa(re, &re->fwd, 0, 0);
+    re->longest = newdfa(re, &re->fwd, 1, 0);
+    re->back = newdfa(re, &re->rev, 1, 1);
+    re->lock = naNewLock();
+    return re;
+}
+
+////////////////////////////////////////////////////////////////////////
+// Matching
+////////////////////////////////////////////////////////////////////////
+
+// The index of the state of threads pcs[0..n-1] after a byte with
+// context ctx.  The caller's states may be gone if this had to start
+// the cache over.
+static int intern(struct DFA* d, int ctx, const int* pcs, int n)
+{
+    struct DState* s;
+    unsigned int h = 2166136261u;
+    int i, ncols = d->re->ncols;
+    size_t size;
+
+    if(n == 0) ctx = 0; // dead whatever came before
+    h = (h ^ ctx) * 16777619u;
+    for(i=0; i<n; i++) h = (h ^ pcs[i]) * 16777619u;
+    for(s = d->buckets[h % NBUCKET]; s; s = s->chain)
+        if(s->hash == h && s->ctx == ctx && s->n == n
+           && !memcmp(s->pcs, pcs, n * sizeof(int)))
+            return s->index;
+
+    size = sizeof(struct DState) + (ncols + n) * sizeof(int);
+    if(d->mem + size > DFAMEM) flush(d);
+    s = naAlloc(size);
+    s->hash = h;
+    s->ctx = ctx;
+    s->n = n;
+    s->start = n == 1 && pcs[0] == d->prog->ustart;
+    s->pcs = s->trans + ncols;
+    memcpy(s->pcs, pcs, n * sizeof(int));
+    for(i=0; i<ncols; i++) s->trans[i] = -1;
+    s->chain = d->buckets[h % NBUCKET];
+    d->buckets[h % NBUCKET] = s;
+    d->states = grow(d->states, d->nstates, &d->cap, sizeof(*d->states));
+    s->index = d->nstates;
+    d->states[d->nstates++] = s;
+    d->mem += size;
+    return s->index;
+}
+
+static int cmpint(const void* a, const void* b)
+{
+    return *(const int*)a - *(const int*)b;
+}
+
+// Computes and caches the transition of state si on column col
+static int step(struct DFA* d, int si, int col)
+{
+    struct Regex* re = d->re;
+    struct Inst* inst = d->prog->inst;
+    struct DState* s = d->states[si];
+    int before, after, i, pc, top, t, n = 0, matched = 0, flushes;
+    int b = re->colbyte[col], edge = col == re->ncols - 1;
+
+    if(d->back) { before = re->colctx[col]; after = s->ctx; }
+    else { before = s->ctx; after = re->colctx[col]; }
+    if(++d->gen == INT_MAX) {
+        memset(d->seen, 0, d->prog->n * sizeof(int));
+        memset(d->added, 0, d->prog->n * sizeof(int));
+        d->gen = 1;
+    }
+
+    // Follows the threads in order through everything but bytes, which
+    // give the next state's threads.  Leftmost first, the threads after
+    // a match can't win, so they are cut.
+    for(i=0; i<s->n && !(matched && !d->longest); i++) {
+        top = 0;
+        d->stack[top++] = s->pcs[i];
+        while(top) {
+            pc = d->stack[--top];
+            if(d->seen[pc] == d->gen) continue;
+            d->seen[pc] = d->gen;
+            switch(inst[pc].op) {
+            case I_JMP: case I_SAVE:
+                d->stack[top++] = inst[pc].x;
+                break;
+            case I_SPLIT:
+                d->stack[top++] = inst[pc].y;
+                d->stack[top++] = inst[pc].x;
+                break;
+            case I_ASSERT:
+                if(holds(inst[pc].arg, before, after))
+                    d->stack[top++] = inst[pc].x;
+                break;
+            case I_MATCH:
+                matched = 1;
+                if(!d->longest) top = 0;
+                break;
+            case I_BYTE:
+                if(!edge && HASBIT(re->cls[inst[pc].arg], b)
+                   && d->added[inst[pc].x] != d->gen) {
+                    d->added[inst[pc].x] = d->gen;
+                    d->list[n++] = inst[pc].x;
+                }
+                break;
+            }
+        }
+    }
+    // Order doesn't matter for the longest match, so the same set is
+    // the same state
+    if(d->longest) qsort(d->list, n, sizeof(int), cmpint);
+    flushes = d->flushes;
+    t = 2 * intern(d, re->colctx[col], d->list, n) + matched;
+    if(d->flushes == flushes) s->trans[col] = t;
+    return t;
+}
+
+#define NEXT(d, si, col) \
+    ((t = (d)->states[si]->trans[col]) >= 0 ? t : step((d), (si), (col)))
+
+// Where the leftmost match at or after start ends, or -1
+static int searchend(struct Regex* re, const unsigned char* s, int len,
+                     int start)
+{
+    struct DFA* d = re->first;
+    int pc = re->anchored ? re->fwd.start : re->fwd.ustart;
+    int i = start, last = -1, si, t, col, at;
+    si = intern(d, i ? bytectx(s[i-1]) : EDGE, &pc, 1);
+    while(1) {
+        if(re->prefixlen && d->states[si]->start) {
+            if((at = naiStr_find(s, len, re->prefix, re->prefixlen, i)) < 0)
+                return last;
+            if(at > i) {
+                i = at;
+                si = intern(d, bytectx(s[i-1]), &pc, 1);
+            }
+        }
+        col = i < len ? re->col[s[i]] : re->ncols - 1;
+        t = NEXT(d, si, col);
+        if(t & 1) last = i;
+        si = t >> 1;
+        if(i++ == len || d->states[si]->n == 0) return last;
+    }
+}
+
+// Where the leftmost match ending at end starts, not before lo
+static int searchstart(struct Regex* re, const unsigned char* s, int len,
+                       int end, int lo)
+{
+    struct DFA* d = re->back;
+    int pc = re->rev.start, i = end, first = -1, si, t, col;
+    si = intern(d, end < len ? bytectx(s[end]) : EDGE, &pc, 1);
+    while(1) {
+        col = i > 0 ? re->col[s[i-1]] : re->ncols - 1;
+        t = NEXT(d, si, col);
+        if(t & 1) first = i;
+        si = t >> 1;
+        if(i-- == lo || d->states[si]->n == 0) return first;
+    }
+}
+
+// Whether all of s matches
+static int fullmatch(struct Regex* re, const unsigned char* s, int len)
+{
+    struct DFA* d = re->longest;
+    int pc = re->fwd.start, i, si, t, col;
+    si = intern(d, EDGE, &pc, 1);
+    for(i=0; ; i++) {
+        col = i < len ? re->col[s[i]] : re->ncols - 1;
+        t = NEXT(d, si, col);
+        if(i == len) return t & 1;
+        si = t >> 1;
+        if(d->states[si]->n == 0) return 0;
+    }
+}
+
+struct Threads {
+    int n;
+    int* pc;
+    int* caps; // nsave for each thread
+};
+
+struct Pike {
+    struct Regex* re;
+    const unsigned char* s;
+    int len, nsave, gen;
+    int *mark, *stack;
+};
+
+// Adds the thread at pc, with captures caps, and everything it leads
+// to without reading a byte, in priority order.  The stack holds
+// triples: a pc, or a capture slot to put back after its subtree.
+static void addthread(struct Pike* vm, struct Threads* l, int pc, int pos,
+                      int* caps)
+{
+    struct Inst* inst = vm->re->fwd.inst;
+    int before = pos > 0 ? bytectx(vm->s[pos-1]) : EDGE;
+    int after = pos < vm->len ? bytectx(vm->s[pos]) : EDGE;
+    int *st = vm->stack, top = 0, slot;
+    st[top++] = pc; st[top++] = -1; st[top++] = 0;
+    while(top) {
+        top -= 3;
+        pc = st[top];
+        if((slot = st[top+1]) >= 0) {
+            caps[slot] = st[top+2];
+            continue;
+        }
+        if(vm->mark[pc] == vm->gen) continue;
+        vm->mark[pc] = vm->gen;
+        switch(inst[pc].op) {
+        case I_SAVE:
+            slot = inst[pc].arg;
+            st[top++] = 0; st[top++] = slot; st[top++] = caps[slot];
+            caps[slot] = pos;
+            // fall through
+        case I_JMP:
+            st[top++] = inst[pc].x; st[top++] = -1; st[top++] = 0;
+            break;
+        case I_SPLIT:
+            st[top++] = inst[pc].y; st[top++] = -1; st[top++] = 0;
+            st[top++] = inst[pc].x; st[top++] = -1; st[top++] = 0;
+            break;
+        case I_ASSERT:
+            if(holds(inst[pc].arg, before, after)) {
+                st[top++] = inst[pc].x; st[top++] = -1; st[top++] = 0;
+            }
+            break;
+        default:
+            l->pc[l->n] = pc;
+            memcpy(l->caps + l->n * vm->nsave, caps, vm->nsave * sizeof(int));
+            l->n++;
+        }
+    }
+}
+
+// Fills in the groups of the match from start to end, which the DFAs
+// have found, by running the NFA with captures over just that text
+static void groups(struct Regex* re, const unsigned char* s, int len,
+                   int start, int end, int* caps)
+{
+    struct Inst* inst = re->fwd.inst;
+    struct Pike vm;
+    struct Threads t[2], *cl = &t[0], *nl = &t[1], *tmp;
+    int i, pc, pos, n = re->fwd.n, *work;
+
+    vm.re = re;
+    vm.s = s;
+    vm.len = len;
+    vm.nsave = 2 * (re->ngroups + 1);
+    vm.gen = 1;
+    vm.mark = naAlloc(n * sizeof(int));
+    vm.stack = naAlloc(9 * n * sizeof(int));
+    memset(vm.mark, 0, n * sizeof(int));
+    work = naAlloc(vm.nsave * sizeof(int));
+    for(i=0; i<2; i++) {
+        t[i].n = 0;
+        t[i].pc = naAlloc(n * sizeof(int));
+        t[i].caps = naAlloc(n * vm.nsave * sizeof(int));
+    }
+
+    for(i=0; i<vm.nsave; i++) work[i] = -1;
+    addthread(&vm, cl, re->fwd.start, start, work);
+    for(pos = start; cl->n; pos++) {
+        vm.gen++;
+        nl->n = 0;
+        for(i=0; i<cl->n; i++) {
+            int* tc = cl->caps + i * vm.nsave;
+            pc = cl->pc[i];
+            if(inst[pc].op == I_MATCH) {
+                // Lower priority threads can't win now
+                memcpy(caps, tc, vm.nsave * sizeof(int));
+                break;
+            }
+            if(pos < end && HASBIT(re->cls[inst[pc].arg], s[pos])) {
+                memcpy(work, tc, vm.nsave * sizeof(int));
+                addthread(&vm, nl, inst[pc].x, pos + 1, work);
+            }
+        }
+        if(pos == end) break;
+        tmp = cl; cl = nl; nl = tmp;
+    }
+
+    for(i=0; i<2; i++) {
+        naFree(t[i].pc);
+        naFree(t[i].caps);
+    }
+    naFree(work);
+    naFree(vm.stack);
+    naFree(vm.mark);
+}
+
+// Finds the leftmost match in str at or after start, filling in m
+// with the start and end of it and (if wanted) of each group, or -1
+// for groups that did not match.
+static int find(struct Regex* re, naRef str, int start, int* m, int want)
+{
+    const unsigned char* s = naiStr_bytes(str);
+    int len = naStr_len(str), i, first, end;
+    if(start < 0) start = 0;
+    if(start > len) return 0;
+    for(i=2; i<2*(re->ngroups+1); i++) m[i] = -1;
+    if(re->literal) {
+        first = naiStr_find(s, len, re->prefix, re->prefixlen, start);
+        m[0] = first;
+        m[1] = first + re->prefixlen;
+        return first >= 0;
+    }
+    // The lock is never held while waiting for anything else, such as
+    // the garbage collector
+    naLock(re->lock);
+    end = searchend(re, s, len, start);
+    first = end < 0 || re->anchored ? start : searchstart(re, s, len, end, start);
+    naUnlock(re->lock);
+    if(end < 0) return 0;
+    m[0] = first;
+    m[1] = end;
+    if(want && re->ngroups) groups(re, s, len, first, end, m);
+    return 1;
+}
+
+////////////////////////////////////////////////////////////////////////
+// The library
+////////////////////////////////////////////////////////////////////////
+
+#define ARGERR() \
+    naRuntimeError(c, "bad/missing argument to regex.%s()", (__FUNCTION__ + 2))
+
+// The regex to work on: "me" for a method call on one, or else the
+// first argument, which is then taken off the list
+#define SELF(re) \
+    do { \
+        if(naGhost_type(me) == &RegexType) re = naGhost_ptr(me); \
+        else if(argc > 0 && naGhost_type(args[0]) == &RegexType) { \
+            re = naGhost_ptr(args[0]); args++; argc--; \
+        } else ARGERR(); \
+    } while(0)
+
+static naRef methods;
+
+static const char* getmember(naContext c, void* g, naRef key, naRef* out)
+{
+    return naHash_get(methods, key, out) ? "" : 0;
+}
+
+static naGhostType RegexType = { refree, "regex", getmember, 0 };
+
+static naRef f_comp(naContext c, naRef me, int argc, naRef* args)
+{
+    const unsigned char* f;
+    int i, n, flags = 0;
+    if(argc < 1 || !IS_STR(args[0])) ARGERR();
+    if(argc > 1 && !naIsNil(args[1])) {
+        if(!IS_STR(args[1])) ARGERR();
+        f = naiStr_bytes(args[1]);
+        for(i = 0, n = naStr_len(args[1]); i < n; i++) {
+            if(f[i] == 'i') flags |= F_ICASE;
+            else if(f[i] == 'm') flags |= F_MULTI;
+            else if(f[i] == 's') flags |= F_DOTALL;
+            else naRuntimeError(c, "unknown regex flag '%c'", f[i]);
+        }
+    }
+    return naNewGhost2(c, &RegexType, compile(c, args[0], flags));
+}
+
+// The string and optional start index arguments
+static int textargs(int argc, naRef* args, naRef* str)
+{
+    if(argc < 1 || !IS_STR(args[0])) return -1;
+    *str = args[0];
+    if(argc < 2 || naIsNil(args[1])) return 0;
+    if(!IS_NUM(args[1])) return -1;
+    return args[1].num > 0 ? (args[1].num < INT_MAX ? (int)args[1].num : INT_MAX) : 0;
+}
+
+static naRef f_exec(naContext c, naRef me, int argc, naRef* args)
+{
+    struct Regex* re = 0;
+    naRef str, r;
+    int m[2*(MAXGROUPS+1)], i, start;
+    SELF(re);
+    if((start = textargs(argc, args, &str)) < 0) ARGERR();
+    r = naNewVector(c);
+    if(find(re, str, start, m, 1))
+        for(i=0; i<2*(re->ngroups+1); i++) naVec_append(r, naNum(m[i]));
+    return r;
+}
+
+// The matched text and groups as strings, or nil for groups that
+// didn't match
+static naRef matchvec(naContext c, struct Regex* re, naRef str, int* m)
+{
+    naRef r = naNewVector(c);
+    int i;
+    for(i=0; i<=re->ngroups; i++)
+        naVec_append(r, m[2*i] < 0 ? naNil() :
+                     naStr_substr(naNewString(c), str, m[2*i],
+                                  m[2*i+1] - m[2*i]));
+    return r;
+}
+
+static naRef f_search(naContext c, naRef me, int argc, naRef* args)
+{
+    struct Regex* re = 0;
+    naRef str;
+    int m[2*(MAXGROUPS+1)], start;
+    SELF(re);
+    if((start = textargs(argc, args, &str)) < 0) ARGERR();
+    if(!find(re, str, start, m, 1)) return naNil();
+    return matchvec(c, re, str, m);
+}
+
+static naRef f_match(naContext c, naRef me, int argc, naRef* args)
+{
+    struct Regex* re = 0;
+    int r;
+    SELF(re);
+    if(argc < 1 || !IS_STR(args[0])) ARGERR();
+    naLock(re->lock);
+    r = fullmatch(re, naiStr_bytes(args[0]), naStr_len(args[0]));
+    naUnlock(re->lock);
+    return naNum(r);
+}
+
+// The next match at or after *at: like Perl and Go, an empty match
+// right where the last one ended doesn't count.  Sets *at to where the
+// search after this match starts.
+static int next(struct Regex* re, naRef str, int* at, int* last, int* m,
+                int want)
+{
+    int len = naStr_len(str);
+    while(find(re, str, *at, m, want)) {
+        if(m[1] == m[0] && m[0] == *last) {
+            if(m[0] >= len) return 0;
+            *at = m[0] + 1;
+            continue;
+        }
+        *last = m[1];
+        *at = m[1] > m[0] ? m[1] : m[1] + 1;
+        return 1;
+    }
+    return 0;
+}
+
+// The number of matches to go by, from an optional argument
+static int maxarg(naContext c, int argc, naRef* args, int i)
+{
+    if(argc <= i || naIsNil(args[i])) return INT_MAX;
+    if(!IS_NUM(args[i])) naRuntimeError(c, "bad count argument to regex");
+    return args[i].num >= 0 ? (args[i].num < INT_MAX ? (int)args[i].num : INT_MAX) : 0;
+}
+
+static naRef f_split(naContext c, naRef me, int argc, naRef* args)
+{
+    struct Regex* re = 0;
+    naRef str, r;
+    int m[2*(MAXGROUPS+1)], at = 0, last = -1, from = 0, max, n = 0;
+    SELF(re);
+    if(argc < 1 || !IS_STR(args[0])) ARGERR();
+    str = args[0];
+    max = maxarg(c, argc, args, 1);
+    r = naNewVector(c);
+    while(n++ < max && next(re, str, &at, &last, m, 0)) {
+        naVec_append(r, naStr_substr(naNewString(c), str, from, m[0] - from));
+        from = m[1];
+    }
+    naVec_append(r, naStr_substr(naNewString(c), str, from,
+                                 naStr_len(str) - from));
+    return r;
+}
+
+struct Buf {
+    unsigned char* d;
+    int n, cap;
+};
+
+static void put(naContext c, struct Buf* b, const unsigned char* s, int n)
+{
+    if((double)b->n + n > INT_MAX) {
+        naFree(b->d);
+        naRuntimeError(c, "regex.replace() result too long");
+    }
+    while(b->n + n > b->cap) {
+        int cap = b->cap ? (b->cap < INT_MAX / 2 ? 2 * b->cap : INT_MAX) : 256;
+        unsigned char* d = naAlloc(cap);
+        if(b->n) memcpy(d, b->d, b->n);
+        naFree(b->d);
+        b->d = d;
+        b->cap = cap;
+    }
+    memcpy(b->d + b->n, s, n);
+    b->n += n;
+}
+
+// A $n, ${n} or $$ at repl[i], returning its length, with the group
+// in *g (-1 for $$), or 0 if there is none
+static int groupref(const unsigned char* repl, int rl, int i, int* g)
+{
+    int j = i + 1, brace = j < rl && repl[j] == '{';
+    if(j < rl && repl[j] == '$') { *g = -1; return 2; }
+    if(brace) j++;
+    if(j >= rl || repl[j] < '0' || repl[j] > '9') return 0;
+    *g = repl[j++] - '0';
+    if(j < rl && repl[j] >= '0' && repl[j] <= '9')
+        *g = *g * 10 + repl[j++] - '0';
+    if(brace) {
+        if(j >= rl || repl[j] != '}') return 0;
+        j++;
+    }
+    return j - i;
+}
+
+static naRef f_replace(naContext c, naRef me, int argc, naRef* args)
+{
+    struct Regex* re = 0;
+    struct Buf out;
+    naRef str, repl, r, pieces;
+    const unsigned char *s, *rs;
+    int m[2*(MAXGROUPS+1)], at = 0, last = -1, from = 0, max, n = 0;
+    int i, k, g, rl;
+    SELF(re);
+    if(argc < 2 || !IS_STR(args[0])) ARGERR();
+    str = args[0];
+    repl = args[1];
+    max = maxarg(c, argc, args, 2);
+
+    if(IS_STR(repl)) {
+        // No Nasal allocation happens until the end, so the bytes stay
+        // valid; groupref() is checked before any output is buffered
+        rs = naiStr_bytes(repl);
+        rl = naStr_len(repl);
+        for(i=0; i<rl; i++)
+            if(rs[i] == '$' && (k = groupref(rs, rl, i, &g))) {
+                if(g > re->ngroups)
+                    naRuntimeError(c, "regex.replace(): no group %d", g);
+                i += k - 1;
+            }
+        memset(&out, 0, sizeof(out));
+        s = naiStr_bytes(str);
+        while(n++ < max && next(re, str, &at, &last, m, 1)) {
+            put(c, &out, s + from, m[0] - from);
+            for(i=0; i<rl; ) {
+                if(rs[i] != '$' || !(k = groupref(rs, rl, i, &g))) {
+                    for(k = i + 1; k < rl && rs[k] != '$'; k++) {}
+                    put(c, &out, rs + i, k - i);
+                    i = k;
+                    continue;
+                }
+                if(g < 0) put(c, &out, (const unsigned char*)"$", 1);
+                else if(m[2*g] >= 0) put(c, &out, s + m[2*g], m[2*g+1] - m[2*g]);
+                i += k;
+            }
+            from = m[1];
+        }
+        put(c, &out, s + from, naStr_len(str) - from);
+        r = naStr_fromdata(naNewString(c), (char*)out.d, out.n);
+        naFree(out.d);
+        return r;
+    }
+
+    if(!naIsFunc(repl)) ARGERR();
+    // The function can run anything, so the pieces are kept in a vector
+    // until they are joined
+    pieces = naNewVector(c);
+    naiHold(c, pieces);
+    while(n++ < max && next(re, str, &at, &last, m, 1)) {
+        naRef v = matchvec(c, re, str, m), sub;
+        naVec_append(pieces, naStr_substr(naNewString(c), str, from,
+                                          m[0] - from));
+        from = m[1];
+        sub = naiCallInline(c, repl, 1, &v);
+        sub = naStringValue(c, sub);
+        if(!naIsNil(sub)) naVec_append(pieces, sub);
+    }
+    naVec_append(pieces, naStr_substr(naNewString(c), str, from,
+                                      naStr_len(str) - from));
+    memset(&out, 0, sizeof(out));
+    for(i=0, n=naVec_size(pieces); i<n; i++) {
+        naRef p = naVec_get(pieces, i);
+        put(c, &out, naiStr_bytes(p), naStr_len(p));
+    }
+    r = naStr_fromdata(naNewString(c), (char*)out.d, out.n);
+    naFree(out.d);
+    return r;
+}
+
+static naCFuncItem funcs[] = {
+    { "comp", f_comp },
+    { "exec", f_exec },
+    { "search", f_search },
+    { "match", f_match },
+    { "split", f_split },
+    { "replace", f_replace },
+    { 0 }
+};
+
+// The module is also where compiled regexes find their methods, so it
+// is kept from the garbage collector here
+naRef naInit_regex(naContext c)
+{
+    methods = naGenLib(c, funcs);
+    naSave(c, methods);
+    return methods;
+}
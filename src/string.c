@@ -1,32 +1,141 @@
+#include <float.h>
 #include <math.h>
+#include <stddef.h>
 #include <string.h>
 
 #include "nasal.h"
 #include "data.h"
+#include "code.h"
+#include "util.h"
 
-// The maximum number of significant (decimal!) figures in an IEEE
-// double.
-#define DIGITS 16
+// Room for any number printed by fromnum()
+#define NUMBUF 32
 
 static int tonum(unsigned char* s, int len, double* result);
 static int fromnum(double val, unsigned char* s);
 
-#define LEN(s) ((s)->emblen != -1 ? (s)->emblen : (s)->data.ref.len)
-#define DATA(s) ((s)->emblen != -1 ? (s)->data.buf : (s)->data.ref.ptr)
+/*
+ * Repeated concatenation (s ~= piece in a loop, or sprintf building its
+ * result) would be quadratic if every result were a fresh copy.  So
+ * results of at least MINBUILD bytes are "builder" strings (emblen
+ * BUILDER): data.ref.ptr points data.ref.off bytes into a growable
+ * StrBuf, shared with other builder strings.  A buffer's bytes below
+ * "used" are never rewritten, so each string sharing it is just a
+ * range of it.  Concatenating onto the string that ends exactly at
+ * "used" claims the room after it (by compare-and-swap, as threads may
+ * race for it) and writes only the new part.
+ *
+ * The same sharing makes substrings (substr(), split()) of at least
+ * MINVIEW bytes cheap: they are builder strings pointing into their
+ * parent's buffer.  A parent that owns a private buffer gets moved into
+ * a StrBuf first (see share()).
+ *
+ * Builder strings need not be nul terminated, and their bytes must not
+ * be written, so naStr_data() first "flattens" them into a private
+ * buffer.  That goes through FLATTENING, under the global lock, so that
+ * concurrent readers can tell a stale buffer pointer from a fresh one.
+ * The code in this file reads them in place.  The GC counts the bytes
+ * of each buffer that live strings use, frees the buffers no string
+ * uses, and copies out the strings using a buffer that is mostly
+ * garbage (SPARSE), so that a short substring can't keep a big parent
+ * alive.
+ */
+#define MINBUILD 64
+#define MINVIEW (MAX_STR_EMBLEN + 1)
+#define BUILDER -2
+#define FLATTENING -3
+
+#define SPARSE(b) ((b)->used >= 4096 && (b)->live < (b)->used / 4)
+
+struct StrBuf {
+    struct StrBuf* next; // every buffer, for the GC
+    int used;
+    int cap; // excluding the terminator
+    size_t live; // bytes used by live strings, counted by the GC
+    unsigned char data[];
+};
+
+static struct StrBuf* strbufs;
+
+/*
+ * Strings used as numbers or booleans are usually the same ones over
+ * and over (values read from files, property names), so the result of
+ * tonum() is cached: numstate is NUM_VALID when num holds the value,
+ * and NUM_INVALID when the string is not a number.  The first thread
+ * to parse claims the cache by moving it to NUM_BUSY.  Anything that
+ * changes the contents resets it, and so does naStr_data() on strings
+ * that are still writable (not yet hashed).
+ *
+ * Strings that are not numbers can hold the utf8 library's character
+ * index in the same slot instead (NUM_UTF8, which also means invalid).
+ * Threads may be reading an index that gets dropped, so it is freed
+ * later, like the buffers of flattened strings.
+ */
+#define NUM_UNKNOWN 0
+#define NUM_BUSY 1
+#define NUM_VALID 2
+#define NUM_INVALID 3
+#define NUM_UTF8 4
+
+#define EMBLEN(s) naLoadAcquire(&(s)->emblen)
+#define LEN(s) (EMBLEN(s) >= 0 ? (s)->emblen : (s)->data.ref.len)
+#define DATA(s) (EMBLEN(s) >= 0 ? (s)->data.buf \
+                 : naLoadAcquire(&(s)->data.ref.ptr))
+#define STRBUF(p, off) \
+    ((struct StrBuf*)((p) - (off) - offsetof(struct StrBuf, data)))
 
 int naStr_len(naRef s)
 {
     return IS_STR(s) ? LEN(PTR(s).str) : 0;
 }
 
+const unsigned char* naiStr_bytes(naRef s)
+{
+    return IS_STR(s) ? DATA(PTR(s).str) : 0;
+}
+
+static void flatten(struct naStr* s)
+{
+    unsigned char* p;
+    LOCK();
+    if(s->emblen == BUILDER) {
+        naStoreRelease(&s->emblen, FLATTENING);
+        p = naAlloc(s->data.ref.len + 1);
+        memcpy(p, s->data.ref.ptr, s->data.ref.len);
+        p[s->data.ref.len] = 0;
+        naStoreRelease(&s->data.ref.ptr, p);
+        naStoreRelease(&s->emblen, -1);
+    }
+    UNLOCK();
+}
+
+// Forgets the cached number or index, as the contents may change
+static void uncache(struct naStr* s)
+{
+    unsigned char state = naLoadRelaxed(&s->numstate);
+    if(state == NUM_UTF8) {
+        if(naCompareSwap(&s->numstate, state, NUM_UNKNOWN)) {
+            LOCK();
+            naiGC_deferfree(s->cache.utf8);
+            UNLOCK();
+        }
+    } else if(state) {
+        naStoreRelaxed(&s->numstate, NUM_UNKNOWN);
+    }
+}
+
 char* naStr_data(naRef s)
 {
-    return IS_STR(s) ? (char*)DATA(PTR(s).str) : 0;
+    if(!IS_STR(s)) return 0;
+    if(EMBLEN(PTR(s).str) < -1) flatten(PTR(s).str);
+    if(!PTR(s).str->hashcode) uncache(PTR(s).str);
+    return (char*)DATA(PTR(s).str);
 }
 
 static void setlen(struct naStr* s, int sz)
 {
     if(s->emblen == -1 && DATA(s)) naFree(s->data.ref.ptr);
+    uncache(s);
     if(sz > MAX_STR_EMBLEN) {
         s->emblen = -1;
         s->data.ref.len = sz;
@@ -38,6 +147,91 @@ static void setlen(struct naStr* s, int sz)
     DATA(s)[sz] = 0; // nul terminate
 }
 
+// Makes dst a builder string for len bytes of buf from off
+static void setbuilder(struct naStr* dst, struct StrBuf* buf, int off, int len)
+{
+    if(dst->emblen == -1 && dst->data.ref.ptr) naFree(dst->data.ref.ptr);
+    uncache(dst);
+    dst->emblen = BUILDER;
+    dst->data.ref.len = len;
+    dst->data.ref.off = off;
+    dst->data.ref.ptr = buf->data + off;
+}
+
+static struct StrBuf* newbuf(const unsigned char* data, int len, int cap)
+{
+    struct StrBuf* buf = naAlloc(sizeof(struct StrBuf) + cap + 1);
+    buf->cap = cap;
+    buf->used = len;
+    buf->live = 0;
+    memcpy(buf->data, data, len);
+    buf->data[len] = 0;
+    LOCK();
+    buf->next = strbufs;
+    strbufs = buf;
+    UNLOCK();
+    return buf;
+}
+
+// Makes s a builder string if it isn't, returning whether it is.  Only
+// private buffers of at least MINBUILD bytes move; shorter strings are
+// cheaper to copy from.  Other threads may be reading the old buffer,
+// so it gets freed later.
+static int share(struct naStr* s)
+{
+    struct StrBuf* buf;
+    unsigned char* old;
+    int len;
+    if(EMBLEN(s) == BUILDER) return 1;
+    if(EMBLEN(s) != -1 || (len = s->data.ref.len) < MINBUILD) return 0;
+    buf = newbuf(DATA(s), len, len);
+    LOCK();
+    // A racing share() wins, and buf is left for the GC
+    if(s->emblen == -1) {
+        old = s->data.ref.ptr;
+        naStoreRelaxed(&s->data.ref.off, 0);
+        naStoreRelease(&s->data.ref.ptr, buf->data);
+        naStoreRelease(&s->emblen, BUILDER);
+        naiGC_deferfree(old);
+    }
+    UNLOCK();
+    return EMBLEN(s) == BUILDER;
+}
+
+// The buffer of s and the offset of its bytes in it, or null if s is
+// not a builder string.  The pointer is a buffer's only if s was
+// (still) BUILDER after reading it, as flatten() changes emblen first.
+// The offset goes with the pointer only if that didn't change either,
+// as a flattened string can be shared again.
+static struct StrBuf* bufof(struct naStr* s, int* off)
+{
+    unsigned char* p;
+    if(EMBLEN(s) != BUILDER) return 0;
+    p = naLoadAcquire(&s->data.ref.ptr);
+    *off = naLoadRelaxed(&s->data.ref.off);
+    if(EMBLEN(s) != BUILDER || naLoadAcquire(&s->data.ref.ptr) != p) return 0;
+    return STRBUF(p, *off);
+}
+
+// Appends b to a in place, if a ends where a buffer's contents do and
+// the buffer has room
+static int extend(struct naStr* dst, struct naStr* a, struct naStr* b)
+{
+    struct StrBuf* buf;
+    int alen, blen, used, off;
+
+    if(!(buf = bufof(a, &off))) return 0;
+    alen = a->data.ref.len;
+    used = off + alen;
+    blen = LEN(b);
+    if(buf->cap - used < blen || !naCompareSwap(&buf->used, used, used + blen))
+        return 0;
+    memcpy(buf->data + used, DATA(b), blen);
+    buf->data[used + blen] = 0;
+    setbuilder(dst, buf, off, alen + blen);
+    return 1;
+}
+
 naRef naStr_buf(naRef dst, int len)
 {
     setlen(PTR(dst).str, len);
@@ -58,19 +252,81 @@ naRef naStr_concat(naRef dest, naRef s1, naRef s2)
     struct naStr* dst = PTR(dest).str;
     struct naStr* a = PTR(s1).str;
     struct naStr* b = PTR(s2).str;
+    struct StrBuf* buf;
+    int alen, blen;
     if(!(IS_STR(s1)&&IS_STR(s2)&&IS_STR(dest))) return naNil();
-    setlen(dst, LEN(a) + LEN(b));
-    memcpy(DATA(dst), DATA(a), LEN(a));
-    memcpy(DATA(dst) + LEN(a), DATA(b), LEN(b));
+    if(extend(dst, a, b)) return dest;
+    alen = LEN(a);
+    blen = LEN(b);
+    if(alen + blen < MINBUILD) {
+        setlen(dst, alen + blen);
+        memcpy(DATA(dst), DATA(a), alen);
+        memcpy(DATA(dst) + alen, DATA(b), blen);
+        return dest;
+    }
+
+    // Leave room to grow by half again
+    buf = newbuf(DATA(a), alen, (alen + blen) * 3 / 2);
+    memcpy(buf->data + alen, DATA(b), blen);
+    buf->data[alen + blen] = 0;
+    buf->used = alen + blen;
+    setbuilder(dst, buf, 0, alen + blen);
     return dest;
 }
 
+void naiStr_gcmark(struct naStr* s)
+{
+    if(s->emblen == BUILDER)
+        STRBUF(s->data.ref.ptr, s->data.ref.off)->live += s->data.ref.len;
+}
+
+// Called by the GC for each live string, after marking: copies the
+// string out of a buffer that would mostly be kept alive for nothing.
+// All other threads are stopped.
+void naiStr_gckeep(struct naStr* s)
+{
+    struct StrBuf* buf;
+    unsigned char* p;
+    int len = s->data.ref.len;
+    if(s->emblen != BUILDER) return;
+    buf = STRBUF(s->data.ref.ptr, s->data.ref.off);
+    if(!SPARSE(buf)) return;
+    p = naAlloc(len + 1);
+    memcpy(p, s->data.ref.ptr, len);
+    p[len] = 0;
+    s->data.ref.ptr = p;
+    s->emblen = -1;
+    buf->live -= len;
+}
+
+// Frees the buffers no live string uses.  Called by the GC
+// after marking, with the global lock held.
+void naiStr_gcsweep()
+{
+    struct StrBuf **p = &strbufs, *buf;
+    while((buf = *p)) {
+        if(buf->live) {
+            buf->live = 0;
+            p = &buf->next;
+        } else {
+            *p = buf->next;
+            naFree(buf);
+        }
+    }
+}
+
 naRef naStr_substr(naRef dest, naRef str, int start, int len)
 {
     struct naStr* dst = PTR(dest).str;
     struct naStr* s = PTR(str).str;
+    struct StrBuf* buf;
+    int off;
     if(!(IS_STR(dest)&&IS_STR(str))) return naNil();
     if(start + len > LEN(s)) return naNil();
+    if(len >= MINVIEW && share(s) && (buf = bufof(s, &off))) {
+        setbuilder(dst, buf, off + start, len);
+        return dest;
+    }
     setlen(dst, len);
     memcpy(DATA(dst), DATA(s) + start, len);
     return dest;
@@ -80,16 +336,192 @@ int naStr_equal(naRef s1, naRef s2)
 {
     struct naStr* a = PTR(s1).str;
     struct naStr* b = PTR(s2).str;
-    if(DATA(a) == DATA(b)) return 1;
     if(LEN(a) != LEN(b)) return 0;
+    if(DATA(a) == DATA(b)) return 1;
     if(memcmp(DATA(a), DATA(b), LEN(a)) == 0) return 1;
     return 0;
 }
 
+/*
+ * Substring search, shared by find(), split(), contains() and the
+ * string methods.  Candidate positions are found by comparing the
+ * needle's first and last bytes against a block of positions at once
+ * (32 with AVX2, 16 with SSE2, else one memchr() hit at a time), and
+ * then checked with memcmp().  That is quick on real text, but
+ * quadratic for inputs like "aaab" in "aaaa...", so once the checks
+ * have cost much more than the distance scanned, the rest of the
+ * search switches to the linear Two-Way algorithm.
+ */
+
+// Bytes of failed checks allowed before switching, given the distance
+// scanned
+#define SCANWORK(d) (4L * (d) + 4096)
+
+// The scanners return the first match from *ip on, -1 for none, or -2
+// when the checks got too expensive, with *ip set to where to resume.
+// nl must be at least 2.
+static int scanscalar(const unsigned char* h, int hl, const unsigned char* n,
+                      int nl, int start, int* ip, long* work)
+{
+    const unsigned char* p;
+    int i = *ip, last = hl - nl;
+    while(i <= last) {
+        if(!(p = memchr(h + i, n[0], last - i + 1))) return -1;
+        i = p - h;
+        if(h[i+nl-1] == n[nl-1]) {
+            if(!memcmp(h+i+1, n+1, nl-2)) return i;
+            if((*work += nl) > SCANWORK(i - start)) { *ip = i; return -2; }
+        }
+        i++;
+    }
+    return -1;
+}
+
+#ifdef NASAL_SSE2
+static int scansse2(const unsigned char* h, int hl, const unsigned char* n,
+                    int nl, int start, int* ip, long* work)
+{
+    __m128i f = _mm_set1_epi8((char)n[0]), l = _mm_set1_epi8((char)n[nl-1]);
+    int i = *ip, last = hl - nl, k;
+    unsigned int m;
+    for(; i + 15 <= last; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(h + i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(h + i + nl - 1));
+        m = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, f),
+                                            _mm_cmpeq_epi8(b, l)));
+        for(; m; m &= m - 1) {
+            k = i + ctz32(m);
+            if(!memcmp(h+k+1, n+1, nl-2)) return k;
+            if((*work += nl) > SCANWORK(k - start)) { *ip = k; return -2; }
+        }
+    }
+    *ip = i;
+    return scanscalar(h, hl, n, nl, start, ip, work);
+}
+#endif
+
+#ifdef NASAL_AVX
+NASAL_AVX2_TARGET
+static int scanavx2(const unsigned char* h, int hl, const unsigned char* n,
+                    int nl, int start, int* ip, long* work)
+{
+    __m256i f = _mm256_set1_epi8((char)n[0]);
+    __m256i l = _mm256_set1_epi8((char)n[nl-1]);
+    int i = *ip, last = hl - nl, k;
+    unsigned int m;
+    for(; i + 31 <= last; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(h + i));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(h + i + nl - 1));
+        m = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, f),
+                                                  _mm256_cmpeq_epi8(b, l)));
+        for(; m; m &= m - 1) {
+            k = i + ctz32(m);
+            if(!memcmp(h+k+1, n+1, nl-2)) return k;
+            if((*work += nl) > SCANWORK(k - start)) { *ip = k; return -2; }
+        }
+    }
+    *ip = i;
+    return scanscalar(h, hl, n, nl, start, ip, work);
+}
+#endif
+
+// Start of the maximal suffix of n under the byte order (or its
+// reverse), with the period of that suffix in *per
+static int maxsuffix(const unsigned char* n, int nl, int rev, int* per)
+{
+    int ms = -1, j = 0, k = 1, p = 1;
+    while(j + k < nl) {
+        unsigned char a = n[j+k], b = n[ms+k];
+        if(rev ? a > b : a < b) { j += k; k = 1; p = j - ms; }
+        else if(a == b) { if(k != p) k++; else { j += p; k = 1; } }
+        else { ms = j; j = ms + 1; k = p = 1; }
+    }
+    *per = p;
+    return ms;
+}
+
+// Two-Way (Crochemore and Perrin): linear time, constant space
+static int twoway(const unsigned char* h, int hl, const unsigned char* n,
+                  int nl, int j)
+{
+    int p1, p2, ell, per, i, mem = -1;
+    int ms1 = maxsuffix(n, nl, 0, &p1), ms2 = maxsuffix(n, nl, 1, &p2);
+    if(ms1 > ms2) { ell = ms1; per = p1; }
+    else { ell = ms2; per = p2; }
+
+    if(!memcmp(n, n + per, ell + 1)) {
+        // Periodic needle: remember how much of a shifted match holds
+        while(j <= hl - nl) {
+            i = (ell > mem ? ell : mem) + 1;
+            while(i < nl && n[i] == h[i+j]) i++;
+            if(i >= nl) {
+                i = ell;
+                while(i > mem && n[i] == h[i+j]) i--;
+                if(i <= mem) return j;
+                j += per;
+                mem = nl - per - 1;
+            } else {
+                j += i - ell;
+                mem = -1;
+            }
+        }
+    } else {
+        per = (ell + 1 > nl - ell - 1 ? ell + 1 : nl - ell - 1) + 1;
+        while(j <= hl - nl) {
+            i = ell + 1;
+            while(i < nl && n[i] == h[i+j]) i++;
+            if(i >= nl) {
+                i = ell;
+                while(i >= 0 && n[i] == h[i+j]) i--;
+                if(i < 0) return j;
+                j += per;
+            } else {
+                j += i - ell;
+            }
+        }
+    }
+    return -1;
+}
+
+typedef int (*Scanner)(const unsigned char*, int, const unsigned char*,
+                       int, int, int*, long*);
+
+static Scanner pickscanner()
+{
+    static Scanner scanner;
+    Scanner s = naLoadRelaxed(&scanner);
+    if(s) return s;
+    s = scanscalar;
+#ifdef NASAL_SSE2
+    s = scansse2;
+#endif
+#ifdef NASAL_AVX
+    if(naHasAVX2()) s = scanavx2;
+#endif
+    naStoreRelaxed(&scanner, s);
+    return s;
+}
+
+int naiStr_find(const unsigned char* h, int hl, const unsigned char* n, int nl,
+                int start)
+{
+    const unsigned char* p;
+    long work = 0;
+    int i = start < 0 ? 0 : start, r;
+    if(nl > hl - i) return nl == 0 && i <= hl ? i : -1;
+    if(nl == 0) return i;
+    if(nl == 1) {
+        p = memchr(h + i, n[0], hl - i);
+        return p ? (int)(p - h) : -1;
+    }
+    r = pickscanner()(h, hl, n, nl, i, &i, &work);
+    return r == -2 ? twoway(h, hl, n, nl, i) : r;
+}
+
 naRef naStr_fromnum(naRef dest, double num)
 {
     struct naStr* dst = PTR(dest).str;
-    unsigned char buf[DIGITS+8];
+    unsigned char buf[NUMBUF];
     setlen(dst, fromnum(num, buf));
     memcpy(DATA(dst), buf, LEN(dst));
     return dest;
@@ -102,18 +534,47 @@ int naStr_parsenum(char* str, int len, double* result)
 
 int naStr_tonum(naRef str, double* out)
 {
-    return tonum(DATA(PTR(str).str), LEN(PTR(str).str), out);
+    struct naStr* s = PTR(str).str;
+    unsigned char state = naLoadAcquire(&s->numstate);
+    int ok;
+    if(state == NUM_VALID) { *out = s->cache.num; return 1; }
+    if(state == NUM_INVALID || state == NUM_UTF8) return 0;
+    ok = tonum(DATA(s), LEN(s), out);
+    if(state == NUM_UNKNOWN && naCompareSwap(&s->numstate, state, NUM_BUSY)) {
+        if(ok) s->cache.num = *out;
+        naStoreRelease(&s->numstate, ok ? NUM_VALID : NUM_INVALID);
+    }
+    return ok;
 }
 
 int naStr_numeric(naRef str)
 {
     double dummy;
-    return tonum(DATA(PTR(str).str), LEN(PTR(str).str), &dummy);
+    return naStr_tonum(str, &dummy);
+}
+
+struct Utf8Index* naiStr_utf8index(naRef s)
+{
+    struct naStr* str = PTR(s).str;
+    return naLoadAcquire(&str->numstate) == NUM_UTF8 ? str->cache.utf8 : 0;
+}
+
+int naiStr_setutf8index(naRef s, struct Utf8Index* index)
+{
+    struct naStr* str = PTR(s).str;
+    unsigned char state = NUM_INVALID;
+    if(naStr_numeric(s) || !naCompareSwap(&str->numstate, state, NUM_BUSY))
+        return 0;
+    str->cache.utf8 = index;
+    naStoreRelease(&str->numstate, NUM_UTF8);
+    return 1;
 }
 
 void naStr_gcclean(struct naStr* str)
 {
-    if(str->emblen == -1) naFree(str->data.ref.ptr);
+    if(str->numstate == NUM_UTF8) naFree(str->cache.utf8);
+    str->numstate = NUM_UNKNOWN;
+    if(str->emblen == -1) naFree(str->data.ref.ptr); // buffers go separately
     str->data.ref.ptr = 0;
     str->data.ref.len = 0;
     str->emblen = -1;
@@ -126,13 +587,14 @@ void naStr_gcclean(struct naStr* str)
 // This works the same way everywhere, although it is tied to an
 // assumption of standard IEEE 64 bit floating point doubles.
 //
-// In practice, these routines work quite well.  Testing conversions
-// of random doubles to strings and back, this routine is beaten by
-// glibc on roundoff error 23% of the time, beats glibc in 10% of
-// cases, and ties (usually with an error of exactly zero) the
-// remaining 67%.
+// Both directions are exact: numbers print as the shortest digit
+// string that reads back as the same double (with the Ryu algorithm),
+// and decimal strings read as the nearest double (ties to even).  So
+// num(str(x)) == x for every finite x.
 ////////////////////////////////////////////////////////////////////////
 
+#include "pow5tab.h"
+
 // TODO unify with number conversion in lex.c
 static int hex(char c)
 {
@@ -180,24 +642,186 @@ static int readsigned(unsigned char* s, int len, int i, double* v)
     return i2;
 }
 
+// The powers of ten that are exact doubles
+static const double exact10[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
 
 // Integer decimal power utility, with a tweak that enforces
 // integer-exactness for arguments where that is possible.
 static double decpow(int exp)
 {
-    double v = 1;
-    int absexp;
-    if(exp < 0 || exp >= DIGITS)
-        return pow(10, exp);
-    else
-        absexp = exp < 0 ? -exp : exp;
-    while(absexp--) v *= 10.0;
-    return v;
+    if(exp >= 0 && exp <= 22) return exact10[exp];
+    return pow(10, exp);
+}
+
+static uint64_t dbits(double d)
+{
+    uint64_t u;
+    memcpy(&u, &d, sizeof(u));
+    return u;
+}
+
+static double bitsd(uint64_t u)
+{
+    double d;
+    memcpy(&d, &u, sizeof(d));
+    return d;
+}
+
+// Digits past this many only matter for being non-zero.  (Deciding a
+// halfway case between two doubles can take up to 767.)
+#define MAXDIG 800
+
+// Big enough for (10^MAXDIG)*2^1076 and (2^55)*10^(MAXDIG+330)
+#define BIGWORDS 128
+
+struct Big {
+    int n;
+    uint32_t w[BIGWORDS];
+};
+
+static void bigmuladd(struct Big* b, uint32_t m, uint32_t add)
+{
+    int i;
+    uint64_t carry = add;
+    for(i=0; i<b->n; i++) {
+        carry += (uint64_t)b->w[i] * m;
+        b->w[i] = (uint32_t)carry;
+        carry >>= 32;
+    }
+    if(carry) b->w[b->n++] = (uint32_t)carry;
+}
+
+static void bigpow10(struct Big* b, int e)
+{
+    for(; e >= 9; e -= 9) bigmuladd(b, 1000000000, 0);
+    if(e) bigmuladd(b, (uint32_t)exact10[e], 0);
+}
+
+static void bigshl(struct Big* b, int bits)
+{
+    int i, words = bits / 32;
+    bits %= 32;
+    if(!b->n) return;
+    if(bits) {
+        uint32_t carry = 0;
+        for(i=0; i<b->n; i++) {
+            uint32_t w = b->w[i];
+            b->w[i] = (w << bits) | carry;
+            carry = w >> (32 - bits);
+        }
+        if(carry) b->w[b->n++] = carry;
+    }
+    if(words) {
+        memmove(b->w + words, b->w, b->n * sizeof(uint32_t));
+        memset(b->w, 0, words * sizeof(uint32_t));
+        b->n += words;
+    }
+}
+
+static int bigcmp(struct Big* a, struct Big* b)
+{
+    int i;
+    if(a->n != b->n) return a->n < b->n ? -1 : 1;
+    for(i=a->n-1; i>=0; i--)
+        if(a->w[i] != b->w[i]) return a->w[i] < b->w[i] ? -1 : 1;
+    return 0;
+}
+
+// Sign of dig*10^e - m*2^b, where dig holds nd decimal digit values
+static int cmpexact(unsigned char* dig, int nd, int e, uint64_t m, int b)
+{
+    struct Big x, y;
+    int i;
+    x.n = y.n = 0;
+    for(i=0; i<nd; i++) bigmuladd(&x, 10, dig[i]);
+    bigmuladd(&y, 1, (uint32_t)m);
+    y.w[y.n++] = (uint32_t)(m >> 32);
+    while(y.n && !y.w[y.n-1]) y.n--;
+    if(e >= 0) bigpow10(&x, e); else bigpow10(&y, -e);
+    if(b >= 0) bigshl(&y, b); else bigshl(&x, -b);
+    return bigcmp(&x, &y);
+}
+
+// The double nearest to dig*10^e, with nd < MAXDIG+2 non-zero
+// leading and trailing digits.  An estimate from the first 19 digits
+// is within a few ulps, and gets corrected with exact comparisons
+// against the midpoints to its neighbours.
+static double decimal(unsigned char* dig, int nd, int e)
+{
+    uint64_t w = 0, u, m;
+    int i, n = nd < 19 ? nd : 19, ew = e + nd - n, k, c;
+    double z;
+
+    if(nd + e > 310) return HUGE_VAL;
+    if(nd + e < -330) return 0;
+    for(i=0; i<n; i++) w = w*10 + dig[i];
+    if(n == nd && w < ((uint64_t)1 << 53) && e >= -22 && e <= 22)
+        return e < 0 ? (double)w / exact10[-e] : (double)w * exact10[e];
+
+    z = (double)w;
+    for(; ew > 22; ew -= 22) z *= 1e22;
+    for(; ew < -22; ew += 22) z /= 1e22;
+    z = ew < 0 ? z / exact10[-ew] : z * exact10[ew];
+    if(z > DBL_MAX) z = DBL_MAX;
+
+    for(;;) {
+        u = dbits(z);
+        k = (int)(u >> 52);
+        m = u & (((uint64_t)1 << 52) - 1);
+        if(k) { m |= (uint64_t)1 << 52; k -= 1075; }
+        else k = -1074;
+
+        // Above the midpoint to the next double up?
+        c = cmpexact(dig, nd, e, 2*m + 1, k - 1);
+        if(c > 0 || (c == 0 && (m & 1))) {
+            z = bitsd(u + 1);
+            if(z > DBL_MAX) return z;
+            continue;
+        }
+        if(!u) return z;
+
+        // Below the one to the next one down, which is closer for the
+        // bottom of a binade
+        if(m == (uint64_t)1 << 52 && k > -1074)
+            c = cmpexact(dig, nd, e, 4*m - 1, k - 2);
+        else
+            c = cmpexact(dig, nd, e, 2*m - 1, k - 1);
+        if(c < 0 || (c == 0 && (m & 1))) {
+            z = bitsd(u - 1);
+            continue;
+        }
+        return z;
+    }
+}
+
+// The value of decimal digits s[is..ie), '.', s[fs..fe), times 10^exp
+static double readdecimal(unsigned char* s, int is, int ie, int fs, int fe,
+                          double exp)
+{
+    unsigned char dig[MAXDIG+1];
+    int i, nd = 0, e, sticky = 0;
+    if(exp > 100000) exp = 100000;
+    if(exp < -100000) exp = -100000;
+    e = (int)exp - (fe - fs);
+    for(i=is; i<fe; i++) {
+        if(i == ie) i = fs;
+        if(i == fe) break;
+        if(!nd && s[i] == '0') continue;
+        if(nd < MAXDIG) dig[nd++] = s[i] - '0';
+        else { e++; sticky |= s[i] != '0'; }
+    }
+    // Dropped digits only need to make the value a bit bigger
+    if(sticky) { dig[nd++] = 1; e--; }
+    while(nd && !dig[nd-1]) { nd--; e++; }
+    return nd ? decimal(dig, nd, e) : 0;
 }
 
 static int tonum(unsigned char* s, int len, double* result)
 {
-    int i=0, fraclen=0;
+    int i=0, fraclen=0, is, ie, base10;
     double sgn=1, val, frac=0, exp=0;
 
     if(len == 1 && (*s=='.' || *s=='-' || *s=='+')) return 0;
@@ -217,9 +841,15 @@ static int tonum(unsigned char* s, int len, double* result)
         sgn = -1; s++; len--;
     }
 
+    // Where the digits start, unless it is a hex or octal number
+    is = len && (s[0] == '+' || s[0] == '-');
+    base10 = !(is + 1 < len && s[is] == '0'
+                && (s[is+1] == 'x' || s[is+1] == 'o'));
+
     // Read the integer part
     i = readsigned(s, len, i, &val);
     if(val < 0) { sgn = -1; val = -val; }
+    ie = i;
 
     // Read the fractional part, if any
     if(i < len && s[i] == '.') {
@@ -237,85 +867,196 @@ static int tonum(unsigned char* s, int len, double* result)
         i = readsigned(s, len, i+1, &exp);
         if(i == i0) return 0; // Must have a number after the "e"
     }
-    
-    // compute the result
-    *result = sgn * (val + frac * decpow(-fraclen)) * decpow(exp);
 
     // if we didn't use the whole string, return failure
     if(i < len) return 0;
+
+    // compute the result
+    if(base10)
+        *result = sgn * readdecimal(s, is, ie, ie + 1, ie + 1 + fraclen, exp);
+    else
+        *result = sgn * (val + frac * decpow(-fraclen)) * decpow(exp);
     return 1;
 }
 
-// Very simple positive (!) integer print routine.  Puts the result in
-// s and returns the number of characters written.  Does not null
-// terminate the result.  Presumes at least a 32 bit integer, and
-// cannot print integers larger than 9999999999.
-static int decprint(int val, unsigned char* s)
-{
-    int p=1, i=0;
-    if(val == 0) { *s = '0'; return 1; }
-    while(p <= 999999999 && p*10 <= val) p *= 10;
-    while(p > 0) {
-        int count = 0;
-        while(val >= p) { val -= p; count++; }
-        s[i++] = '0' + count;
-        p /= 10;
-    }
-    return i;
+// Prints the digits of a positive integer, returning their count.
+// Does not null terminate the result.
+static int decprint(uint64_t val, unsigned char* s)
+{
+    unsigned char buf[20];
+    int n = 0, i;
+    do { buf[n++] = '0' + val % 10; val /= 10; } while(val);
+    for(i=0; i<n; i++) s[i] = buf[n-1-i];
+    return n;
+}
+
+// 64x64 -> 128 bit multiplication, as needed for Ryu
+#if defined(__SIZEOF_INT128__)
+static uint64_t mulshift(uint64_t m, const uint64_t* mul, int j)
+{
+    unsigned __int128 b0 = (unsigned __int128)m * mul[0];
+    unsigned __int128 b2 = (unsigned __int128)m * mul[1];
+    return (uint64_t)(((b0 >> 64) + b2) >> (j - 64));
+}
+#else
+static uint64_t umul128(uint64_t a, uint64_t b, uint64_t* hi)
+{
+    uint64_t alo = (uint32_t)a, ahi = a >> 32;
+    uint64_t blo = (uint32_t)b, bhi = b >> 32;
+    uint64_t b00 = alo * blo, b01 = alo * bhi;
+    uint64_t b10 = ahi * blo, b11 = ahi * bhi;
+    uint64_t mid1 = b10 + (b00 >> 32);
+    uint64_t mid2 = b01 + (uint32_t)mid1;
+    *hi = b11 + (mid1 >> 32) + (mid2 >> 32);
+    return (mid2 << 32) | (uint32_t)b00;
+}
+
+static uint64_t mulshift(uint64_t m, const uint64_t* mul, int j)
+{
+    uint64_t hi0, hi1, lo1, sum;
+    umul128(m, mul[0], &hi0);
+    lo1 = umul128(m, mul[1], &hi1);
+    sum = hi0 + lo1;
+    if(sum < hi0) hi1++;
+    j -= 64; // 0 < j < 64 here
+    return (hi1 << (64 - j)) | (sum >> j);
 }
+#endif
+
+static int pow5bits(int e) { return (int)(((uint32_t)e * 1217359) >> 19) + 1; }
+static int log10pow2(int e) { return (int)(((uint32_t)e * 78913) >> 18); }
+static int log10pow5(int e) { return (int)(((uint32_t)e * 732923) >> 20); }
+
+static int pow5factor(uint64_t v)
+{
+    int n = 0;
+    while(v % 5 == 0) { v /= 5; n++; }
+    return n;
+}
+
+// Ryu (Ulf Adams, PLDI 2018): finds the shortest decimal in the
+// interval of reals that round to the positive, finite, non-zero
+// double with the given fields.  Returns digits d, with *exp10 set so
+// that the number is d*10^*exp10.
+static uint64_t shortest(uint64_t mant, int bexp, int* exp10)
+{
+    uint64_t m2, mv, vr, vp, vm, out;
+    int e2, e10, q, i, removed = 0, even, mmshift, last = 0;
+    int vmzeros = 0, vrzeros = 0;
 
-// Takes a positive (!) floating point numbers, and returns exactly
-// DIGITS decimal numbers in the buffer pointed to by s, and an
-// integer exponent as the return value.  For example, printing 1.0
-// will result in "1000000000000000" in the buffer and -15 as the
-// exponent.  The caller can then place the floating point as needed.
-static int rawprint(double val, unsigned char* s)
-{
-    int exponent = (int)floor(log10(val));
-    double mantissa = val / pow(10, exponent);
-    int i, c;
-    for(i=0; i<DIGITS-1; i++) {
-        int digit = (int)floor(mantissa);
-        s[i] = '0' + digit;
-        mantissa -= digit;
-        mantissa *= 10.0;
+    if(bexp) { m2 = ((uint64_t)1 << 52) | mant; e2 = bexp - 1075 - 2; }
+    else { m2 = mant; e2 = 1 - 1075 - 2; }
+    even = (m2 & 1) == 0;
+    mv = 4 * m2;
+    mmshift = mant != 0 || bexp <= 1;
+
+    // vr, vp and vm: the number and the bounds of its rounding
+    // interval, scaled to keep enough digits
+    if(e2 >= 0) {
+        q = log10pow2(e2) - (e2 > 3);
+        e10 = q;
+        i = -e2 + q + POW5_INV_BITCOUNT + pow5bits(q) - 1;
+        vr = mulshift(4*m2, POW5_INV[q], i);
+        vp = mulshift(4*m2 + 2, POW5_INV[q], i);
+        vm = mulshift(4*m2 - 1 - mmshift, POW5_INV[q], i);
+        if(q <= 21) {
+            if(mv % 5 == 0) vrzeros = pow5factor(mv) >= q;
+            else if(even) vmzeros = pow5factor(mv - 1 - mmshift) >= q;
+            else vp -= pow5factor(mv + 2) >= q;
+        }
+    } else {
+        int j, k;
+        q = log10pow5(-e2) - (-e2 > 1);
+        e10 = q + e2;
+        i = -e2 - q;
+        k = pow5bits(i) - POW5_BITCOUNT;
+        j = q - k;
+        vr = mulshift(4*m2, POW5[i], j);
+        vp = mulshift(4*m2 + 2, POW5[i], j);
+        vm = mulshift(4*m2 - 1 - mmshift, POW5[i], j);
+        if(q <= 1) {
+            vrzeros = 1;
+            if(even) vmzeros = mmshift;
+            else vp--;
+        } else if(q < 63) {
+            vrzeros = (mv & (((uint64_t)1 << q) - 1)) == 0;
+        }
+    }
+
+    // Drop digits while the bounds still differ
+    if(vmzeros || vrzeros) {
+        while(vp / 10 > vm / 10) {
+            vmzeros &= vm % 10 == 0;
+            vrzeros &= last == 0;
+            last = (int)(vr % 10);
+            vr /= 10; vp /= 10; vm /= 10;
+            removed++;
+        }
+        if(vmzeros) {
+            while(vm % 10 == 0) {
+                vrzeros &= last == 0;
+                last = (int)(vr % 10);
+                vr /= 10; vp /= 10; vm /= 10;
+                removed++;
+            }
+        }
+        // Exactly halfway: round to even
+        if(vrzeros && last == 5 && vr % 2 == 0) last = 4;
+        out = vr + ((vr == vm && (!even || !vmzeros)) || last >= 5);
+    } else {
+        int up = 0;
+        if(vp / 100 > vm / 100) {
+            up = vr % 100 >= 50;
+            vr /= 100; vp /= 100; vm /= 100;
+            removed += 2;
+        }
+        while(vp / 10 > vm / 10) {
+            up = vr % 10 >= 5;
+            vr /= 10; vp /= 10; vm /= 10;
+            removed++;
+        }
+        out = vr + (vr == vm || up);
     }
-    // Round (i.e. don't floor) the last digit
-    c = (int)floor(mantissa);
-    if(mantissa - c >= 0.5) c++;
-    if(c < 0) c = 0;
-    if(c > 9) c = 9;
-    s[i] = '0' + c;
-    return exponent - DIGITS + 1;
+    *exp10 = e10 + removed;
+    return out;
 }
 
+// Numbers with a decimal exponent from -4 to DIGITS-1 print without
+// scientific notation
+#define DIGITS 16
+
+// Prints val into s (at least NUMBUF bytes), returning the length
 static int fromnum(double val, unsigned char* s)
 {
-    unsigned char raw[DIGITS];
+    unsigned char raw[20];
     unsigned char* ptr = s;
-    int exp, digs, i=0;
+    uint64_t u = dbits(val), digits;
+    int bexp = (int)(u >> 52) & 0x7ff, exp, digs, i;
+
+    if(bexp == 0x7ff) {
+        const char* str = (u << 12) ? "nan" : (val < 0 ? "-inf" : "inf");
+        strcpy((char*)s, str);
+        return strlen(str);
+    }
 
     // Handle negatives
     if(val < 0) { *ptr++ = '-'; val = -val; }
 
-    // Exactly an integer is a special case
-    if(val == (int)val) {
-        ptr += decprint(val, ptr);
+    // Exact integers (including negative zero, as 0) are a special
+    // case
+    if(val < 9007199254740992.0 && val == (double)(uint64_t)val) {
+        ptr += decprint((uint64_t)val, ptr);
         *ptr = 0;
         return ptr - s;
     }
 
-    // Get the raw digits
-    exp = rawprint(val, raw);
+    // Get the shortest digits, and the exponent of the first one
+    digits = shortest(u & (((uint64_t)1 << 52) - 1), bexp, &exp);
+    digs = decprint(digits, raw);
+    exp += digs - 1;
 
-    // Examine trailing zeros to get a significant digit count
-    for(i=DIGITS-1; i>0; i--)
-        if(raw[i] != '0') break;
-    digs = i+1;
-
-    if(exp > 0 || exp < -(DIGITS+3)) {
+    if(exp >= DIGITS || exp < -4) {
         // Standard scientific notation
-        exp += DIGITS-1;
         *ptr++ = raw[0];
         if(digs > 1) {
             *ptr++ = '.';
@@ -326,14 +1067,14 @@ static int fromnum(double val, unsigned char* s)
         else { *ptr++ = '+'; }
         if(exp < 10) *ptr++ = '0';
         ptr += decprint(exp, ptr);
-    } else if(exp < 1-DIGITS) {
+    } else if(exp < 0) {
         // Fraction with insignificant leading zeros
         *ptr++ = '0'; *ptr++ = '.';
-        for(i=0; i<-(exp+DIGITS); i++) *ptr++ = '0';
+        for(i=0; i<-exp-1; i++) *ptr++ = '0';
         for(i=0; i<digs; i++) *ptr++ = raw[i];
     } else {
         // Integer part
-        for(i=0; i<DIGITS+exp; i++) *ptr++ = raw[i];
+        for(i=0; i<=exp; i++) *ptr++ = i < digs ? raw[i] : '0';
         if(i < digs) {
             // Fraction, if any
             *ptr++ = '.';
@@ -344,26 +1085,3 @@ static int fromnum(double val, unsigned char* s)
     return ptr - s;
 }
 
-
-//------------------------------------------------------------------------------
-static naRef string_methods;
-static int init = 0; // As we can't use naNil() for static initialization we
-                     // need a separate variable for saving whether we have
-                     // already initialized.
-
-//------------------------------------------------------------------------------
-naRef naInit_string(naContext c)
-{
-  string_methods = naNewHash(c);
-  init = 1;
-  return string_methods;
-}
-
-//------------------------------------------------------------------------------
-naRef getStringMethods(naContext c)
-{
-  if( !init )
-    return naNil();
-
-  return string_methods;
-}
@@ -0,0 +1,312 @@
+#include <limits.h>
+#include <string.h>
+
+#include "data.h"
+#include "util.h"
+
+/*
+ * Methods of strings, as in s.upper() or ", ".join(v): getMember()
+ * looks up members of strings in the hash naInit_string() returns,
+ * and calls them with the string as "me".  Case mapping and trimming
+ * only know ASCII, and leave all other bytes (such as UTF-8 sequences)
+ * alone.
+ */
+
+#define ARGERR() \
+    naRuntimeError(c, "bad/missing argument to string method %s()", \
+                   (__FUNCTION__ + 2))
+
+// Checks that the method was called on a string
+#define SELF() \
+    do { if(!IS_STR(me)) \
+        naRuntimeError(c, "string method %s() called on a non-string", \
+                       (__FUNCTION__ + 2)); } while(0)
+
+// A new string of len bytes, to be filled through naStr_data()
+static naRef newbuf(naContext c, int len)
+{
+    return naStr_buf(naNewString(c), len);
+}
+
+// Copies s to d, flipping the case of the bytes in [lo, lo+25]
+static void casemap(unsigned char* d, const unsigned char* s, int n,
+                    unsigned char lo)
+{
+    int i = 0;
+#ifdef NASAL_SSE2
+    // Unsigned x - lo < 26, done as a signed compare after biasing
+    __m128i vlo = _mm_set1_epi8((char)lo);
+    __m128i bias = _mm_set1_epi8((char)0x80);
+    __m128i lim = _mm_set1_epi8((char)(26 - 128));
+    __m128i bit = _mm_set1_epi8(0x20);
+    for(; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(s + i));
+        __m128i t = _mm_xor_si128(_mm_sub_epi8(v, vlo), bias);
+        __m128i in = _mm_cmpgt_epi8(lim, t);
+        _mm_storeu_si128((__m128i*)(d + i),
+                         _mm_xor_si128(v, _mm_and_si128(in, bit)));
+    }
+#endif
+    for(; i < n; i++)
+        d[i] = (unsigned char)(s[i] - lo) < 26 ? s[i] ^ 0x20 : s[i];
+}
+
+static naRef mapcase(naContext c, naRef me, unsigned char lo)
+{
+    int len = naStr_len(me);
+    naRef r = newbuf(c, len);
+    casemap((unsigned char*)naStr_data(r), naiStr_bytes(me), len, lo);
+    return r;
+}
+
+static naRef f_upper(naContext c, naRef me, int argc, naRef* args)
+{
+    SELF();
+    return mapcase(c, me, 'a');
+}
+
+static naRef f_lower(naContext c, naRef me, int argc, naRef* args)
+{
+    SELF();
+    return mapcase(c, me, 'A');
+}
+
+static int isspc(unsigned char ch)
+{
+    return ch == ' ' || (ch >= '\t' && ch <= '\r');
+}
+
+// Strips whitespace from the left (side 1), the right (2) or both
+static naRef trim(naContext c, naRef me, int side)
+{
+    const unsigned char* s = naiStr_bytes(me);
+    int a = 0, b = naStr_len(me);
+    if(side & 1) while(a < b && isspc(s[a])) a++;
+    if(side & 2) while(b > a && isspc(s[b-1])) b--;
+    return naStr_substr(naNewString(c), me, a, b - a);
+}
+
+static naRef f_trim(naContext c, naRef me, int argc, naRef* args)
+{
+    SELF();
+    return trim(c, me, 3);
+}
+
+static naRef f_ltrim(naContext c, naRef me, int argc, naRef* args)
+{
+    SELF();
+    return trim(c, me, 1);
+}
+
+static naRef f_rtrim(naContext c, naRef me, int argc, naRef* args)
+{
+    SELF();
+    return trim(c, me, 2);
+}
+
+static naRef f_startswith(naContext c, naRef me, int argc, naRef* args)
+{
+    int n;
+    SELF();
+    if(argc < 1 || !IS_STR(args[0])) ARGERR();
+    n = naStr_len(args[0]);
+    return naNum(n <= naStr_len(me)
+                 && !memcmp(naiStr_bytes(me), naiStr_bytes(args[0]), n));
+}
+
+static naRef f_endswith(naContext c, naRef me, int argc, naRef* args)
+{
+    int n, len;
+    SELF();
+    if(argc < 1 || !IS_STR(args[0])) ARGERR();
+    n = naStr_len(args[0]);
+    len = naStr_len(me);
+    return naNum(n <= len && !memcmp(naiStr_bytes(me) + len - n,
+                                     naiStr_bytes(args[0]), n));
+}
+
+// Index of the first occurrence of a byte (given as a number or a one
+// byte string) from an optional start, or -1
+static naRef f_indexof(naContext c, naRef me, int argc, naRef* args)
+{
+    const unsigned char *s, *p;
+    int ch, start = 0, len;
+    SELF();
+    if(argc < 1) ARGERR();
+    if(IS_NUM(args[0])) ch = (int)args[0].num;
+    else if(IS_STR(args[0]) && naStr_len(args[0]) == 1)
+        ch = naiStr_bytes(args[0])[0];
+    else ARGERR();
+    if(argc > 1) {
+        if(!IS_NUM(args[1])) ARGERR();
+        start = (int)args[1].num;
+        if(start < 0) start = 0;
+    }
+    len = naStr_len(me);
+    if(start >= len || ch < 0 || ch > 255) return naNum(-1);
+    s = naiStr_bytes(me);
+    p = memchr(s + start, ch, len - start);
+    return naNum(p ? p - s : -1);
+}
+
+// Index of the first occurrence of a substring from an optional start,
+// or -1
+static naRef f_find(naContext c, naRef me, int argc, naRef* args)
+{
+    int start = 0;
+    SELF();
+    if(argc < 1 || !IS_STR(args[0])) ARGERR();
+    if(argc > 1) {
+        if(!IS_NUM(args[1])) ARGERR();
+        start = (int)args[1].num;
+    }
+    return naNum(naiStr_find(naiStr_bytes(me), naStr_len(me),
+                             naiStr_bytes(args[0]), naStr_len(args[0]),
+                             start));
+}
+
+// Replaces every occurrence of a substring.  The matches are found
+// twice, to size the result and then to fill it, which is cheaper than
+// keeping them.
+static naRef f_replace(naContext c, naRef me, int argc, naRef* args)
+{
+    naRef r;
+    unsigned char* d;
+    const unsigned char* s;
+    int len, ol, nl, n = 0, i, at;
+    double rlen;
+    SELF();
+    if(argc < 2 || !IS_STR(args[0]) || !IS_STR(args[1])) ARGERR();
+    len = naStr_len(me);
+    ol = naStr_len(args[0]);
+    nl = naStr_len(args[1]);
+    if(ol == 0) return naStr_substr(naNewString(c), me, 0, len);
+
+    for(i = 0; (at = naiStr_find(naiStr_bytes(me), len, naiStr_bytes(args[0]),
+                                 ol, i)) >= 0; i = at + ol)
+        n++;
+    if(n == 0) return naStr_substr(naNewString(c), me, 0, len);
+    rlen = len + (double)n * (nl - ol);
+    if(rlen > INT_MAX) naRuntimeError(c, "replace() result too long");
+
+    r = newbuf(c, (int)rlen);
+    d = (unsigned char*)naStr_data(r);
+    s = naiStr_bytes(me);
+    for(i = 0; (at = naiStr_find(s, len, naiStr_bytes(args[0]), ol, i)) >= 0;
+        i = at + ol) {
+        memcpy(d, s + i, at - i);
+        d += at - i;
+        memcpy(d, naiStr_bytes(args[1]), nl);
+        d += nl;
+    }
+    memcpy(d, s + i, len - i);
+    return r;
+}
+
+// The strings (or numbers) of a vector, with the string between them
+static naRef f_join(naContext c, naRef me, int argc, naRef* args)
+{
+    naRef parts, r, e;
+    unsigned char* d;
+    int n, i, sl, el;
+    double total;
+    SELF();
+    if(argc < 1 || !IS_VEC(args[0])) ARGERR();
+    parts = args[0];
+    n = naVec_size(parts);
+
+    // Numbers need converting first, into a copy of the vector
+    for(i=0; i<n; i++) {
+        e = naVec_get(parts, i);
+        if(IS_STR(e)) continue;
+        if(!IS_NUM(e)) naRuntimeError(c, "join() element not a scalar");
+        if(IDENTICAL(parts, args[0])) {
+            parts = naNewVector(c);
+            naiVec_appendrange(c, parts, args[0], 0, n, 0);
+        }
+        naVec_set(parts, i, naStringValue(c, e));
+    }
+
+    sl = naStr_len(me);
+    total = n > 0 ? (double)sl * (n - 1) : 0;
+    for(i=0; i<n; i++) total += naStr_len(naVec_get(parts, i));
+    if(total > INT_MAX) naRuntimeError(c, "join() result too long");
+
+    r = newbuf(c, (int)total);
+    d = (unsigned char*)naStr_data(r);
+    for(i=0; i<n; i++) {
+        if(i > 0) {
+            memcpy(d, naiStr_bytes(me), sl);
+            d += sl;
+        }
+        e = naVec_get(parts, i);
+        el = naStr_len(e);
+        memcpy(d, naiStr_bytes(e), el);
+        d += el;
+    }
+    return r;
+}
+
+// The string n times over, built by doubling the copied part
+static naRef f_repeat(naContext c, naRef me, int argc, naRef* args)
+{
+    naRef r;
+    unsigned char* d;
+    int len, have, total;
+    double n;
+    SELF();
+    if(argc < 1 || !IS_NUM(args[0])) ARGERR();
+    n = args[0].num >= 1 ? args[0].num : 0; // and not NaN
+    len = naStr_len(me);
+    if(len * n > INT_MAX) naRuntimeError(c, "repeat() result too long");
+    total = len ? len * (int)n : 0;
+    r = newbuf(c, total);
+    if(total == 0) return r;
+    d = (unsigned char*)naStr_data(r);
+    memcpy(d, naiStr_bytes(me), len);
+    for(have = len; have < total; have *= 2)
+        memcpy(d + have, d, have < total - have ? have : total - have);
+    return r;
+}
+
+static naCFuncItem funcs[] = {
+    { "upper", f_upper },
+    { "lower", f_lower },
+    { "trim", f_trim },
+    { "ltrim", f_ltrim },
+    { "rtrim", f_rtrim },
+    { "startswith", f_startswith },
+    { "endswith", f_endswith },
+    { "indexof", f_indexof },
+    { "find", f_find },
+    { "replace", f_replace },
+    { "join", f_join },
+    { "repeat", f_repeat },
+    { 0 }
+};
+
+//------------------------------------------------------------------------------
+static naRef string_methods;
+static int init = 0; // As we can't use naNil() for static initialization we
+                     // need a separate variable for saving whether we have
+                     // already initialized.
+
+//------------------------------------------------------------------------------
+// The hash is not referenced from anywhere else, so the caller must keep
+// it from the GC (with naSave(), say).  Applications can add their own
+// methods to it.
+naRef naInit_string(naContext c)
+{
+  string_methods = naGenLib(c, funcs);
+  init = 1;
+  return string_methods;
+}
+
+//------------------------------------------------------------------------------
+naRef getStringMethods(naContext c)
+{
+  if( !init )
+    return naNil();
+
+  return string_methods;
+}
@@ -1,6 +1,7 @@
 #ifndef _WIN32
 
 #include <pthread.h>
+#include <unistd.h>
 #include "code.h"
 
 void* naNewLock()
@@ -68,6 +69,39 @@ void naSemUp(void* sh, int count)
     pthread_mutex_unlock(&sem->lock);
 }
 
+struct ThreadStart {
+    void (*fn)(void*);
+    void* arg;
+};
+
+static void* threadstart(void* p)
+{
+    struct ThreadStart ts = *(struct ThreadStart*)p;
+    naFree(p);
+    ts.fn(ts.arg);
+    return 0;
+}
+
+int naStartThread(void (*fn)(void*), void* arg)
+{
+    pthread_t t;
+    struct ThreadStart* ts = naAlloc(sizeof(struct ThreadStart));
+    ts->fn = fn;
+    ts->arg = arg;
+    if(pthread_create(&t, 0, threadstart, ts)) {
+        naFree(ts);
+        return 0;
+    }
+    pthread_detach(t);
+    return 1;
+}
+
+int naNumCPUs()
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+}
+
 #endif
 
 extern int GccWarningWorkaround_IsoCForbidsAnEmptySourceFile;
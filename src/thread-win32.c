@@ -19,6 +19,41 @@ void  naSemDown(void* sem) { WaitForSingleObject((HANDLE)sem, INFINITE); }
 void  naSemUp(void* sem, int count) { ReleaseSemaphore(sem, count, 0); }
 void naFreeSem(void* sem) { ReleaseSemaphore(sem, 1, 0); }
 
+struct ThreadStart {
+    void (*fn)(void*);
+    void* arg;
+};
+
+static DWORD WINAPI threadstart(LPVOID p)
+{
+    struct ThreadStart ts = *(struct ThreadStart*)p;
+    free(p);
+    ts.fn(ts.arg);
+    return 0;
+}
+
+int naStartThread(void (*fn)(void*), void* arg)
+{
+    HANDLE t;
+    struct ThreadStart* ts = malloc(sizeof(struct ThreadStart));
+    if(!ts) return 0;
+    ts->fn = fn;
+    ts->arg = arg;
+    if(!(t = CreateThread(0, 0, threadstart, ts, 0, 0))) {
+        free(ts);
+        return 0;
+    }
+    CloseHandle(t);
+    return 1;
+}
+
+int naNumCPUs()
+{
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    return si.dwNumberOfProcessors > 0 ? (int)si.dwNumberOfProcessors : 1;
+}
+
 #endif
 
 extern int GccWarningWorkaround_IsoCForbidsAnEmptySourceFile;
@@ -1,6 +1,8 @@
 #include <string.h>
 #include "nasal.h"
 #include "parse.h"
+#include "data.h"
+#include "util.h"
 
 // bytes required to store a given character
 static int cbytes(unsigned int c)
@@ -51,14 +53,254 @@ static int readc(unsigned char* s, int len, int* used)
 int naLexUtf8C(char* s, int len, int* used)
 { return readc((void*)s, len, used); }
 
-static unsigned char* nthchar(unsigned char* s, int n, int* len)
+/*
+ * Indexing by character would mean walking the string from the start
+ * each time, so a loop over the characters of a string is quadratic.
+ * Strings of at least MININDEX bytes therefore get an index the first
+ * time they are indexed, kept with the string (see string.c): the byte
+ * offset of every STEP'th character, or nothing for plain ASCII.  Only
+ * the characters before the first encoding error are indexed, so the
+ * errors come out where walking would have met them.
+ */
+#define MININDEX 64
+#define STEP 32
+
+struct Utf8Index {
+    int nchars; // characters before the first error (or in all)
+    int end; // where they end: the length, or the error's offset
+    int offs[]; // of character i*STEP, if nchars != end
+};
+
+#define CONT(b) (((b) & 0xc0) == 0x80)
+
+// Number of ASCII bytes at the start of s
+static int asciirun(const unsigned char* s, int len)
 {
-    int i, bytes;
-    for(i=0; *len && i<n; i++) {
-        if(readc(s, *len, &bytes) < 0) return 0;
-        s += bytes; *len -= bytes;
+    int i = 0;
+#ifdef NASAL_SSE2
+    for(; i + 16 <= len; i += 16) {
+        int m = _mm_movemask_epi8(_mm_loadu_si128((const __m128i*)(s + i)));
+        if(m) return i + ctz32(m);
     }
-    return s;
+#endif
+    while(i < len && s[i] < 0x80) i++;
+    return i;
+}
+
+// Number of characters in valid UTF-8: the bytes that aren't
+// continuation bytes
+static int countchars(const unsigned char* s, int len)
+{
+    int i = 0, n = 0;
+#ifdef NASAL_SSE2
+    // As signed bytes, continuation bytes are -128 to -65
+    __m128i limit = _mm_set1_epi8(-65);
+    for(; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(s + i));
+        n += popcount32(_mm_movemask_epi8(_mm_cmpgt_epi8(v, limit)));
+    }
+#endif
+    for(; i < len; i++) n += !CONT(s[i]);
+    return n;
+}
+
+static int validascii(const unsigned char* s, int len)
+{
+    return asciirun(s, len) == len;
+}
+
+#ifdef NASAL_AVX
+/*
+ * Standard UTF-8 (no surrogates, nothing past U+10FFFF, no five or six
+ * byte forms) checked 32 bytes at a time, after Keiser and Lemire,
+ * "Validating UTF-8 In Less Than One Instruction Per Byte".  Each byte
+ * and the one before it are classified by three table lookups on their
+ * nibbles, whose bitwise and is non-zero for any invalid pair; third and
+ * fourth bytes are checked against the leading bytes two and three
+ * back.  readc() accepts more than this, so failing is not the last word.
+ */
+#define TOO_SHORT 0x01 // lead byte or ASCII, then a lead byte or ASCII
+#define TOO_LONG 0x02 // ASCII, then a continuation byte
+#define OVERLONG_3 0x04 // 11100000 100_____
+#define TOO_LARGE 0x08 // 11110100 1001____ and above
+#define SURROGATE 0x10 // 11101101 101_____
+#define OVERLONG_2 0x20 // 1100000_ 10______
+#define TOO_LARGE_1000 0x40 // 11110101 and above, then 1000____
+#define OVERLONG_4 0x40 // 11110000 1000____
+#define TWO_CONTS 0x80 // two continuation bytes
+#define CARRY (TOO_SHORT | TOO_LONG | TWO_CONTS)
+
+#define TABLE(...) _mm256_broadcastsi128_si256(_mm_setr_epi8(__VA_ARGS__))
+
+NASAL_AVX2_TARGET
+static __m256i classify(__m256i in, __m256i prev)
+{
+    const __m256i byte1high = TABLE(
+        TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+        TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+        TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,
+        TOO_SHORT | OVERLONG_2,
+        TOO_SHORT,
+        TOO_SHORT | OVERLONG_3 | SURROGATE,
+        TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4);
+    const __m256i byte1low = TABLE(
+        CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4,
+        CARRY | OVERLONG_2,
+        CARRY,
+        CARRY,
+        CARRY | TOO_LARGE,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000);
+    const __m256i byte2high = TABLE(
+        TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+        TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000
+            | OVERLONG_4,
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE,
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+        TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT);
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    // The 32 bytes before each byte's position, from prev and in
+    __m256i back = _mm256_permute2x128_si256(prev, in, 0x21);
+    __m256i prev1 = _mm256_alignr_epi8(in, back, 15);
+    __m256i prev2 = _mm256_alignr_epi8(in, back, 14);
+    __m256i prev3 = _mm256_alignr_epi8(in, back, 13);
+    __m256i special = _mm256_and_si256(
+        _mm256_and_si256(
+            _mm256_shuffle_epi8(byte1high,
+                _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nibble)),
+            _mm256_shuffle_epi8(byte1low, _mm256_and_si256(prev1, nibble))),
+        _mm256_shuffle_epi8(byte2high,
+            _mm256_and_si256(_mm256_srli_epi16(in, 4), nibble)));
+    // 0x80 where a byte must continue a three or four byte character
+    __m256i third = _mm256_subs_epu8(prev2, _mm256_set1_epi8(0xe0 - 0x80));
+    __m256i fourth = _mm256_subs_epu8(prev3, _mm256_set1_epi8(0xf0 - 0x80));
+    __m256i must = _mm256_and_si256(_mm256_or_si256(third, fourth),
+                                    _mm256_set1_epi8((char)0x80));
+    return _mm256_xor_si256(must, special);
+}
+
+NASAL_AVX2_TARGET
+static int validavx2(const unsigned char* s, int len)
+{
+    // Lead bytes in the last three places that need more bytes after
+    const __m256i last = _mm256_setr_epi8(
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        0xf0 - 1, 0xe0 - 1, 0xc0 - 1);
+    __m256i prev = _mm256_setzero_si256(), err = prev, incomplete = prev;
+    unsigned char tail[32];
+    int i;
+    for(i = 0; i < len; i += 32) {
+        __m256i in;
+        if(i + 32 <= len) {
+            in = _mm256_loadu_si256((const __m256i*)(s + i));
+        } else {
+            // Zeros after the end catch a character it cuts off
+            memset(tail, 0, sizeof(tail));
+            memcpy(tail, s + i, len - i);
+            in = _mm256_loadu_si256((const __m256i*)tail);
+        }
+        if(_mm256_movemask_epi8(in)) {
+            err = _mm256_or_si256(err, classify(in, prev));
+            incomplete = _mm256_subs_epu8(in, last);
+        } else {
+            err = _mm256_or_si256(err, incomplete);
+            incomplete = _mm256_setzero_si256();
+        }
+        prev = in;
+    }
+    err = _mm256_or_si256(err, incomplete);
+    return _mm256_testz_si256(err, err);
+}
+#endif
+
+// Whether s is certainly valid, so that there is no need to decode it
+// to find out
+static int quickvalid(const unsigned char* s, int len)
+{
+    static int (*check)(const unsigned char*, int);
+    int (*f)(const unsigned char*, int) = naLoadRelaxed(&check);
+    if(!f) {
+        f = validascii;
+#ifdef NASAL_AVX
+        if(naHasAVX2()) f = validavx2;
+#endif
+        naStoreRelaxed(&check, f);
+    }
+    return f(s, len);
+}
+
+static struct Utf8Index* buildindex(const unsigned char* s, int len)
+{
+    struct Utf8Index* idx;
+    int n = 0, end, used, i;
+    if(quickvalid(s, len)) {
+        n = countchars(s, len);
+        end = len;
+    } else {
+        for(end = 0; end < len && readc((unsigned char*)s + end, len - end,
+                                        &used) >= 0; end += used)
+            n++;
+    }
+    idx = naAlloc(sizeof(struct Utf8Index)
+                  + (n == end ? 0 : (n / STEP + 1) * sizeof(int)));
+    idx->nchars = n;
+    idx->end = end;
+    if(n != end) {
+        for(i = n = 0; i < end; i++)
+            if(!CONT(s[i]) && n++ % STEP == 0)
+                idx->offs[(n - 1) / STEP] = i;
+        if(n % STEP == 0) idx->offs[n / STEP] = end;
+    }
+    return idx;
+}
+
+// The index of s, if it is long enough to get one
+static struct Utf8Index* getindex(naRef s)
+{
+    struct Utf8Index* idx = naiStr_utf8index(s);
+    int len = naStr_len(s);
+    if(idx || len < MININDEX) return idx;
+    // Strings that are numbers keep the number instead
+    if(naStr_numeric(s)) return 0;
+    idx = buildindex(naiStr_bytes(s), len);
+    if(!naiStr_setutf8index(s, idx)) {
+        naFree(idx);
+        return 0;
+    }
+    return idx;
+}
+
+// Offset of the nth character of s (n >= 0), of the end if there are
+// fewer characters, or -1 if an encoding error comes first
+static int charoffset(naRef s, int n)
+{
+    const unsigned char* p = naiStr_bytes(s);
+    struct Utf8Index* idx = getindex(s);
+    int len = naStr_len(s), off, used;
+    if(!idx) {
+        for(off = 0; off < len && n > 0; n--, off += used)
+            if(readc((unsigned char*)p + off, len - off, &used) < 0)
+                return -1;
+        return off;
+    }
+    if(n > idx->nchars) return idx->end < len ? -1 : len;
+    if(idx->nchars == idx->end) return n;
+    off = idx->offs[n / STEP];
+    for(n %= STEP; n > 0; n--)
+        while(++off < idx->end && CONT(p[off])) {}
+    return off;
 }
 
 static naRef f_chstr(naContext ctx, naRef me, int argc, naRef* args)
@@ -74,14 +316,20 @@ static naRef f_chstr(naContext ctx, naRef me, int argc, naRef* args)
 
 static naRef f_size(naContext c, naRef me, int argc, naRef* args)
 {
-    unsigned char* s;
+    const unsigned char* s;
+    struct Utf8Index* idx;
     int sz=0, n=0, len;
     if(argc < 1 || !naIsString(args[0]))
         naRuntimeError(c, "bad/missing argument to utf8.strc");
-    s = (void*)naStr_data(args[0]);
     len = naStr_len(args[0]);
+    if((idx = getindex(args[0]))) {
+        if(idx->end < len)
+            naRuntimeError(c, "utf8 encoding error in utf8.size");
+        return naNum(idx->nchars);
+    }
+    s = naiStr_bytes(args[0]);
     while(len > 0) {
-        if(readc(s, len, &n) < 0)
+        if(readc((unsigned char*)s, len, &n) < 0)
             naRuntimeError(c, "utf8 encoding error in utf8.size");
         sz++; len -= n; s += n;
     }
@@ -91,13 +339,16 @@ static naRef f_size(naContext c, naRef me, int argc, naRef* args)
 static naRef f_strc(naContext ctx, naRef me, int argc, naRef* args)
 {
     naRef idx;
-    unsigned char* s;
-    int len, c=0, bytes;
+    int len, off, c=-1, bytes;
     if(argc < 2 || !naIsString(args[0]) || naIsNil(idx=naNumValue(args[1])))
         naRuntimeError(ctx, "bad/missing argument to utf8.strc");
     len = naStr_len(args[0]);
-    s = nthchar((void*)naStr_data(args[0]), (int)idx.num, &len);
-    if(!s || (c = readc(s, len, &bytes)) < 0)
+    off = charoffset(args[0], idx.num > 0
+                     ? (idx.num < len ? (int)idx.num : len) : 0);
+    if(off >= 0)
+        c = readc((unsigned char*)naiStr_bytes(args[0]) + off, len - off,
+                  &bytes);
+    if(c < 0)
         naRuntimeError(ctx, "utf8 encoding error in utf8.strc");
     return naNum(c);
 }
@@ -105,39 +356,53 @@ static naRef f_strc(naContext ctx, naRef me, int argc, naRef* args)
 static naRef f_substr(naContext c, naRef me, int argc, naRef* args)
 {
     naRef start, end;
-    int len;
-    unsigned char *s, *s2;
+    int len, first, off, off2, n;
     end = argc > 2 ? naNumValue(args[2]) : naNil();
     if((argc < 2 || !naIsString(args[0]) || naIsNil(start=naNumValue(args[1])))
        || (argc > 2 && naIsNil(end)))
         naRuntimeError(c, "bad/missing argument to utf8.substr");
     len = naStr_len(args[0]);
-    if(!(s = nthchar((void*)naStr_data(args[0]), (int)start.num, &len)))
+    // No string has more characters than bytes, so clamping to the
+    // length changes nothing but overflow
+    first = start.num > 0 ? (start.num < len ? (int)start.num : len) : 0;
+    if((off = charoffset(args[0], first)) < 0)
         naRuntimeError(c, "start index overrun in utf8.substr");
-    if(!naIsNil(end)) {
-        if(!(s2 = nthchar(s, (int)end.num, &len)))
+    off2 = len;
+    if(!naIsNil(end) && off < len) {
+        n = end.num > 0 ? (end.num < len - off ? (int)end.num : len - off) : 0;
+        if((off2 = charoffset(args[0], first + n)) < 0)
             naRuntimeError(c, "end index overrun in utf8.substr");
-        len = (int)(s2-s);
     }
-    return naStr_fromdata(naNewString(c), (void*)s, len);
+    return naStr_substr(naNewString(c), args[0], off, off2 - off);
 }
 
 static naRef f_validate(naContext c, naRef me, int argc, naRef* args)
 {
     naRef result, unkc=naNil();
     int len, len2, lenout=0, n;
-    unsigned char *s, *s2, *buf;
+    const unsigned char* s;
+    unsigned char *s2, *buf;
     if(argc < 1 || !naIsString(args[0]) ||
        (argc > 1 && naIsNil(unkc=naNumValue(args[1]))))
         naRuntimeError(c, "bad/missing argument to utf8.strc");
     if(naIsNil(unkc)) unkc = naNum('?');
     len = naStr_len(args[0]);
-    s = (void*)naStr_data(args[0]);
+    s = naiStr_bytes(args[0]);
+    if(quickvalid(s, len))
+        return naStr_substr(naNewString(c), args[0], 0, len);
     len2 = 6*len; // max for ridiculous unkc values
     s2 = buf = naAlloc(len2);
     while(len > 0) {
-        int c = readc(s, len, &n);
+        int c = readc((unsigned char*)s, len, &n);
         if(c < 0) { c = (int)unkc.num; n = 1; }
+        else if(c < 0x80) {
+            // Copy runs of ASCII in one go
+            n = asciirun(s, len);
+            memcpy(s2, s, n);
+            s += n; len -= n;
+            s2 += n; len2 -= n; lenout += n;
+            continue;
+        }
         s += n; len -= n;
         n = writec(c, s2, len2);
         s2 += n; len2 -= n; lenout += n;
@@ -25,4 +25,108 @@ inline static int pow2(int n) {
     return 1 << n;
 }
 
+/*
+ * SSE2 is part of the x86_64 baseline, so it can be used without any
+ * runtime CPU detection.  Code using it must keep a portable scalar
+ * fallback for other architectures.
+ */
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+# define NASAL_SSE2
+# include <emmintrin.h>
+#endif
+
+#if defined(_MSC_VER)
+# include <intrin.h>
+#endif
+
+/*
+ * AVX and AVX2 are not part of the x86_64 baseline, but GCC and Clang
+ * can build single functions for them (NASAL_AVX_TARGET,
+ * NASAL_AVX2_TARGET) and check for them at runtime with naHasAVX() and
+ * naHasAVX2(), so a generic build can still pick AVX code.
+ */
+#if defined(NASAL_SSE2) && defined(__GNUC__) && \
+    (defined(__x86_64__) || defined(__i386__))
+# define NASAL_AVX
+# define NASAL_AVX_TARGET __attribute__((target("avx")))
+# define NASAL_AVX2_TARGET __attribute__((target("avx2")))
+# include <immintrin.h>
+inline static int naHasAVX(void) {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx");
+}
+inline static int naHasAVX2(void) {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+#endif
+
+#if defined(__SANITIZE_THREAD__)
+# define NASAL_TSAN
+#elif defined(__has_feature)
+# if __has_feature(thread_sanitizer)
+#  define NASAL_TSAN
+# endif
+#endif
+
+/*
+ * Memory ordering for data that other threads read without taking a
+ * lock.  A release store makes everything the thread wrote before it
+ * visible to any thread whose acquire load sees the stored value; the
+ * relaxed forms are plain (but untorn) accesses to racing data.  See
+ * the notes on concurrent readers in hash.c.  naCompareSwap() stores v
+ * if *p equals old, else loads *p into old, and returns whether it
+ * stored.  The fallback is plain accesses, which x86 orders well
+ * enough for this (but which makes naCompareSwap() racy).
+ */
+#if defined(__GNUC__)
+# define naLoadAcquire(p)     __atomic_load_n((p), __ATOMIC_ACQUIRE)
+# define naStoreRelease(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+# define naLoadRelaxed(p)     __atomic_load_n((p), __ATOMIC_RELAXED)
+# define naStoreRelaxed(p, v) __atomic_store_n((p), (v), __ATOMIC_RELAXED)
+# define naFenceAcquire()     __atomic_thread_fence(__ATOMIC_ACQUIRE)
+# define naCompareSwap(p, old, v) \
+    __atomic_compare_exchange_n((p), &(old), (v), 0, \
+                                __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)
+#else
+# define naLoadAcquire(p)     (*(p))
+# define naStoreRelease(p, v) (*(p) = (v))
+# define naLoadRelaxed(p)     (*(p))
+# define naStoreRelaxed(p, v) (*(p) = (v))
+# define naFenceAcquire()     ((void)0)
+# define naCompareSwap(p, old, v) \
+    (*(p) == (old) ? (*(p) = (v), 1) : ((old) = *(p), 0))
+#endif
+
+/**
+ * @brief Returns the index of the lowest set bit in a (non-zero!) mask.
+ *
+ * Used to walk the match bitmasks produced by the SIMD group probes.
+ */
+inline static int ctz32(unsigned int m) {
+#if defined(__GNUC__)
+    return __builtin_ctz(m);
+#elif defined(_MSC_VER)
+    unsigned long i;
+    _BitScanForward(&i, m);
+    return (int)i;
+#else
+    int i = 0;
+    while(!(m & 1)) { m >>= 1; i++; }
+    return i;
+#endif
+}
+
+// Returns the number of set bits in a mask
+inline static int popcount32(unsigned int m) {
+#if defined(__GNUC__)
+    return __builtin_popcount(m);
+#else
+    int n = 0;
+    for(; m; m &= m - 1) n++;
+    return n;
+#endif
+}
+
 #endif
@@ -1,30 +1,82 @@
 #include "data.h"
 #include "nasal.h"
 #include "simgear/nasal/naref.h"
+#include "util.h"
 
 #include <string.h>
 
-static struct VecRec* newvecrec(struct VecRec* old)
+// Capacities at or below this are never shrunk
+#define MINSHRINK 16
+
+// Slices shorter than this are copied rather than shared
+#define MINSHARE 32
+
+static struct VecRec* newrec(int alloced, int front)
 {
-    int i, oldsz = old ? old->size : 0, newsz = 1 + ((oldsz*3)>>1);
-    struct VecRec* vr = naAlloc(sizeof(struct VecRec) + sizeof(naRef) * newsz);
-    if(oldsz > newsz) oldsz = newsz; // race protection
-    vr->alloced = newsz;
+    struct VecRec* vr = naAlloc(sizeof(struct VecRec) + sizeof(naRef) * alloced);
+    vr->alloced = alloced;
+    vr->size = 0;
+    vr->array = vr->store + front;
+    vr->owner = naNil();
+    return vr;
+}
+
+// Whether the elements must be copied before writing
+#define SHARED(r) (!IS_NIL((r)->owner))
+
+// Shared storage (as opposed to a view record, or a private one) is
+// freed by its owner, not by the vectors using it.
+static int ownedby(struct VecRec* r, struct naVec* v)
+{
+    return SHARED(r) && r->alloced && PTR(r->owner).vec != v;
+}
+
+// Installs a new record, disposing of the old one
+static void setrec(struct naVec* v, struct VecRec* vr)
+{
+    if(v->rec && ownedby(v->rec, v))
+        naStoreRelease((void**)&v->rec, vr);
+    else
+        naGC_swapfree((void*)&(v->rec), vr);
+}
+
+// Copies the live elements into a record with room for half as many
+// again.  With front set, the spare room goes before the elements
+// (for prepending), otherwise after them.
+static struct VecRec* newvecrec(struct VecRec* old, int front)
+{
+    int oldsz = old ? old->size : 0, newsz = 1 + ((oldsz*3)>>1);
+    struct VecRec* vr = newrec(newsz, front ? newsz - oldsz : 0);
+    if(oldsz) memcpy(vr->array, old->array, sizeof(naRef) * oldsz);
     vr->size = oldsz;
-    for(i=0; i<oldsz; i++)
-        vr->array[i] = old->array[i];
     return vr;
 }
 
-static void resize(struct naVec* v)
+static void resize(struct naVec* v, int front)
+{
+    setrec(v, newvecrec(v->rec, front));
+}
+
+// Gives v a private copy of shared elements, before writing them
+static void unshare(struct naVec* v)
 {
-    struct VecRec* vr = newvecrec(v->rec);
-    naGC_swapfree((void*)&(v->rec), vr);
+    if(v->rec && SHARED(v->rec))
+        resize(v, 0);
+}
+
+// Shrinks only once three quarters of the storage is unused, so a
+// vector hovering around a size doesn't reallocate on every push/pop.
+static void shrink(struct naVec* v)
+{
+    struct VecRec* r = v->rec;
+    if(r->alloced > MINSHRINK && r->size < (r->alloced >> 2))
+        resize(v, 0);
 }
 
 void naVec_gcclean(struct naVec* v)
 {
-    naFree(v->rec);
+    if(v->rec && !ownedby(v->rec, v))
+        naFree(v->rec);
     v->rec = 0;
 }
 
@@ -45,6 +97,10 @@ void naVec_set(naRef vec, int i, naRef o)
     if(IS_VEC(vec)) {
         struct VecRec* r = PTR(vec).vec->rec;
         if(r && i >= r->size) return;
+        if(SHARED(r)) {
+            unshare(PTR(vec).vec);
+            r = PTR(vec).vec->rec;
+        }
         r->array[i] = o;
     }
 }
@@ -62,8 +118,8 @@ int naVec_append(naRef vec, naRef o)
 {
     if(IS_VEC(vec)) {
         struct VecRec* r = PTR(vec).vec->rec;
-        while(!r || r->size >= r->alloced) {
-            resize(PTR(vec).vec);
+        while(!r || SHARED(r) || r->array + r->size >= r->store + r->alloced) {
+            resize(PTR(vec).vec, 0);
             r = PTR(vec).vec->rec;
         }
         r->array[r->size] = o;
@@ -72,6 +128,20 @@ int naVec_append(naRef vec, naRef o)
     return 0;
 }
 
+void naVec_prepend(naRef vec, naRef o)
+{
+    if(IS_VEC(vec)) {
+        struct VecRec* r = PTR(vec).vec->rec;
+        while(!r || SHARED(r) || r->array == r->store) {
+            resize(PTR(vec).vec, 1);
+            r = PTR(vec).vec->rec;
+        }
+        r->array[-1] = o;
+        r->array--;
+        r->size++;
+    }
+}
+
 //------------------------------------------------------------------------------
 void naVec_setsize(naContext c, naRef vec, int sz)
 {
@@ -79,14 +149,15 @@ void naVec_setsize(naContext c, naRef vec, int sz)
         naRuntimeError(c, "size cannot be negative");
     else
     {
-        int i;
+        int i, n;
         struct VecRec* v = PTR(vec).vec->rec;
-        struct VecRec* nv = naAlloc(sizeof(struct VecRec) + sizeof(naRef) * sz);
+        struct VecRec* nv = newrec(sz, 0);
         nv->size = sz;
-        nv->alloced = sz;
-        for(i=0; i<sz; i++)
-            nv->array[i] = (v && i < v->size) ? v->array[i] : naNil();
-        naGC_swapfree((void*)&(PTR(vec).vec->rec), nv);
+        n = v && v->size < sz ? v->size : (v ? sz : 0);
+        if(n) memcpy(nv->array, v->array, n * sizeof(naRef));
+        for(i=n; i<sz; i++)
+            nv->array[i] = naNil();
+        setrec(PTR(vec).vec, nv);
     }
 }
 
@@ -94,16 +165,13 @@ void naVec_setsize(naContext c, naRef vec, int sz)
 naRef naVec_removefirst(naRef vec)
 {
     naRef o;
-    int i;
     if(IS_VEC(vec)) {
         struct VecRec* v = PTR(vec).vec->rec;
         if(!v || v->size == 0) return naNil();
         o = v->array[0];
-        for (i=1; i<v->size; i++)
-            v->array[i-1] = v->array[i];
         v->size--;
-        if(v->size < (v->alloced >> 1))
-            resize(PTR(vec).vec);
+        v->array++;
+        shrink(PTR(vec).vec);
         return o;
     }
     return naNil();
@@ -118,8 +186,7 @@ naRef naVec_removelast(naRef vec)
         if(!v || v->size == 0) return naNil();
         o = v->array[v->size - 1];
         v->size--;
-        if(v->size < (v->alloced >> 1))
-            resize(PTR(vec).vec);
+        shrink(PTR(vec).vec);
         return o;
     }
     return naNil();
@@ -134,15 +201,72 @@ naRef naVec_remove(naRef vec, int index)
         if (!v || v->size == 0) return naNil();
         if ((index < 0) || (index >= v->size - 1)) return naNil();
 
+        if (SHARED(v)) {
+            unshare(PTR(vec).vec);
+            v = PTR(vec).vec->rec;
+        }
         o = v->array[index];
-        // must use memmove since this range overlaps itself
-        memmove((void*)&v->array[index],
-                (void*)&v->array[index + 1], (v->size - (index + 1)) * sizeof(naRef));
+        // Close the gap from whichever end has fewer elements to move.
+        // Must use memmove since these ranges overlap themselves.
+        if (index < (v->size >> 1)) {
+            memmove((void*)&v->array[1],
+                    (void*)&v->array[0], index * sizeof(naRef));
+            v->array++;
+        } else {
+            memmove((void*)&v->array[index],
+                    (void*)&v->array[index + 1], (v->size - (index + 1)) * sizeof(naRef));
+        }
 
         v->size--;
-        if (v->size < (v->alloced >> 1))
-            resize(PTR(vec).vec);
+        shrink(PTR(vec).vec);
         return o;
     }
     return naNil();
 }
+
+//------------------------------------------------------------------------------
+// Hands the storage of src over to a hidden owner vector, if that
+// hasn't happened yet, and returns the owner.
+static naRef shareowner(naContext c, naRef src)
+{
+    naRef owner;
+    struct VecRec* r = PTR(src).vec->rec;
+    if(SHARED(r)) return r->owner;
+    owner = naNewVector(c);
+    PTR(owner).vec->rec = r;
+    r->owner = owner;
+    return owner;
+}
+
+// Appends src[start..start+len) to dst.  With share set and dst empty,
+// dst becomes a copy-on-write view of the elements instead.  The range
+// must be valid.  Like other vector mutations, not safe while another
+// thread resizes src.
+void naiVec_appendrange(naContext c, naRef dst, naRef src, int start, int len,
+                        int share)
+{
+    struct naVec* d = PTR(dst).vec;
+    struct VecRec *r = d->rec, *sr;
+    if(len <= 0) return;
+    if(share && len >= MINSHARE && (!r || !r->size)) {
+        naRef owner = shareowner(c, src);
+        sr = PTR(src).vec->rec;
+        r = newrec(0, 0);
+        r->array = sr->array + start;
+        r->size = len;
+        r->owner = owner;
+        setrec(d, r);
+        return;
+    }
+    if(!r || SHARED(r) || r->array + r->size + len > r->store + r->alloced) {
+        int sz = r ? r->size : 0, cap = 1 + ((sz*3)>>1);
+        struct VecRec* nr = newrec(cap > sz + len ? cap : sz + len, 0);
+        if(sz) memcpy(nr->array, r->array, sz * sizeof(naRef));
+        nr->size = sz;
+        setrec(d, nr);
+        r = nr;
+    }
+    sr = PTR(src).vec->rec;
+    memcpy(r->array + r->size, sr->array + start, len * sizeof(naRef));
+    r->size += len;
+}